@@ -53,6 +53,117 @@ mife_test_sigma () {
     $prog mife test --smart --sigma --mmap $2 $1
 }
 
+# Obfuscates a copy of |1| with LZ and checks batch evaluation, output
+# selection, the constants file, serving, checkpoint resume and that a seed
+# gives the same obfuscation whatever the number of threads
+obf_io_test () {
+    echo ""
+    echo "***"
+    echo "***"
+    echo "*** OBF I/O $1 $2"
+    echo "***"
+    echo "***"
+    echo ""
+    local dir circuit opts
+    dir=$(mktemp -d)
+    circuit="$dir/$(basename "$1")"
+    opts="--mmap $2 --scheme LZ"
+    cp "$1" "$circuit"
+    grep '^:test' "$1" | awk '{ print $2 }' > "$dir/batch"
+    grep '^:test' "$1" | awk '{ print "result: " $3 }' > "$dir/expected"
+    grep '^:test' "$1" | awk '{ print "result: " substr($3, 1, 1) }' > "$dir/expected0"
+
+    $prog obf obfuscate --smart $opts --seed mio --nthreads 1 "$circuit"
+    cp "$circuit.obf" "$dir/obf.1"
+    cp "$circuit.obf.consts" "$dir/consts.1"
+    $prog obf obfuscate --smart $opts --seed mio --nthreads 4 "$circuit"
+    cmp "$circuit.obf" "$dir/obf.1"
+
+    # Evaluating twice reuses the constants file
+    for _ in 1 2; do
+        $prog obf evaluate $opts --batch "$dir/batch" "$circuit" > "$dir/got"
+        diff "$dir/expected" "$dir/got"
+    done
+    $prog obf evaluate $opts --outputs 0 --batch "$dir/batch" "$circuit" > "$dir/got"
+    diff "$dir/expected0" "$dir/got"
+    $prog obf serve $opts "$circuit" < "$dir/batch" > "$dir/got"
+    diff "$dir/expected" "$dir/got"
+
+    { cat "$dir/batch"; head -1 "$dir/batch" | tr 0 x; } > "$dir/malformed"
+    if $prog obf evaluate $opts --batch "$dir/malformed" "$circuit"; then
+        echo "error: malformed batch accepted"
+        exit 1
+    fi
+
+    # A constants file left over from another obfuscation is rejected
+    $prog obf obfuscate --smart $opts --seed other "$circuit"
+    cp "$dir/consts.1" "$circuit.obf.consts"
+    if $prog obf evaluate $opts --batch "$dir/batch" "$circuit"; then
+        echo "error: stale constants accepted"
+        exit 1
+    fi
+
+    # Resuming from a journal cut short gives the same obfuscation
+    $prog obf obfuscate --smart $opts --seed mio --checkpoint "$dir/ck" "$circuit"
+    truncate -s $(( $(stat -c %s "$dir/ck/journal") / 2 )) "$dir/ck/journal"
+    rm -f "$circuit.obf" "$circuit.obf.consts"
+    $prog obf obfuscate --smart $opts --seed mio --checkpoint "$dir/ck" "$circuit"
+    cmp "$circuit.obf" "$dir/obf.1"
+    $prog obf evaluate $opts --batch "$dir/batch" "$circuit" > "$dir/got"
+    diff "$dir/expected" "$dir/got"
+
+    rm -rf "$dir"
+}
+
+# Checks batch evaluation of an obfuscation of |1| under scheme |3|, which
+# shares gates across the inputs where the scheme supports it
+obf_batch_test () {
+    echo ""
+    echo "***"
+    echo "***"
+    echo "*** OBF BATCH $1 $2 $3"
+    echo "***"
+    echo "***"
+    echo ""
+    local dir circuit opts
+    dir=$(mktemp -d)
+    circuit="$dir/$(basename "$1")"
+    opts="--mmap $2 --scheme $3"
+    cp "$1" "$circuit"
+    grep '^:test' "$1" | awk '{ print $2 }' > "$dir/batch"
+    grep '^:test' "$1" | awk '{ print "result: " $3 }' > "$dir/expected"
+
+    $prog obf obfuscate --smart $opts "$circuit"
+    $prog obf evaluate $opts --batch "$dir/batch" "$circuit" > "$dir/got"
+    diff "$dir/expected" "$dir/got"
+
+    rm -rf "$dir"
+}
+
+# Checks that a seed gives the same obfuscation of |1| under scheme |3|
+# whatever the number of threads
+obf_seed_test () {
+    echo ""
+    echo "***"
+    echo "***"
+    echo "*** OBF SEED $1 $2 $3"
+    echo "***"
+    echo "***"
+    echo ""
+    local dir circuit opts
+    dir=$(mktemp -d)
+    circuit="$dir/$(basename "$1")"
+    opts="--mmap $2 --scheme $3"
+    cp "$1" "$circuit"
+
+    $prog obf obfuscate --smart $opts --seed mio --nthreads 1 "$circuit"
+    cp "$circuit.obf" "$dir/obf.1"
+    $prog obf obfuscate --smart $opts --seed mio --nthreads 4 "$circuit"
+    cmp "$circuit.obf" "$dir/obf.1"
+
+    rm -rf "$dir"
+}
+
 for circuit in $circuits/*.acirc; do
     mife_test "$circuit" DUMMY
 done
@@ -70,3 +181,9 @@ for circuit in $circuits/sigma/*.acirc; do
     obf_test_sigma "$circuit" DUMMY LZ
     obf_test_sigma "$circuit" DUMMY MIFE
 done
+
+obf_io_test "$circuits/comp2.dsl.acirc" DUMMY
+obf_batch_test "$circuits/comp2.dsl.acirc" DUMMY CMR
+obf_batch_test "$circuits/comp2.dsl.acirc" DUMMY POLYLOG
+obf_seed_test "$circuits/comp2.dsl.acirc" DUMMY CMR
+obf_seed_test "$circuits/comp2.dsl.acirc" DUMMY POLYLOG
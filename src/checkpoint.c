@@ -0,0 +1,267 @@
+#include "checkpoint.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct checkpoint {
+    char *dir;
+    const encoding_vtable *vt;
+    size_t nentries;
+    bool *done;
+    long *offset;               /* [nentries] where a done entry's bytes start */
+    size_t *length;             /* [nentries] and how many there are */
+    size_t ndone;
+    FILE *journal;
+    FILE *replay;               /* the journal as replayed, for restoring */
+};
+
+static char *
+_path(const checkpoint *ck, const char *name, const char *suffix)
+{
+    const size_t length = snprintf(NULL, 0, "%s/%s%s", ck->dir, name, suffix) + 1;
+    char *path = my_calloc(length, sizeof path[0]);
+    snprintf(path, length, "%s/%s%s", ck->dir, name, suffix);
+    return path;
+}
+
+checkpoint *
+checkpoint_new(const char *dir, const encoding_vtable *vt, size_t nentries)
+{
+    checkpoint *ck;
+
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "%s: unable to create checkpoint directory '%s'\n",
+                errorstr, dir);
+        return NULL;
+    }
+    ck = my_calloc(1, sizeof ck[0]);
+    ck->dir = strdup(dir);
+    ck->vt = vt;
+    ck->nentries = nentries;
+    ck->done = my_calloc(nentries, sizeof ck->done[0]);
+    ck->offset = my_calloc(nentries, sizeof ck->offset[0]);
+    ck->length = my_calloc(nentries, sizeof ck->length[0]);
+    return ck;
+}
+
+void
+checkpoint_free(checkpoint *ck)
+{
+    if (ck == NULL)
+        return;
+    if (ck->journal)
+        fclose(ck->journal);
+    if (ck->replay)
+        fclose(ck->replay);
+    free(ck->done);
+    free(ck->offset);
+    free(ck->length);
+    free(ck->dir);
+    free(ck);
+}
+
+FILE *
+checkpoint_state_fopen(const checkpoint *ck, const char *name)
+{
+    char *path = _path(ck, name, "");
+    FILE *fp = fopen(path, "r");
+    free(path);
+    return fp;
+}
+
+FILE *
+checkpoint_state_create(const checkpoint *ck, const char *name)
+{
+    char *path = _path(ck, name, ".tmp");
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        fprintf(stderr, "%s: unable to open '%s' for writing\n", errorstr, path);
+    free(path);
+    return fp;
+}
+
+int
+checkpoint_state_commit(const checkpoint *ck, const char *name, FILE *fp)
+{
+    char *tmp = _path(ck, name, ".tmp");
+    char *path = _path(ck, name, "");
+    int ret = ERR;
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) == -1) {
+        fclose(fp);
+        goto cleanup;
+    }
+    if (fclose(fp) != 0)
+        goto cleanup;
+    if (rename(tmp, path) == -1)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    if (ret == ERR)
+        fprintf(stderr, "%s: unable to save checkpoint '%s'\n", errorstr, path);
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+/* FNV-1a over a record's index, length and contents */
+static uint64_t
+_checksum(size_t idx, size_t length, const void *buf)
+{
+    const size_t hdr[2] = { idx, length };
+    uint64_t h = 0xcbf29ce484222325UL;
+    const unsigned char *p = (const unsigned char *) hdr;
+    for (size_t i = 0; i < sizeof hdr; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3UL;
+    }
+    p = buf;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+static int
+_raw_write(const void *x, FILE *fp, void *args)
+{
+    const size_t length = *(const size_t *) args;
+    return fwrite(x, 1, length, fp) == length ? OK : ERR;
+}
+
+int
+checkpoint_replay(checkpoint *ck)
+{
+    char *path = _path(ck, "journal", "");
+    unsigned char *buf = NULL, *tmp;
+    long good = 0;
+    struct stat st;
+    FILE *fp;
+    int ret = ERR;
+
+    if ((fp = fopen(path, "r"))) {
+        if (fstat(fileno(fp), &st) == -1) {
+            fclose(fp);
+            goto cleanup;
+        }
+        while (true) {
+            size_t idx, length, sum;
+            long offset;
+            if (size_t_fread(&idx, fp) == ERR || size_t_fread(&length, fp) == ERR)
+                break;
+            if (idx >= ck->nentries) {
+                fprintf(stderr, "%s: checkpoint journal does not match circuit\n",
+                        errorstr);
+                fclose(fp);
+                goto cleanup;
+            }
+            /* A torn length may be anything, but the encoding it describes
+             * cannot be longer than what is left of the journal */
+            if (length > (size_t) st.st_size - ftell(fp))
+                break;
+            if ((tmp = my_realloc(buf, length ? length : 1)) == NULL) {
+                fclose(fp);
+                goto cleanup;
+            }
+            buf = tmp;
+            offset = ftell(fp);
+            if (fread(buf, 1, length, fp) != length
+                || size_t_fread(&sum, fp) == ERR
+                || sum != _checksum(idx, length, buf))
+                break;
+            if (!ck->done[idx]) {
+                ck->offset[idx] = offset;
+                ck->length[idx] = length;
+                ck->done[idx] = true;
+                ck->ndone++;
+            }
+            good = ftell(fp);
+        }
+        fclose(fp);
+        /* Drop any record cut short when the previous run died */
+        if (truncate(path, good) == -1)
+            goto cleanup;
+        if (ck->ndone && (ck->replay = fopen(path, "r")) == NULL)
+            goto cleanup;
+    }
+    if ((ck->journal = fopen(path, "a")) == NULL) {
+        fprintf(stderr, "%s: unable to open '%s' for writing\n", errorstr, path);
+        goto cleanup;
+    }
+    ret = OK;
+cleanup:
+    free(buf);
+    free(path);
+    return ret;
+}
+
+int
+checkpoint_restore(container_writer *w, size_t idx, void *vck)
+{
+    checkpoint *const ck = vck;
+    unsigned char *buf;
+    int ret = ERR;
+
+    if (!ck->done[idx])
+        return 0;
+    buf = my_calloc(ck->length[idx] ? ck->length[idx] : 1, sizeof buf[0]);
+    if (fseek(ck->replay, ck->offset[idx], SEEK_SET) == -1
+        || fread(buf, 1, ck->length[idx], ck->replay) != ck->length[idx]
+        || container_writer_add(w, idx, buf, _raw_write, &ck->length[idx]) == ERR)
+        goto cleanup;
+    ret = 1;
+cleanup:
+    if (ret == ERR)
+        fprintf(stderr, "%s: unable to restore encoding %lu from checkpoint\n",
+                errorstr, idx);
+    free(buf);
+    return ret;
+}
+
+size_t
+checkpoint_ndone(const checkpoint *ck)
+{
+    return ck->ndone;
+}
+
+bool
+checkpoint_done(const checkpoint *ck, size_t idx)
+{
+    return ck->done[idx];
+}
+
+int
+checkpoint_add_encoding(size_t idx, const encoding *enc, void *vck)
+{
+    checkpoint *const ck = vck;
+    char *buf = NULL;
+    size_t length = 0;
+    FILE *fp;
+    int ret = ERR;
+
+    if ((fp = open_memstream(&buf, &length)) == NULL)
+        return ERR;
+    if (encoding_fwrite(ck->vt, enc, fp) == ERR) {
+        fclose(fp);
+        goto cleanup;
+    }
+    fclose(fp);
+    if (size_t_fwrite(idx, ck->journal) == ERR
+        || size_t_fwrite(length, ck->journal) == ERR
+        || fwrite(buf, 1, length, ck->journal) != length
+        || size_t_fwrite(_checksum(idx, length, buf), ck->journal) == ERR
+        || fflush(ck->journal) != 0
+        || fsync(fileno(ck->journal)) == -1)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    if (ret == ERR)
+        fprintf(stderr, "%s: unable to journal encoding %lu\n", errorstr, idx);
+    free(buf);
+    return ret;
+}
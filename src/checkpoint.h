@@ -0,0 +1,46 @@
+#pragma once
+
+#include "container.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Checkpoint directory for resuming an interrupted obfuscation.  It holds
+ * named state files, each replaced atomically when committed, and a journal
+ * of the container entries written so far:
+ *
+ *   journal    (index, length, serialized entry, checksum) per completed
+ *              encoding, synced to disk before the next one is written
+ *
+ * A record cut short by a crash, or whose checksum does not match, is
+ * discarded along with everything after it when the journal is replayed.
+ * Entries are journaled in the order the container stream writes them, that
+ * is index order, so a resumed run writes the same file as one that was never
+ * interrupted.
+ */
+
+typedef struct checkpoint checkpoint;
+
+/* Opens (creating if needed) checkpoint directory |dir| for an obfuscation
+ * with |nentries| container entries, each an encoding */
+checkpoint * checkpoint_new(const char *dir, const encoding_vtable *vt,
+                            size_t nentries);
+void checkpoint_free(checkpoint *ck);
+
+/* Returns NULL if state file |name| has not been committed yet */
+FILE * checkpoint_state_fopen(const checkpoint *ck, const char *name);
+/* Returns a temporary file that becomes |name| on checkpoint_state_commit */
+FILE * checkpoint_state_create(const checkpoint *ck, const char *name);
+int checkpoint_state_commit(const checkpoint *ck, const char *name, FILE *fp);
+
+/* Reads the journal, marking every entry in it as done */
+int checkpoint_replay(checkpoint *ck);
+/* Copies journaled entry |idx| into |w| if it is done; a
+ * container_restore_f, so that the stream writes it in its place */
+int checkpoint_restore(container_writer *w, size_t idx, void *vck);
+size_t checkpoint_ndone(const checkpoint *ck);
+bool checkpoint_done(const checkpoint *ck, size_t idx);
+/* Appends entry |idx| to the journal; a container_stream_f, so that the
+ * stream journals each encoding as it writes it */
+int checkpoint_add_encoding(size_t idx, const encoding *enc, void *vck);
@@ -2,6 +2,8 @@
 #include "util.h"
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 
 int
 circ_params_init(circ_params_t *cp, size_t n, acirc_t *circ)
@@ -10,6 +12,8 @@ circ_params_init(circ_params_t *cp, size_t n, acirc_t *circ)
     cp->circ = circ;
     cp->ds = my_calloc(n, sizeof cp->ds[0]);
     cp->qs = my_calloc(n, sizeof cp->ds[0]);
+    cp->outputs = NULL;
+    cp->cone = NULL;
     return OK;
 }
 
@@ -20,6 +24,10 @@ circ_params_clear(circ_params_t *cp)
         free(cp->ds);
     if (cp->qs)
         free(cp->qs);
+    if (cp->outputs)
+        free(cp->outputs);
+    if (cp->cone)
+        free(cp->cone);
 }
 
 int
@@ -47,6 +55,8 @@ circ_params_fread(circ_params_t *const cp, acirc_t *circ, FILE *fp)
     for (size_t i = 0; i < acirc_nsymbols(circ); ++i)
         if (size_t_fread(&cp->qs[i], fp) == ERR) goto error;
     cp->circ = circ;
+    cp->outputs = NULL;
+    cp->cone = NULL;
     return OK;
 error:
     if (cp->ds)
@@ -122,3 +132,156 @@ circ_params_print(const circ_params_t *cp)
     fprintf(stderr, "* degree: ...... %lu\n", acirc_max_degree(cp->circ));
     fprintf(stderr, "* binary: ...... %s\n", acirc_is_binary(cp->circ) ? "✓" : "✗");
 }
+
+
+/* Records each gate's operands in one cheap traversal */
+
+static void *
+operands_input_f(size_t ref, size_t i, void *args_)
+{
+    circ_operands_t *args = args_;
+    args->inputs[ref] = i;
+    args->constant[ref] = false;
+    return (void *) 1;
+}
+
+static void *
+operands_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) i; (void) val;
+    circ_operands_t *args = args_;
+    args->constant[ref] = true;
+    return (void *) 1;
+}
+
+static void *
+operands_eval_f(size_t ref, acirc_op op, size_t xref, const void *x, size_t yref,
+                const void *y, void *args_)
+{
+    (void) op; (void) x; (void) y;
+    circ_operands_t *args = args_;
+    args->xrefs[ref] = xref;
+    args->yrefs[ref] = yref;
+    args->constant[ref] = args->constant[xref] && args->constant[yref];
+    return (void *) 1;
+}
+
+static void *
+operands_output_f(size_t ref, size_t o, void *x, void *args_)
+{
+    (void) x;
+    circ_operands_t *args = args_;
+    args->outrefs[o] = ref;
+    return NULL;
+}
+
+static void
+operands_free_f(void *x, void *args_)
+{
+    (void) x; (void) args_;
+}
+
+void
+circ_params_operands(const circ_params_t *cp, circ_operands_t *args)
+{
+    const size_t nrefs = acirc_nrefs(cp->circ);
+
+    args->xrefs = my_calloc(nrefs, sizeof args->xrefs[0]);
+    args->yrefs = my_calloc(nrefs, sizeof args->yrefs[0]);
+    args->inputs = my_calloc(nrefs, sizeof args->inputs[0]);
+    args->outrefs = my_calloc(acirc_noutputs(cp->circ), sizeof args->outrefs[0]);
+    args->constant = my_calloc(nrefs, sizeof args->constant[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref)
+        args->xrefs[ref] = args->yrefs[ref] = args->inputs[ref] = SIZE_MAX;
+    /* Operands are visited first, which a single thread guarantees */
+    free(acirc_traverse(cp->circ, operands_input_f, operands_const_f,
+                        operands_eval_f, operands_output_f, operands_free_f,
+                        args, 1));
+}
+
+void
+circ_operands_clear(circ_operands_t *args)
+{
+    free(args->xrefs);
+    free(args->yrefs);
+    free(args->inputs);
+    free(args->outrefs);
+    free(args->constant);
+}
+
+int
+circ_params_select_outputs(circ_params_t *cp, const size_t *os, size_t n)
+{
+    const size_t nrefs = acirc_nrefs(cp->circ);
+    const size_t noutputs = acirc_noutputs(cp->circ);
+    circ_operands_t args;
+    size_t *stack, nstack = 0;
+    bool *outputs, *cone;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (os[i] >= noutputs) {
+            fprintf(stderr, "%s: no output %lu (circuit has %lu)\n",
+                    errorstr, os[i], noutputs);
+            return ERR;
+        }
+    }
+    circ_params_operands(cp, &args);
+
+    outputs = my_calloc(noutputs, sizeof outputs[0]);
+    cone = my_calloc(nrefs, sizeof cone[0]);
+    stack = my_calloc(nrefs, sizeof stack[0]);
+    for (size_t i = 0; i < n; ++i) {
+        outputs[os[i]] = true;
+        if (!cone[args.outrefs[os[i]]]) {
+            cone[args.outrefs[os[i]]] = true;
+            stack[nstack++] = args.outrefs[os[i]];
+        }
+    }
+    while (nstack) {
+        const size_t ref = stack[--nstack];
+        const size_t operands[] = { args.xrefs[ref], args.yrefs[ref] };
+        for (size_t i = 0; i < 2; ++i) {
+            if (operands[i] != SIZE_MAX && !cone[operands[i]]) {
+                cone[operands[i]] = true;
+                stack[nstack++] = operands[i];
+            }
+        }
+    }
+    if (g_verbose) {
+        size_t count = 0;
+        for (size_t ref = 0; ref < nrefs; ++ref)
+            count += cone[ref];
+        fprintf(stderr, "Output cone: %lu of %lu refs for %lu of %lu outputs\n",
+                count, nrefs, n, noutputs);
+    }
+    free(stack);
+    circ_operands_clear(&args);
+    free(cp->outputs);
+    free(cp->cone);
+    cp->outputs = outputs;
+    cp->cone = cone;
+    return OK;
+}
+
+size_t
+circ_params_constants(const circ_params_t *cp, bool *constant, bool *needed)
+{
+    const size_t nrefs = acirc_nrefs(cp->circ);
+    circ_operands_t args;
+    size_t count = 0;
+
+    circ_params_operands(cp, &args);
+    memset(needed, '\0', nrefs * sizeof needed[0]);
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        constant[ref] = args.constant[ref] && args.xrefs[ref] != SIZE_MAX;
+        count += constant[ref];
+        if (!constant[ref] && args.xrefs[ref] != SIZE_MAX) {
+            needed[args.xrefs[ref]] = true;
+            needed[args.yrefs[ref]] = true;
+        }
+    }
+    for (size_t o = 0; o < acirc_noutputs(cp->circ); ++o)
+        needed[args.outrefs[o]] = true;
+    circ_operands_clear(&args);
+    return count;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <acirc.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 typedef struct {
@@ -8,8 +9,19 @@ typedef struct {
     size_t *ds;                 /* number of bits in each input string */
     size_t *qs;                 /* number of symbols associated with input string */
     acirc_t *circ;
+    bool *outputs;              /* if set, the outputs to evaluate */
+    bool *cone;                 /* if set, the refs those outputs depend on */
 } circ_params_t;
 
+/* The circuit's wiring, for analyses that walk it backwards */
+typedef struct {
+    size_t *xrefs;              /* [nrefs] operands, SIZE_MAX unless a gate */
+    size_t *yrefs;
+    size_t *inputs;             /* [nrefs] input index, SIZE_MAX unless an input */
+    size_t *outrefs;            /* [noutputs] */
+    bool *constant;             /* [nrefs] whether independent of the input */
+} circ_operands_t;
+
 int    circ_params_init(circ_params_t *cp, size_t n, acirc_t *circ);
 void   circ_params_clear(circ_params_t *cp);
 int    circ_params_fwrite(const circ_params_t *const cp, FILE *fp);
@@ -18,3 +30,25 @@ size_t circ_params_ninputs(const circ_params_t *cp);
 size_t circ_params_slot(const circ_params_t *cp, size_t pos);
 size_t circ_params_bit(const circ_params_t *cp, size_t pos);
 void   circ_params_print(const circ_params_t *cp);
+/* Restricts evaluation to outputs |os| and the gates in their fan-in cone */
+int    circ_params_select_outputs(circ_params_t *cp, const size_t *os, size_t n);
+/* Fills |ops| with the circuit's wiring; free with circ_operands_clear */
+void   circ_params_operands(const circ_params_t *cp, circ_operands_t *ops);
+void   circ_operands_clear(circ_operands_t *ops);
+/* Marks the gates whose value does not depend on the input, and which refs
+ * are read by an input-dependent gate or an output; returns the number of
+ * constant gates */
+size_t circ_params_constants(const circ_params_t *cp, bool *constant,
+                             bool *needed);
+
+static inline bool
+circ_params_needs_ref(const circ_params_t *cp, size_t ref)
+{
+    return cp->cone == NULL || cp->cone[ref];
+}
+
+static inline bool
+circ_params_needs_output(const circ_params_t *cp, size_t o)
+{
+    return cp->outputs == NULL || cp->outputs[o];
+}
@@ -0,0 +1,483 @@
+#include "container.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* "MIOCTNR1" */
+#define CONTAINER_MAGIC 0x31524e54434f494dUL
+
+typedef struct {
+    size_t offset;
+    size_t length;
+} toc_entry;
+
+struct container_writer {
+    FILE *fp;
+    long start;
+    size_t nentries;
+    toc_entry *toc;
+};
+
+struct container {
+    unsigned char *map;
+    size_t size;
+    size_t nentries;
+    const toc_entry *toc;
+};
+
+static int
+_pad(FILE *fp)
+{
+    static const unsigned char zeros[CONTAINER_ALIGN];
+    long pos;
+
+    if ((pos = ftell(fp)) < 0)
+        return ERR;
+    if (pos % CONTAINER_ALIGN) {
+        const size_t n = CONTAINER_ALIGN - pos % CONTAINER_ALIGN;
+        if (fwrite(zeros, 1, n, fp) != n)
+            return ERR;
+    }
+    return OK;
+}
+
+container_writer *
+container_writer_new(FILE *fp, size_t nentries)
+{
+    container_writer *w;
+
+    w = my_calloc(1, sizeof w[0]);
+    w->fp = fp;
+    w->nentries = nentries;
+    w->toc = my_calloc(nentries, sizeof w->toc[0]);
+    if ((w->start = ftell(fp)) < 0)
+        goto error;
+    if (size_t_fwrite(CONTAINER_MAGIC, fp) == ERR
+        || size_t_fwrite(nentries, fp) == ERR
+        || size_t_fwrite(0, fp) == ERR)
+        goto error;
+    return w;
+error:
+    fprintf(stderr, "%s: unable to write container header\n", errorstr);
+    free(w->toc);
+    free(w);
+    return NULL;
+}
+
+int
+container_writer_add(container_writer *w, size_t idx, const void *x,
+                     container_write_f write, void *args)
+{
+    long start, end;
+
+    if (idx >= w->nentries) {
+        fprintf(stderr, "%s: container entry %lu out of range (%lu)\n",
+                errorstr, idx, w->nentries);
+        return ERR;
+    }
+    if (w->toc[idx].length) {
+        fprintf(stderr, "%s: container entry %lu written twice\n", errorstr, idx);
+        return ERR;
+    }
+    if (_pad(w->fp) == ERR || (start = ftell(w->fp)) < 0)
+        return ERR;
+    if (write(x, w->fp, args) == ERR)
+        return ERR;
+    if ((end = ftell(w->fp)) < 0)
+        return ERR;
+    w->toc[idx].offset = start;
+    w->toc[idx].length = end - start;
+    return OK;
+}
+
+static int
+_encoding_write(const void *x, FILE *fp, void *args)
+{
+    return encoding_fwrite(args, x, fp);
+}
+
+static void *
+_encoding_read(FILE *fp, void *args)
+{
+    return encoding_fread(args, fp);
+}
+
+static void
+_encoding_free(void *x, void *args)
+{
+    encoding_free(args, x);
+}
+
+int
+container_writer_add_encoding(container_writer *w, size_t idx,
+                              const encoding_vtable *vt, const encoding *enc)
+{
+    return container_writer_add(w, idx, enc, _encoding_write, (void *) vt);
+}
+
+int
+container_writer_finish(container_writer *w)
+{
+    long toc, end;
+    int ret = ERR;
+
+    for (size_t i = 0; i < w->nentries; ++i) {
+        if (w->toc[i].length == 0) {
+            fprintf(stderr, "%s: container entry %lu never written\n", errorstr, i);
+            goto cleanup;
+        }
+    }
+    if (_pad(w->fp) == ERR || (toc = ftell(w->fp)) < 0)
+        goto cleanup;
+    if (fwrite(w->toc, sizeof w->toc[0], w->nentries, w->fp) != w->nentries)
+        goto cleanup;
+    if ((end = ftell(w->fp)) < 0)
+        goto cleanup;
+    if (fseek(w->fp, w->start + 2 * sizeof(size_t), SEEK_SET) == -1)
+        goto cleanup;
+    if (size_t_fwrite(toc, w->fp) == ERR)
+        goto cleanup;
+    if (fseek(w->fp, end, SEEK_SET) == -1)
+        goto cleanup;
+    ret = OK;
+cleanup:
+    if (ret == ERR)
+        fprintf(stderr, "%s: unable to finish container\n", errorstr);
+    container_writer_free(w);
+    return ret;
+}
+
+void
+container_writer_free(container_writer *w)
+{
+    if (w == NULL)
+        return;
+    free(w->toc);
+    free(w);
+}
+
+struct container_stream {
+    container_writer *w;
+    const encoding_vtable *vt;
+    encoding_pool *pool;
+    size_t window;
+    container_restore_f restore;
+    container_stream_f hook;
+    void *args;
+    size_t inflight;
+    encoding **ready;           /* [nentries] pushed, awaiting their turn */
+    size_t next;                /* the entry the writer waits for */
+    bool done;
+    int ret;                    /* atomic; once ERR nothing more is written */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t pushed;      /* signalled when an entry is pushed */
+    pthread_cond_t space;       /* broadcast when an entry has been written */
+};
+
+static void
+_stream_fail(container_stream *s)
+{
+    __atomic_store_n(&s->ret, ERR, __ATOMIC_RELEASE);
+    /* Every blocked producer, and the writer, must see it */
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->space);
+    pthread_cond_signal(&s->pushed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+stream_writer(void *vs)
+{
+    container_stream *s = vs;
+
+    for (size_t idx = 0; idx < s->w->nentries; ++idx) {
+        encoding *enc;
+        int restored = 0;
+
+        if (s->restore && (restored = s->restore(s->w, idx, s->args)) == ERR) {
+            _stream_fail(s);
+            break;
+        }
+        pthread_mutex_lock(&s->lock);
+        s->next = idx;
+        /* A producer may be waiting to reserve this entry */
+        pthread_cond_broadcast(&s->space);
+        if (restored) {
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+        while (s->ready[idx] == NULL && !s->done && !container_stream_failed(s))
+            pthread_cond_wait(&s->pushed, &s->lock);
+        enc = s->ready[idx];
+        s->ready[idx] = NULL;
+        pthread_mutex_unlock(&s->lock);
+        /* Producers have stopped; container_stream_finish recycles the rest */
+        if (enc == NULL)
+            break;
+
+        const int ret = container_writer_add_encoding(s->w, idx, s->vt, enc) == ERR
+            || (s->hook && s->hook(idx, enc, s->args) == ERR) ? ERR : OK;
+        encoding_pool_put(s->pool, enc);
+        pthread_mutex_lock(&s->lock);
+        s->inflight--;
+        pthread_cond_broadcast(&s->space);
+        pthread_mutex_unlock(&s->lock);
+        if (ret == ERR) {
+            _stream_fail(s);
+            break;
+        }
+    }
+    return NULL;
+}
+
+container_stream *
+container_stream_new(container_writer *w, const encoding_vtable *vt,
+                     encoding_pool *pool, size_t window,
+                     container_restore_f restore, container_stream_f hook,
+                     void *args)
+{
+    container_stream *s;
+
+    s = my_calloc(1, sizeof s[0]);
+    s->w = w;
+    s->vt = vt;
+    s->pool = pool;
+    s->window = window ? window : 1;
+    s->restore = restore;
+    s->hook = hook;
+    s->args = args;
+    s->ret = OK;
+    if ((s->ready = my_calloc(w->nentries ? w->nentries : 1, sizeof s->ready[0])) == NULL) {
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->pushed, NULL);
+    pthread_cond_init(&s->space, NULL);
+    if (pthread_create(&s->thread, NULL, stream_writer, s) != 0) {
+        fprintf(stderr, "%s: unable to start writer thread\n", errorstr);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->pushed);
+        pthread_cond_destroy(&s->space);
+        free(s->ready);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+bool
+container_stream_failed(container_stream *s)
+{
+    return __atomic_load_n(&s->ret, __ATOMIC_ACQUIRE) == ERR;
+}
+
+encoding *
+container_stream_reserve(container_stream *s, size_t idx)
+{
+    pthread_mutex_lock(&s->lock);
+    /* The entry the writer waits for is always let through, or producers
+     * holding later entries could fill the window and stall it */
+    while (s->inflight >= s->window && idx != s->next && !container_stream_failed(s))
+        pthread_cond_wait(&s->space, &s->lock);
+    if (container_stream_failed(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    s->inflight++;
+    pthread_mutex_unlock(&s->lock);
+    return encoding_pool_get(s->pool);
+}
+
+void
+container_stream_push(container_stream *s, size_t idx, encoding *enc)
+{
+    if (idx >= s->w->nentries) {
+        fprintf(stderr, "%s: container entry %lu out of range (%lu)\n",
+                errorstr, idx, s->w->nentries);
+        encoding_pool_put(s->pool, enc);
+        _stream_fail(s);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->ready[idx]) {
+        pthread_mutex_unlock(&s->lock);
+        fprintf(stderr, "%s: container entry %lu written twice\n", errorstr, idx);
+        encoding_pool_put(s->pool, enc);
+        _stream_fail(s);
+        return;
+    }
+    s->ready[idx] = enc;
+    pthread_cond_signal(&s->pushed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int
+container_stream_finish(container_stream *s)
+{
+    int ret;
+
+    pthread_mutex_lock(&s->lock);
+    s->done = true;
+    pthread_cond_signal(&s->pushed);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    /* Entries left behind once writing stopped */
+    for (size_t i = 0; i < s->w->nentries; ++i)
+        if (s->ready[i])
+            encoding_pool_put(s->pool, s->ready[i]);
+    if ((ret = __atomic_load_n(&s->ret, __ATOMIC_ACQUIRE)) == OK)
+        ret = container_writer_finish(s->w);
+    else
+        container_writer_free(s->w);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->pushed);
+    pthread_cond_destroy(&s->space);
+    free(s->ready);
+    free(s);
+    return ret;
+}
+
+container *
+container_open(FILE *fp)
+{
+    container *c = NULL;
+    struct stat st;
+    size_t magic, toc;
+    void *map;
+
+    if (fstat(fileno(fp), &st) == -1)
+        return NULL;
+    if (size_t_fread(&magic, fp) == ERR)
+        return NULL;
+    if (magic != CONTAINER_MAGIC) {
+        fprintf(stderr, "%s: not an obfuscation container\n", errorstr);
+        return NULL;
+    }
+    c = my_calloc(1, sizeof c[0]);
+    c->size = st.st_size;
+    if (size_t_fread(&c->nentries, fp) == ERR || size_t_fread(&toc, fp) == ERR)
+        goto error;
+    /* Both come from the file, so bound them before they size anything */
+    if (toc % CONTAINER_ALIGN || toc > c->size
+        || c->nentries > (c->size - toc) / sizeof c->toc[0]) {
+        fprintf(stderr, "%s: corrupt container table of contents\n", errorstr);
+        goto error;
+    }
+    map = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: unable to map container\n", errorstr);
+        goto error;
+    }
+    /* Evaluation touches a small, input-dependent subset of the entries */
+    (void) madvise(map, c->size, MADV_RANDOM);
+    c->map = map;
+    c->toc = (const toc_entry *) (c->map + toc);
+    for (size_t i = 0; i < c->nentries; ++i) {
+        if (c->toc[i].offset > c->size
+            || c->toc[i].length > c->size - c->toc[i].offset) {
+            fprintf(stderr, "%s: container entry %lu out of bounds\n", errorstr, i);
+            goto error;
+        }
+    }
+    return c;
+error:
+    container_close(c);
+    return NULL;
+}
+
+void
+container_close(container *c)
+{
+    if (c == NULL)
+        return;
+    if (c->map)
+        munmap(c->map, c->size);
+    free(c);
+}
+
+size_t
+container_nentries(const container *c)
+{
+    return c->nentries;
+}
+
+/* FNV-1a over the preamble, which holds the freshly sampled public
+ * parameters, and the TOC */
+size_t
+container_digest(const container *c)
+{
+    const size_t start = 3 * sizeof(size_t);
+    const unsigned char *toc = (const unsigned char *) c->toc;
+    size_t end = toc - c->map;
+    uint64_t h = 0xcbf29ce484222325UL;
+
+    for (size_t i = 0; i < c->nentries; ++i)
+        if (c->toc[i].length && c->toc[i].offset < end)
+            end = c->toc[i].offset;
+    for (size_t i = start; i < end; ++i) {
+        h ^= c->map[i];
+        h *= 0x100000001b3UL;
+    }
+    for (size_t i = 0; i < c->nentries * sizeof c->toc[0]; ++i) {
+        h ^= toc[i];
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+void *
+container_read(const container *c, size_t idx, container_read_f read, void *args)
+{
+    FILE *fp;
+    void *x;
+
+    if (idx >= c->nentries || c->toc[idx].length == 0) {
+        fprintf(stderr, "%s: no container entry %lu\n", errorstr, idx);
+        return NULL;
+    }
+    fp = fmemopen(c->map + c->toc[idx].offset, c->toc[idx].length, "r");
+    if (fp == NULL)
+        return NULL;
+    x = read(fp, args);
+    fclose(fp);
+    return x;
+}
+
+encoding *
+container_read_encoding(const container *c, const encoding_vtable *vt, size_t idx)
+{
+    return container_read(c, idx, _encoding_read, (void *) vt);
+}
+
+void *
+container_get(const container *c, size_t idx, void **slot,
+              container_read_f read, container_free_f free_f, void *args)
+{
+    void *x;
+
+    if ((x = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) || c == NULL)
+        return x;
+    if ((x = container_read(c, idx, read, args)) == NULL)
+        return NULL;
+    /* Another thread may have decoded the same entry in the meantime */
+    if (!__sync_bool_compare_and_swap(slot, NULL, x)) {
+        free_f(x, args);
+        x = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+    return x;
+}
+
+encoding *
+container_get_encoding(const container *c, const encoding_vtable *vt,
+                       encoding **slot, size_t idx)
+{
+    return container_get(c, idx, (void **) slot, _encoding_read,
+                         _encoding_free, (void *) vt);
+}
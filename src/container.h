@@ -0,0 +1,96 @@
+#pragma once
+
+#include "mmap.h"
+
+#include <stdio.h>
+
+/*
+ * Offset-indexed container used for obfuscations.  On disk:
+ *
+ *   header     magic, number of entries, offset of the table of contents
+ *   preamble   scheme-specific stream data (public parameters, etc.)
+ *   entries    one serialized object each, starting on CONTAINER_ALIGN
+ *   TOC        (offset, length) for every entry, indexed by the scheme
+ *
+ * Readers map the file and decode entries only when they are first used, so
+ * opening a container costs the header, the preamble and the TOC.
+ */
+
+#define CONTAINER_ALIGN 64
+
+typedef struct container_writer container_writer;
+typedef struct container container;
+
+typedef void * (*container_read_f)(FILE *fp, void *args);
+typedef int    (*container_write_f)(const void *x, FILE *fp, void *args);
+typedef void   (*container_free_f)(void *x, void *args);
+
+/* Writes a placeholder header at the current position of |fp|; the caller
+ * then writes the preamble directly to |fp| before adding any entries */
+container_writer * container_writer_new(FILE *fp, size_t nentries);
+int container_writer_add(container_writer *w, size_t idx, const void *x,
+                         container_write_f write, void *args);
+int container_writer_add_encoding(container_writer *w, size_t idx,
+                                  const encoding_vtable *vt, const encoding *enc);
+/* Writes the TOC, patches the header and frees |w| */
+int container_writer_finish(container_writer *w);
+/* Abandons a partially written container */
+void container_writer_free(container_writer *w);
+
+/* A writer thread that appends encodings to a container as producers finish
+ * them, bounding the number of encodings alive at once.  Entries are written
+ * in index order whatever order they finish in, so the file does not depend
+ * on the number of threads */
+typedef struct container_stream container_stream;
+
+/* Called by the writer thread after each encoding is written */
+typedef int (*container_stream_f)(size_t idx, const encoding *enc, void *args);
+/* Called by the writer thread when entry |idx| is next; returns 1 after
+ * writing the entry to |w| itself, 0 if a producer will push it, or ERR */
+typedef int (*container_restore_f)(container_writer *w, size_t idx, void *args);
+
+/* Takes over |w|, which must already have its preamble written; written
+ * encodings go back to |pool|, which must outlive the stream.  |restore| and
+ * |hook| may be NULL, and both get |args| */
+container_stream * container_stream_new(container_writer *w,
+                                        const encoding_vtable *vt,
+                                        encoding_pool *pool, size_t window,
+                                        container_restore_f restore,
+                                        container_stream_f hook, void *args);
+/* Blocks until fewer than |window| encodings are in flight, or entry |idx|
+ * is the one the writer waits for, then claims a place for it and returns an
+ * encoding from the pool to fill.  Returns NULL once writing has failed, so
+ * producers stop.  Producers must reserve entries in roughly index order, as
+ * the writer holds later entries until the earlier ones arrive */
+encoding * container_stream_reserve(container_stream *s, size_t idx);
+/* Whether writing an encoding (or its hook) has failed */
+bool container_stream_failed(container_stream *s);
+/* Queues |enc| to be written as entry |idx| and recycled; called once per
+ * reserved place, from any thread */
+void container_stream_push(container_stream *s, size_t idx, encoding *enc);
+/* Waits for everything queued to be written, finishes the container and
+ * frees |s| */
+int container_stream_finish(container_stream *s);
+
+/* Reads the header at the current position of |fp| and maps the file,
+ * leaving |fp| positioned at the start of the preamble */
+container * container_open(FILE *fp);
+void container_close(container *c);
+size_t container_nentries(const container *c);
+/* A hash of the preamble and TOC, so that files derived from a container,
+ * such as precomputed constants, can be tied to it */
+size_t container_digest(const container *c);
+
+/* Decodes entry |idx| into a freshly allocated object */
+void * container_read(const container *c, size_t idx, container_read_f read,
+                      void *args);
+encoding * container_read_encoding(const container *c, const encoding_vtable *vt,
+                                   size_t idx);
+
+/* Returns *slot, decoding entry |idx| into it first if it is still empty.
+ * Safe to call concurrently on the same slot.  A NULL container just
+ * returns *slot. */
+void * container_get(const container *c, size_t idx, void **slot,
+                     container_read_f read, container_free_f free_f, void *args);
+encoding * container_get_encoding(const container *c, const encoding_vtable *vt,
+                                  encoding **slot, size_t idx);
@@ -0,0 +1,158 @@
+#include "encode_batch.h"
+#include "util.h"
+
+/* Encoding takes far longer than a pool job costs to submit, so chunks only
+ * need to be big enough to keep submission out of the profile */
+#define ENCODE_CHUNK_MAX 32
+
+typedef struct values {
+    struct values *next;
+    size_t n;
+    mpz_t xs[];
+} values;
+
+typedef struct {
+    encode_batch *b;
+    size_t njobs;
+    encode_job jobs[];
+} chunk;
+
+struct encode_batch {
+    threadpool *pool;
+    const encoding_vtable *vt;
+    const secret_params *sp;
+    size_t nslots;
+    size_t chunksize;
+    progress *progress;
+    chunk *cur;
+    values *values;
+};
+
+static void
+encode_worker(void *vc)
+{
+    chunk *const c = vc;
+    encode_batch *const b = c->b;
+    /* The worker's own copies, so that encode may use them as it likes
+     * without touching values other jobs share */
+    mpz_t slots[b->nslots];
+
+    for (size_t i = 0; i < b->nslots; ++i)
+        mpz_init(slots[i]);
+    for (size_t i = 0; i < c->njobs; ++i) {
+        const encode_job *job = &c->jobs[i];
+        encoding *enc;
+
+        for (size_t k = 0; k < b->nslots; ++k)
+            mpz_set(slots[k], job->slots[k]);
+        for (size_t k = 0; k < job->nover; ++k)
+            mpz_set(slots[job->over[k]], job->value[k]);
+        enc = job->enc ? job->enc : container_stream_reserve(job->stream, job->idx);
+        /* A NULL one means the stream failed, so the rest are skipped */
+        if (enc) {
+            encode(b->vt, enc, slots, b->nslots, job->ix, b->sp, job->level);
+            if (job->stream)
+                container_stream_push(job->stream, job->idx, enc);
+            progress_add(b->progress, 1);
+        }
+        index_set_release(job->ix);
+    }
+    for (size_t i = 0; i < b->nslots; ++i)
+        mpz_clear(slots[i]);
+    free(c);
+}
+
+encode_batch *
+encode_batch_new(threadpool *pool, const encoding_vtable *vt,
+                 const secret_params *sp, size_t nslots, size_t nthreads,
+                 progress *progress)
+{
+    encode_batch *b;
+
+    b = my_calloc(1, sizeof b[0]);
+    b->pool = pool;
+    b->vt = vt;
+    b->sp = sp;
+    b->nslots = nslots;
+    /* A few chunks per thread, so the last ones finish together */
+    b->chunksize = progress_total(progress) / (8 * (nthreads ? nthreads : 1));
+    if (b->chunksize < 1)
+        b->chunksize = 1;
+    if (b->chunksize > ENCODE_CHUNK_MAX)
+        b->chunksize = ENCODE_CHUNK_MAX;
+    b->progress = progress;
+    return b;
+}
+
+void
+encode_batch_free(encode_batch *b)
+{
+    values *v, *next;
+
+    if (b == NULL)
+        return;
+    for (v = b->values; v; v = next) {
+        next = v->next;
+        for (size_t i = 0; i < v->n; ++i)
+            mpz_clear(v->xs[i]);
+        free(v);
+    }
+    if (b->cur)
+        for (size_t i = 0; i < b->cur->njobs; ++i)
+            index_set_release(b->cur->jobs[i].ix);
+    free(b->cur);
+    free(b);
+}
+
+static mpz_t *
+_values(encode_batch *b, size_t n)
+{
+    values *v;
+
+    v = my_calloc(1, sizeof v[0] + n * sizeof v->xs[0]);
+    v->n = n;
+    v->next = b->values;
+    b->values = v;
+    return v->xs;
+}
+
+const mpz_t *
+encode_batch_slots(encode_batch *b, const mpz_t *slots)
+{
+    mpz_t *xs = _values(b, b->nslots);
+
+    for (size_t i = 0; i < b->nslots; ++i)
+        mpz_init_set(xs[i], slots[i]);
+    return (const mpz_t *) xs;
+}
+
+mpz_srcptr
+encode_batch_value(encode_batch *b, const mpz_t x)
+{
+    mpz_t *xs = _values(b, 1);
+
+    mpz_init_set(xs[0], x);
+    return xs[0];
+}
+
+void
+encode_batch_add(encode_batch *b, const encode_job *job)
+{
+    if (b->cur == NULL) {
+        b->cur = my_calloc(1, sizeof b->cur[0] + b->chunksize * sizeof b->cur->jobs[0]);
+        b->cur->b = b;
+    }
+    b->cur->jobs[b->cur->njobs] = *job;
+    b->cur->jobs[b->cur->njobs].ix = index_set_intern(job->ix);
+    if (++b->cur->njobs == b->chunksize)
+        encode_batch_flush(b);
+}
+
+void
+encode_batch_flush(encode_batch *b)
+{
+    if (b->cur == NULL)
+        return;
+    threadpool_add_job(b->pool, encode_worker, b->cur);
+    b->cur = NULL;
+}
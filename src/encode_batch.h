@@ -0,0 +1,47 @@
+#pragma once
+
+#include "container.h"
+#include "index_set.h"
+#include "mmap.h"
+#include "progress.h"
+
+#include <threadpool.h>
+
+/*
+ * Encodings submitted to a threadpool in chunks, one pool job per chunk.
+ * Jobs share their plaintext slots instead of copying them: a job names a
+ * slot vector that outlives the batch (kept with encode_batch_slots, or the
+ * caller's own), and replaces up to ENCODE_NOVER of its slots by values
+ * that also outlive it.  Index sets are interned, so equal ones are shared.
+ *
+ * Jobs run once a chunk fills; encode_batch_flush submits the rest.  The
+ * batch must stay alive until the pool has been destroyed.
+ */
+
+#define ENCODE_NOVER 3
+
+typedef struct {
+    encoding *enc;              /* result, or NULL to reserve from stream */
+    container_stream *stream;   /* if set, enc is pushed to it when done */
+    size_t idx;                 /* container entry, with stream */
+    const mpz_t *slots;
+    size_t nover;               /* slots replaced, the first nover of over */
+    size_t over[ENCODE_NOVER];
+    mpz_srcptr value[ENCODE_NOVER];
+    const index_set *ix;
+    size_t level;
+} encode_job;
+
+typedef struct encode_batch encode_batch;
+
+/* Each finished encoding is counted into |progress| */
+encode_batch * encode_batch_new(threadpool *pool, const encoding_vtable *vt,
+                                const secret_params *sp, size_t nslots,
+                                size_t nthreads, progress *progress);
+void encode_batch_free(encode_batch *b);
+/* Copies |slots| (nslots values) or |x| into the batch, for jobs to share */
+const mpz_t * encode_batch_slots(encode_batch *b, const mpz_t *slots);
+mpz_srcptr    encode_batch_value(encode_batch *b, const mpz_t x);
+/* Queues |job|, interning its index set until the job has run */
+void encode_batch_add(encode_batch *b, const encode_job *job);
+void encode_batch_flush(encode_batch *b);
@@ -0,0 +1,280 @@
+#include "eval_cache.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct cache_entry {
+    size_t ref;
+    uint64_t hash;
+    size_t *syms;               /* symbols of the slots ref depends on */
+    encoding *enc;
+    struct cache_entry *next;
+} cache_entry;
+
+struct eval_cache {
+    const circ_params_t *cp;
+    const encoding_vtable *vt;
+    circ_operands_t ops;
+    size_t nrefs;
+    size_t nslots;              /* slots holding inputs */
+    size_t nwords;
+    uint64_t *deps;             /* [nrefs][nwords] slots each ref depends on */
+    size_t *ndeps;              /* [nrefs] */
+    pthread_mutex_t lock;
+    cache_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    size_t budget;
+    size_t used;
+    size_t encsize;             /* serialized size of an encoding, once known */
+    size_t hits, misses, dropped;
+};
+
+#define DEPS(cache, ref) (&(cache)->deps[(ref) * (cache)->nwords])
+
+/* Iterates k over the slots ref depends on */
+#define FOREACH_DEP(cache, ref, k)                                      \
+    for (size_t _w = 0; _w < (cache)->nwords; ++_w)                     \
+        for (uint64_t _bits = DEPS(cache, ref)[_w]; _bits; _bits &= _bits - 1) \
+            for (size_t k = _w * 64 + __builtin_ctzll(_bits), _once = 1; _once; _once = 0)
+
+static void *
+deps_input_f(size_t ref, size_t i, void *args_)
+{
+    eval_cache *cache = args_;
+    const size_t k = circ_params_slot(cache->cp, i);
+    DEPS(cache, ref)[k / 64] |= (uint64_t) 1 << (k % 64);
+    return (void *) 1;
+}
+
+static void *
+deps_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) ref; (void) i; (void) val; (void) args_;
+    return (void *) 1;
+}
+
+static void *
+deps_eval_f(size_t ref, acirc_op op, size_t xref, const void *x, size_t yref,
+            const void *y, void *args_)
+{
+    (void) op; (void) x; (void) y;
+    eval_cache *cache = args_;
+    for (size_t w = 0; w < cache->nwords; ++w)
+        DEPS(cache, ref)[w] = DEPS(cache, xref)[w] | DEPS(cache, yref)[w];
+    return (void *) 1;
+}
+
+static void *
+deps_output_f(size_t ref, size_t o, void *x, void *args_)
+{
+    (void) ref; (void) o; (void) x; (void) args_;
+    return NULL;
+}
+
+static void
+deps_free_f(void *x, void *args_)
+{
+    (void) x; (void) args_;
+}
+
+eval_cache *
+eval_cache_new(const circ_params_t *cp, const encoding_vtable *vt, size_t budget)
+{
+    eval_cache *cache;
+
+    cache = my_calloc(1, sizeof cache[0]);
+    cache->cp = cp;
+    cache->vt = vt;
+    cache->nrefs = acirc_nrefs(cp->circ);
+    cache->nslots = acirc_nsymbols(cp->circ);
+    cache->nwords = (cache->nslots + 63) / 64;
+    cache->budget = budget;
+    cache->deps = my_calloc(cache->nrefs * cache->nwords + 1, sizeof cache->deps[0]);
+    cache->ndeps = my_calloc(cache->nrefs, sizeof cache->ndeps[0]);
+    pthread_mutex_init(&cache->lock, NULL);
+    circ_params_operands(cp, &cache->ops);
+    /* Operands are visited first, which a single thread guarantees */
+    free(acirc_traverse(cp->circ, deps_input_f, deps_const_f, deps_eval_f,
+                        deps_output_f, deps_free_f, cache, 1));
+    for (size_t ref = 0; ref < cache->nrefs; ++ref)
+        for (size_t w = 0; w < cache->nwords; ++w)
+            cache->ndeps[ref] += __builtin_popcountll(DEPS(cache, ref)[w]);
+    return cache;
+}
+
+void
+eval_cache_free(eval_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        cache_entry *e = cache->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->next;
+            encoding_free(cache->vt, e->enc);
+            free(e->syms);
+            free(e);
+        }
+    }
+    free(cache->buckets);
+    circ_operands_clear(&cache->ops);
+    free(cache->deps);
+    free(cache->ndeps);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static bool
+_cacheable(const eval_cache *cache, size_t ref)
+{
+    return cache->ops.xrefs[ref] != SIZE_MAX && cache->ndeps[ref] < cache->nslots;
+}
+
+static uint64_t
+_hash(const eval_cache *cache, size_t ref, const size_t *syms)
+{
+    /* FNV-1a over the ref and its slots' symbols */
+    uint64_t h = (0xcbf29ce484222325UL ^ ref) * 0x100000001b3UL;
+    FOREACH_DEP(cache, ref, k) {
+        h ^= syms[k];
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+/* Requires the lock */
+static cache_entry *
+_lookup(const eval_cache *cache, size_t ref, const size_t *syms, uint64_t hash)
+{
+    if (cache->nbuckets == 0)
+        return NULL;
+    for (cache_entry *e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->next) {
+        bool match = e->ref == ref && e->hash == hash;
+        size_t j = 0;
+        if (!match)
+            continue;
+        FOREACH_DEP(cache, ref, k) {
+            if (e->syms[j++] != syms[k])
+                match = false;
+        }
+        if (match)
+            return e;
+    }
+    return NULL;
+}
+
+/* Requires the lock */
+static void
+_grow(eval_cache *cache)
+{
+    const size_t nbuckets = cache->nbuckets ? 2 * cache->nbuckets : 1024;
+    cache_entry **buckets = my_calloc(nbuckets, sizeof buckets[0]);
+
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        cache_entry *e = cache->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+void
+eval_cache_plan(eval_cache *cache, const size_t *syms, encoding **hits,
+                bool *needed)
+{
+    const circ_params_t *cp = cache->cp;
+    size_t *stack, nstack = 0;
+
+    memset(hits, '\0', cache->nrefs * sizeof hits[0]);
+    memset(needed, '\0', cache->nrefs * sizeof needed[0]);
+    stack = my_calloc(cache->nrefs, sizeof stack[0]);
+    for (size_t o = 0; o < acirc_noutputs(cp->circ); ++o) {
+        const size_t ref = cache->ops.outrefs[o];
+        if (circ_params_needs_output(cp, o) && !needed[ref] && !hits[ref]) {
+            needed[ref] = true;
+            stack[nstack++] = ref;
+        }
+    }
+    pthread_mutex_lock(&cache->lock);
+    /* Walks back from the outputs, stopping at cached gates */
+    while (nstack) {
+        const size_t ref = stack[--nstack];
+        const size_t operands[] = { cache->ops.xrefs[ref], cache->ops.yrefs[ref] };
+        if (_cacheable(cache, ref)) {
+            cache_entry *e = _lookup(cache, ref, syms, _hash(cache, ref, syms));
+            if (e) {
+                needed[ref] = false;
+                hits[ref] = e->enc;
+                cache->hits++;
+                continue;
+            }
+            cache->misses++;
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            if (operands[i] != SIZE_MAX && !needed[operands[i]] && !hits[operands[i]]) {
+                needed[operands[i]] = true;
+                stack[nstack++] = operands[i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(stack);
+}
+
+void
+eval_cache_offer(eval_cache *cache, const size_t *syms, size_t ref,
+                 encoding *enc)
+{
+    const uint64_t hash = _hash(cache, ref, syms);
+    cache_entry *e;
+    size_t cost, j = 0;
+
+    if (enc == NULL || !_cacheable(cache, ref))
+        return;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->encsize == 0)
+        cache->encsize = encoding_size(cache->vt, enc);
+    cost = sizeof e[0] + cache->ndeps[ref] * sizeof e->syms[0] + cache->encsize;
+    if (cache->used + cost > cache->budget) {
+        cache->dropped++;
+        goto cleanup;
+    }
+    if (_lookup(cache, ref, syms, hash))
+        goto cleanup;
+    if (cache->nentries >= cache->nbuckets)
+        _grow(cache);
+    e = my_calloc(1, sizeof e[0]);
+    e->ref = ref;
+    e->hash = hash;
+    e->syms = my_calloc(cache->ndeps[ref], sizeof e->syms[0]);
+    FOREACH_DEP(cache, ref, k) {
+        e->syms[j++] = syms[k];
+    }
+    e->enc = encoding_ref(enc);
+    e->next = cache->buckets[hash & (cache->nbuckets - 1)];
+    cache->buckets[hash & (cache->nbuckets - 1)] = e;
+    cache->nentries++;
+    cache->used += cost;
+cleanup:
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+eval_cache_print(const eval_cache *cache)
+{
+    fprintf(stderr, "Evaluation cache:\n");
+    fprintf(stderr, "* hits: ........ %lu\n", cache->hits);
+    fprintf(stderr, "* misses: ...... %lu\n", cache->misses);
+    fprintf(stderr, "* entries: ..... %lu (%lu dropped)\n", cache->nentries,
+            cache->dropped);
+    fprintf(stderr, "* size: ........ %lu KB of %lu KB\n", cache->used / 1024,
+            cache->budget / 1024);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "circ_params.h"
+#include "mmap.h"
+
+/*
+ * Gate encodings shared across the evaluations of a batch.  Evaluation
+ * selects one symbol per slot, and a gate's encoding depends only on the
+ * symbols of the slots in its input cone, so it is keyed by the gate and
+ * those symbols.  Gates depending on every slot only repeat for repeated
+ * inputs and are not kept.
+ *
+ * Per evaluation, eval_cache_plan finds the cached gates and the refs still
+ * to be computed (the ones reachable from the outputs without passing a
+ * cached gate); eval_f then offers each gate it computes back to the cache.
+ */
+
+typedef struct eval_cache eval_cache;
+
+/* Keeps at most |budget| bytes of encodings */
+eval_cache * eval_cache_new(const circ_params_t *cp, const encoding_vtable *vt,
+                            size_t budget);
+void eval_cache_free(eval_cache *cache);
+
+/* For the symbols |syms| (one per slot), sets hits[ref] to the cached
+ * encoding of each cached gate still needed, and needed[ref] for every ref
+ * the evaluation must compute; both arrays have nrefs entries */
+void eval_cache_plan(eval_cache *cache, const size_t *syms, encoding **hits,
+                     bool *needed);
+/* Keeps a reference to |enc| as gate |ref|'s encoding for |syms| if the
+ * gate is cacheable and the budget allows; safe to call concurrently */
+void eval_cache_offer(eval_cache *cache, const size_t *syms, size_t ref,
+                      encoding *enc);
+void eval_cache_print(const eval_cache *cache);
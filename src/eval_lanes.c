@@ -0,0 +1,521 @@
+#include "eval_lanes.h"
+#include "sched.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Known values beyond this many bits are left to evaluate modulo the lane's
+ * field, rather than carried exactly */
+#define RESIDUAL_MAXBITS 1024
+
+typedef enum {
+    RES_EVAL = 0,
+    RES_KNOWN,
+    RES_X,                      /* equal to the first operand */
+    RES_Y,                      /* equal to the second operand */
+    RES_BASE,                   /* as in the base residual */
+} res_e;
+
+struct residual {
+    size_t nrefs;
+    unsigned char *kind;        /* [nrefs] res_e */
+    mpz_t *known;               /* [nrefs] value where RES_KNOWN, or [nknown]
+                                 * if derived */
+    size_t *knownrefs;          /* [nknown] ascending refs of known, if derived */
+    size_t nknown;
+    const residual *base;       /* where RES_BASE, if derived */
+    size_t ngates;              /* gates left as RES_EVAL */
+    /* while building */
+    mpz_srcptr *inputs;
+    mpz_srcptr *consts;
+    size_t input;               /* the free input, if derived */
+    size_t *at;                 /* [nrefs] index into known, or SIZE_MAX */
+    size_t maxknown;
+    mpz_t tmp;
+};
+
+static res_e
+_kind(const residual *r, size_t ref)
+{
+    const res_e kind = r->kind[ref];
+    return kind == RES_BASE ? (res_e) r->base->kind[ref] : kind;
+}
+
+static int
+_ref_cmp(const void *a, const void *b)
+{
+    const size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* The value of |ref|, which is RES_KNOWN */
+static mpz_srcptr
+_known(const residual *r, size_t ref)
+{
+    const size_t *at;
+
+    if (r->kind[ref] == RES_BASE)
+        r = r->base;
+    if (r->base == NULL)
+        return r->known[ref];
+    if (r->at)
+        return r->known[r->at[ref]];
+    at = bsearch(&ref, r->knownrefs, r->nknown, sizeof ref, _ref_cmp);
+    return r->known[at - r->knownrefs];
+}
+
+/* Makes |ref| RES_KNOWN with value |x|, which is left undefined.  Fails
+ * only if there is no room to store it, when |ref| can be evaluated instead */
+static bool
+_set_known(residual *r, size_t ref, mpz_t x)
+{
+    if (r->base == NULL) {
+        mpz_swap(r->known[ref], x);
+    } else {
+        if (r->nknown == r->maxknown) {
+            const size_t max = r->maxknown ? 2 * r->maxknown : 16;
+            mpz_t *known = my_realloc(r->known, max * sizeof known[0]);
+            if (known == NULL)
+                return false;
+            r->known = known;
+            r->maxknown = max;
+        }
+        mpz_init(r->known[r->nknown]);
+        mpz_swap(r->known[r->nknown], x);
+        r->at[ref] = r->nknown++;
+    }
+    r->kind[ref] = RES_KNOWN;
+    return true;
+}
+
+static void *
+res_input_f(size_t ref, size_t i, void *args_)
+{
+    residual *r = args_;
+    if (r->base)
+        r->kind[ref] = i == r->input ? RES_EVAL : RES_BASE;
+    else if (r->inputs && r->inputs[i]) {
+        mpz_set(r->tmp, r->inputs[i]);
+        _set_known(r, ref, r->tmp);
+    }
+    return (void *) 1;
+}
+
+static void *
+res_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) val;
+    residual *r = args_;
+    if (r->base)
+        r->kind[ref] = RES_BASE;
+    else if (r->consts && r->consts[i]) {
+        mpz_set(r->tmp, r->consts[i]);
+        _set_known(r, ref, r->tmp);
+    }
+    return (void *) 1;
+}
+
+static void *
+res_eval_f(size_t ref, acirc_op op, size_t xref, const void *x, size_t yref,
+           const void *y, void *args_)
+{
+    (void) x; (void) y;
+    residual *r = args_;
+
+    /* Gates that do not depend on the free input are as in the base */
+    if (r->base && r->kind[xref] == RES_BASE && r->kind[yref] == RES_BASE) {
+        r->kind[ref] = RES_BASE;
+        if (r->base->kind[ref] == RES_EVAL)
+            r->ngates++;
+        return (void *) 1;
+    }
+
+    const bool kx = _kind(r, xref) == RES_KNOWN;
+    const bool ky = _kind(r, yref) == RES_KNOWN;
+    mpz_srcptr vx = kx ? _known(r, xref) : NULL;
+    mpz_srcptr vy = ky ? _known(r, yref) : NULL;
+    res_e kind = RES_EVAL;
+
+    if (kx && ky) {
+        switch (op) {
+        case ACIRC_OP_ADD:
+            mpz_add(r->tmp, vx, vy);
+            break;
+        case ACIRC_OP_SUB:
+            mpz_sub(r->tmp, vx, vy);
+            break;
+        case ACIRC_OP_MUL:
+            mpz_mul(r->tmp, vx, vy);
+            break;
+        }
+        if (mpz_sizeinbase(r->tmp, 2) <= RESIDUAL_MAXBITS)
+            kind = RES_KNOWN;
+    } else {
+        const bool x0 = kx && mpz_cmp_ui(vx, 0) == 0;
+        const bool y0 = ky && mpz_cmp_ui(vy, 0) == 0;
+        const bool x1 = kx && mpz_cmp_ui(vx, 1) == 0;
+        const bool y1 = ky && mpz_cmp_ui(vy, 1) == 0;
+        switch (op) {
+        case ACIRC_OP_MUL:
+            if (x0 || y0) {
+                kind = RES_KNOWN;
+                mpz_set_ui(r->tmp, 0);
+            } else if (y1) {
+                kind = RES_X;
+            } else if (x1) {
+                kind = RES_Y;
+            }
+            break;
+        case ACIRC_OP_ADD:
+            if (y0)
+                kind = RES_X;
+            else if (x0)
+                kind = RES_Y;
+            break;
+        case ACIRC_OP_SUB:
+            if (y0)
+                kind = RES_X;
+            break;
+        }
+    }
+    /* Known values that agree with the base, say once multiplied by 0,
+     * are read from it */
+    if (kind == RES_KNOWN && r->base && r->base->kind[ref] == RES_KNOWN
+        && mpz_cmp(r->tmp, r->base->known[ref]) == 0) {
+        r->kind[ref] = RES_BASE;
+        return (void *) 1;
+    }
+    if (kind != RES_KNOWN || !_set_known(r, ref, r->tmp)) {
+        if (kind == RES_KNOWN)
+            kind = RES_EVAL;
+        r->kind[ref] = kind;
+    }
+    if (kind == RES_EVAL)
+        r->ngates++;
+    return (void *) 1;
+}
+
+static void *
+res_output_f(size_t ref, size_t o, void *x, void *args_)
+{
+    (void) ref; (void) o; (void) x; (void) args_;
+    return NULL;
+}
+
+static void
+res_free_f(void *x, void *args_)
+{
+    (void) x; (void) args_;
+}
+
+static void
+_build(acirc_t *circ, residual *r)
+{
+    mpz_init(r->tmp);
+    /* Operands are visited first, which a single thread guarantees */
+    free(acirc_traverse(circ, res_input_f, res_const_f, res_eval_f,
+                        res_output_f, res_free_f, r, 1));
+    mpz_clear(r->tmp);
+}
+
+residual *
+residual_new(acirc_t *circ, mpz_srcptr *inputs, mpz_srcptr *consts)
+{
+    residual *r;
+
+    r = my_calloc(1, sizeof r[0]);
+    r->nrefs = acirc_nrefs(circ);
+    r->kind = my_calloc(r->nrefs, sizeof r->kind[0]);
+    r->known = mpz_vect_new(r->nrefs);
+    r->inputs = inputs;
+    r->consts = consts;
+    _build(circ, r);
+    r->inputs = NULL;
+    r->consts = NULL;
+    return r;
+}
+
+static residual *
+_derive(acirc_t *circ, const residual *base, size_t input)
+{
+    residual *r;
+    size_t n = 0;
+
+    r = my_calloc(1, sizeof r[0]);
+    r->nrefs = base->nrefs;
+    r->kind = my_calloc(r->nrefs, sizeof r->kind[0]);
+    r->base = base;
+    r->input = input;
+    r->at = my_calloc(r->nrefs, sizeof r->at[0]);
+    for (size_t ref = 0; ref < r->nrefs; ++ref)
+        r->at[ref] = SIZE_MAX;
+    _build(circ, r);
+    /* Known values go in ref order, to be found by bisection */
+    r->knownrefs = my_calloc(r->nknown, sizeof r->knownrefs[0]);
+    for (size_t ref = 0; ref < r->nrefs; ++ref) {
+        if (r->at[ref] != SIZE_MAX)
+            r->knownrefs[n++] = ref;
+    }
+    {
+        mpz_t *known = my_calloc(r->nknown, sizeof known[0]);
+        for (size_t i = 0; i < r->nknown; ++i)
+            known[i][0] = r->known[r->at[r->knownrefs[i]]][0];
+        free(r->known);
+        r->known = known;
+    }
+    free(r->at);
+    r->at = NULL;
+    return r;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;
+} latch;
+
+typedef struct {
+    acirc_t *circ;
+    const residual *base;
+    residual **r;
+    size_t input;
+    latch *done;
+} derive_args;
+
+static void
+derive_worker(void *vargs)
+{
+    derive_args *args = vargs;
+    latch *done = args->done;
+
+    *args->r = _derive(args->circ, args->base, args->input);
+    free(args);
+    pthread_mutex_lock(&done->lock);
+    if (--done->pending == 0)
+        pthread_cond_signal(&done->cond);
+    pthread_mutex_unlock(&done->lock);
+}
+
+void
+residual_derive(acirc_t *circ, const residual *base, residual **rs, size_t n,
+                threadpool *pool)
+{
+    latch done;
+
+    if (pool == NULL || n <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            rs[i] = _derive(circ, base, i);
+        return;
+    }
+    pthread_mutex_init(&done.lock, NULL);
+    pthread_cond_init(&done.cond, NULL);
+    done.pending = n;
+    for (size_t i = 0; i < n; ++i) {
+        derive_args *args = my_calloc(1, sizeof args[0]);
+        args->circ = circ;
+        args->base = base;
+        args->r = &rs[i];
+        args->input = i;
+        args->done = &done;
+        threadpool_add_job(pool, derive_worker, args);
+    }
+    pthread_mutex_lock(&done.lock);
+    while (done.pending)
+        pthread_cond_wait(&done.cond, &done.lock);
+    pthread_mutex_unlock(&done.lock);
+    pthread_cond_destroy(&done.cond);
+    pthread_mutex_destroy(&done.lock);
+}
+
+void
+residual_free(residual *r)
+{
+    if (r == NULL)
+        return;
+    mpz_vect_free(r->known, r->base ? r->nknown : r->nrefs);
+    free(r->knownrefs);
+    free(r->kind);
+    free(r);
+}
+
+size_t
+residual_ngates(const residual *r)
+{
+    return r->ngates;
+}
+
+typedef struct {
+    size_t nlanes;
+    mpz_t ***inputs;
+    mpz_t ***consts;
+    mpz_srcptr *moduli;
+    residual **residuals;
+    /* Freed lane vectors, kept with their limbs for the next gate */
+    pthread_mutex_t lock;
+    mpz_t **spare;
+    size_t nspare, maxspare;
+} lanes_args_t;
+
+static mpz_t *
+_vect_get(lanes_args_t *args)
+{
+    mpz_t *x = NULL;
+
+    pthread_mutex_lock(&args->lock);
+    if (args->nspare)
+        x = args->spare[--args->nspare];
+    pthread_mutex_unlock(&args->lock);
+    return x ? x : mpz_vect_new(args->nlanes);
+}
+
+/* Lanes where |ref| is known hold nothing, and are read from the residual */
+static bool
+_lane_known(const lanes_args_t *args, size_t l, size_t ref)
+{
+    const residual *r = args->residuals ? args->residuals[l] : NULL;
+    return r && _kind(r, ref) == RES_KNOWN;
+}
+
+static mpz_srcptr
+_lane(const lanes_args_t *args, size_t l, size_t ref, const mpz_t *x)
+{
+    return _lane_known(args, l, ref) ? _known(args->residuals[l], ref) : x[l];
+}
+
+/* Sets |rop| to lane l of |ref|, reduced */
+static void
+_lane_set(mpz_t rop, const lanes_args_t *args, size_t l, size_t ref,
+          const mpz_t *x)
+{
+    if (_lane_known(args, l, ref))
+        mpz_mod(rop, _known(args->residuals[l], ref), args->moduli[l]);
+    else
+        mpz_set(rop, x[l]);
+}
+
+static void *
+input_f(size_t ref, size_t i, void *args_)
+{
+    lanes_args_t *args = args_;
+    mpz_t *x = _vect_get(args);
+    for (size_t l = 0; l < args->nlanes; ++l) {
+        if (!_lane_known(args, l, ref))
+            mpz_set(x[l], *args->inputs[l][i]);
+    }
+    return x;
+}
+
+static void *
+const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) val;
+    lanes_args_t *args = args_;
+    mpz_t *x = _vect_get(args);
+    for (size_t l = 0; l < args->nlanes; ++l) {
+        if (!_lane_known(args, l, ref))
+            mpz_set(x[l], *args->consts[l][i]);
+    }
+    return x;
+}
+
+static void *
+eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref,
+       const void *y_, void *args_)
+{
+    lanes_args_t *args = args_;
+    const mpz_t *x = x_;
+    const mpz_t *y = y_;
+    mpz_t *rop = _vect_get(args);
+    for (size_t l = 0; l < args->nlanes; ++l) {
+        const residual *r = args->residuals ? args->residuals[l] : NULL;
+        switch (r ? _kind(r, ref) : RES_EVAL) {
+        case RES_KNOWN:
+            continue;
+        case RES_X:
+            _lane_set(rop[l], args, l, xref, x);
+            continue;
+        case RES_Y:
+            _lane_set(rop[l], args, l, yref, y);
+            continue;
+        case RES_EVAL:
+        case RES_BASE:
+            break;
+        }
+        mpz_srcptr a = _lane(args, l, xref, x);
+        mpz_srcptr b = _lane(args, l, yref, y);
+        switch (op) {
+        case ACIRC_OP_ADD:
+            mpz_add(rop[l], a, b);
+            break;
+        case ACIRC_OP_SUB:
+            mpz_sub(rop[l], a, b);
+            break;
+        case ACIRC_OP_MUL:
+            mpz_mul(rop[l], a, b);
+            break;
+        }
+        mpz_mod(rop[l], rop[l], args->moduli[l]);
+    }
+    return rop;
+}
+
+static void *
+output_f(size_t ref, size_t o, void *x_, void *args_)
+{
+    (void) o;
+    lanes_args_t *args = args_;
+    const mpz_t *x = x_;
+    /* x may still be read by other gates, so the output is a copy */
+    mpz_t *rop = mpz_vect_new(args->nlanes);
+    for (size_t l = 0; l < args->nlanes; ++l)
+        _lane_set(rop[l], args, l, ref, x);
+    return rop;
+}
+
+static void
+free_f(void *x, void *args_)
+{
+    lanes_args_t *args = args_;
+
+    pthread_mutex_lock(&args->lock);
+    if (args->nspare == args->maxspare) {
+        const size_t max = args->maxspare ? 2 * args->maxspare : 64;
+        mpz_t **spare = my_realloc(args->spare, max * sizeof spare[0]);
+        if (spare) {
+            args->spare = spare;
+            args->maxspare = max;
+        }
+    }
+    if (args->nspare < args->maxspare) {
+        args->spare[args->nspare++] = x;
+        x = NULL;
+    }
+    pthread_mutex_unlock(&args->lock);
+    if (x)
+        mpz_vect_free(x, args->nlanes);
+}
+
+mpz_t **
+eval_lanes(acirc_t *circ, mpz_t ***inputs, mpz_t ***consts, mpz_srcptr *moduli,
+           residual **residuals, size_t nlanes, size_t nthreads)
+{
+    lanes_args_t args = {
+        .nlanes = nlanes,
+        .inputs = inputs,
+        .consts = consts,
+        .moduli = moduli,
+        .residuals = residuals,
+    };
+    mpz_t **outputs;
+
+    pthread_mutex_init(&args.lock, NULL);
+    outputs = (mpz_t **) sched_traverse(circ, NULL, input_f, const_f, eval_f,
+                                        output_f, free_f, &args, nthreads);
+    for (size_t i = 0; i < args.nspare; ++i)
+        mpz_vect_free(args.spare[i], nlanes);
+    free(args.spare);
+    pthread_mutex_destroy(&args.lock);
+    return outputs;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <acirc.h>
+#include <gmp.h>
+#include <threadpool.h>
+
+/*
+ * The circuit specialised to known values of some of its inputs and
+ * constants.  Known values are propagated through the gates, as are
+ * multiplications by 1 or 0 and additions of 0, leaving only the gates that
+ * depend on the free inputs in a way that needs evaluating.  A slot's C†,
+ * with every other slot's inputs set to 1, costs that slot's share of the
+ * circuit this way rather than the whole of it.
+ */
+typedef struct residual residual;
+
+/* |inputs| and |consts| hold the known values, and NULL where free */
+residual * residual_new(acirc_t *circ, mpz_srcptr *inputs, mpz_srcptr *consts);
+/* Derives rs[i] from |base|, which must know every input, with input i
+ * free, for each i < n, as jobs on |pool| if given.  Gates that do not
+ * depend on input i are read from |base|, which must outlive them, so each
+ * keeps only the known values that differ */
+void residual_derive(acirc_t *circ, const residual *base, residual **rs,
+                     size_t n, threadpool *pool);
+void residual_free(residual *r);
+/* The number of gates left to evaluate */
+size_t residual_ngates(const residual *r);
+
+/*
+ * Evaluates the circuit over plaintexts for several assignments at once, as
+ * one traversal whose wires carry a lane per assignment.  Lane l takes its
+ * inputs and constants from inputs[l] and consts[l], laid out as for
+ * acirc_eval_mpz, and is reduced modulo moduli[l].  If |residuals| and
+ * residuals[l] are given, lane l evaluates only that residual's gates, and
+ * its known values must agree with inputs[l] and consts[l].  Gates are
+ * spread over |nthreads| by sched_traverse.  Returns [noutputs][nlanes],
+ * each freed with mpz_vect_free.
+ */
+mpz_t ** eval_lanes(acirc_t *circ, mpz_t ***inputs, mpz_t ***consts,
+                    mpz_srcptr *moduli, residual **residuals, size_t nlanes,
+                    size_t nthreads);
@@ -2,8 +2,197 @@
 #include "util.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+/*
+ * Exponent kernels.  Each handles as many whole vectors as fit, then finishes
+ * with the scalar loop, which is also the fallback when neither AVX2 nor
+ * SSE4.1 is available.
+ */
+
+#if defined(__AVX2__)
+#define LANES 8
+typedef __m256i vec;
+#define vload(p)      _mm256_loadu_si256((const __m256i *) (p))
+#define vstore(p, v)  _mm256_storeu_si256((__m256i *) (p), (v))
+#define vadd          _mm256_add_epi32
+#define vsub          _mm256_sub_epi32
+#define vmax          _mm256_max_epi32
+#define vxor          _mm256_xor_si256
+#define vand          _mm256_and_si256
+#define vor           _mm256_or_si256
+#define vcmpeq        _mm256_cmpeq_epi32
+#define vcmpgt        _mm256_cmpgt_epi32
+#define vzero         _mm256_setzero_si256
+#define vsigns(v)     _mm256_movemask_ps(_mm256_castsi256_ps(v))
+#define vallones(v)   ((unsigned) _mm256_movemask_epi8(v) == 0xffffffffU)
+#elif defined(__SSE4_1__)
+#define LANES 4
+typedef __m128i vec;
+#define vload(p)      _mm_loadu_si128((const __m128i *) (p))
+#define vstore(p, v)  _mm_storeu_si128((__m128i *) (p), (v))
+#define vadd          _mm_add_epi32
+#define vsub          _mm_sub_epi32
+#define vmax          _mm_max_epi32
+#define vxor          _mm_xor_si128
+#define vand          _mm_and_si128
+#define vor           _mm_or_si128
+#define vcmpeq        _mm_cmpeq_epi32
+#define vcmpgt        _mm_cmpgt_epi32
+#define vzero         _mm_setzero_si128
+#define vsigns(v)     _mm_movemask_ps(_mm_castsi128_ps(v))
+#define vallones(v)   (_mm_movemask_epi8(v) == 0xffff)
+#else
+#define LANES 0
+#endif
+
+/* The scalar loops, which finish each kernel and are its reference */
+
+static bool
+_pows_add_scalar(int *rop, const int *x, const int *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (__builtin_add_overflow(x[i], y[i], &rop[i]))
+            return false;
+    return true;
+}
+
+static void
+_pows_max_scalar(int *rop, const int *x, const int *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        rop[i] = x[i] > y[i] ? x[i] : y[i];
+}
+
+static bool
+_pows_sub_scalar(int *rop, const int *x, const int *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (x[i] < y[i])
+            return false;
+        rop[i] = x[i] - y[i];
+    }
+    return true;
+}
+
+static bool
+_pows_eq_scalar(const int *x, const int *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (x[i] != y[i])
+            return false;
+    return true;
+}
+
+/* Debug builds check every kernel result against the scalar loop, so any
+ * run of the test suite compares the two.  The scalar result is taken
+ * before the kernel runs, as |rop| may alias |x| or |y| */
+#if LANES && !defined(NDEBUG)
+static bool
+_pows_max_scalar_ok(int *rop, const int *x, const int *y, size_t n)
+{
+    _pows_max_scalar(rop, x, y, n);
+    return true;
+}
+
+#define KERNEL_WANT(scalar, x, y, n)                                    \
+    int _want[(n) ? (n) : 1];                                           \
+    const bool _want_ok = scalar(_want, x, y, n)
+#define KERNEL_CHECK(ret, rop, n)                                       \
+    do {                                                                \
+        assert(_want_ok == (ret));                                      \
+        assert(!_want_ok || memcmp(_want, rop, (n) * sizeof _want[0]) == 0); \
+    } while (0)
+#else
+#define KERNEL_WANT(scalar, x, y, n)
+#define KERNEL_CHECK(ret, rop, n) ((void) 0)
+#endif
+
+/* False if some sum overflows an int */
+static bool
+_pows_add(int *rop, const int *x, const int *y, size_t n)
+{
+    size_t i = 0;
+    bool ret;
+    KERNEL_WANT(_pows_add_scalar, x, y, n);
+#if LANES
+    vec overflow = vzero();
+    for (; i + LANES <= n; i += LANES) {
+        const vec a = vload(x + i), b = vload(y + i), r = vadd(a, b);
+        /* Signed overflow iff both operands differ in sign from the sum */
+        overflow = vor(overflow, vand(vxor(a, r), vxor(b, r)));
+        vstore(rop + i, r);
+    }
+    if (vsigns(overflow))
+        ret = false;
+    else
+#endif
+        ret = _pows_add_scalar(rop + i, x + i, y + i, n - i);
+    KERNEL_CHECK(ret, rop, n);
+    return ret;
+}
+
+static void
+_pows_max(int *rop, const int *x, const int *y, size_t n)
+{
+    size_t i = 0;
+    KERNEL_WANT(_pows_max_scalar_ok, x, y, n);
+#if LANES
+    for (; i + LANES <= n; i += LANES)
+        vstore(rop + i, vmax(vload(x + i), vload(y + i)));
+#endif
+    _pows_max_scalar(rop + i, x + i, y + i, n - i);
+    KERNEL_CHECK(true, rop, n);
+}
+
+/* False if y exceeds x anywhere */
+static bool
+_pows_sub(int *rop, const int *x, const int *y, size_t n)
+{
+    size_t i = 0;
+    bool ret;
+    KERNEL_WANT(_pows_sub_scalar, x, y, n);
+#if LANES
+    vec negative = vzero();
+    for (; i + LANES <= n; i += LANES) {
+        const vec a = vload(x + i), b = vload(y + i);
+        negative = vor(negative, vcmpgt(b, a));
+        vstore(rop + i, vsub(a, b));
+    }
+    if (vsigns(negative))
+        ret = false;
+    else
+#endif
+        ret = _pows_sub_scalar(rop + i, x + i, y + i, n - i);
+    KERNEL_CHECK(ret, rop, n);
+    return ret;
+}
+
+static bool
+_pows_eq(const int *x, const int *y, size_t n)
+{
+    size_t i = 0;
+    bool ret = true;
+#if LANES
+    for (; i + LANES <= n && ret; i += LANES)
+        ret = vallones(vcmpeq(vload(x + i), vload(y + i)));
+#endif
+    if (ret)
+        ret = _pows_eq_scalar(x + i, y + i, n - i);
+#if LANES && !defined(NDEBUG)
+    assert(ret == _pows_eq_scalar(x, y, n));
+#endif
+    return ret;
+}
+
 index_set *
 index_set_new(size_t nzs)
 {
@@ -48,11 +237,14 @@ index_set_print(const index_set *ix)
     fprintf(stderr, "\n");
 }
 
-void
+int
 index_set_add(index_set *rop, const index_set *x, const index_set *y)
 {
-    for (size_t i = 0; i < rop->nzs; ++i)
-        rop->pows[i] = x->pows[i] + y->pows[i];
+    if (!_pows_add(rop->pows, x->pows, y->pows, rop->nzs)) {
+        fprintf(stderr, "error: overflow in index set\n");
+        return ERR;
+    }
+    return OK;
 }
 
 void
@@ -75,13 +267,11 @@ index_set_copy(const index_set *x)
 bool
 index_set_eq(const index_set *x, const index_set *y)
 {
-    if (x == NULL && y == NULL)
+    if (x == y)
         return true;
-    for (size_t i = 0; i < x->nzs; ++i) {
-        if (x->pows[i] != y->pows[i])
-            return false;
-    }
-    return true;
+    if (x->id && y->id)
+        return false;
+    return _pows_eq(x->pows, y->pows, x->nzs);
 }
 
 index_set *
@@ -90,9 +280,7 @@ index_set_union(const index_set *x, const index_set *y)
     index_set *rop;
     if ((rop = index_set_new(x->nzs)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        rop->pows[i] = x->pows[i] > y->pows[i] ? x->pows[i] : y->pows[i];
-    }
+    _pows_max(rop->pows, x->pows, y->pows, x->nzs);
     return rop;
 }
 
@@ -102,19 +290,14 @@ index_set_difference(const index_set *x, const index_set *y)
     index_set *rop;
     if ((rop = index_set_new(x->nzs)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        if (x->pows[i] < y->pows[i]) {
-            fprintf(stderr, "error: negative difference in index set\n");
-            index_set_print(x);
-            index_set_print(y);
-            goto error;
-        }
-        rop->pows[i] = x->pows[i] - y->pows[i];
+    if (!_pows_sub(rop->pows, x->pows, y->pows, x->nzs)) {
+        fprintf(stderr, "error: negative difference in index set\n");
+        index_set_print(x);
+        index_set_print(y);
+        index_set_free(rop);
+        return NULL;
     }
     return rop;
-error:
-    free(rop);
-    return NULL;
 }
 
 index_set *
@@ -152,3 +335,305 @@ index_set_fwrite(const index_set *ix, FILE *fp)
     }
     return OK;
 }
+
+typedef struct intern_entry {
+    index_set ix;
+    uint64_t hash;
+    size_t refs;                /* atomic; reaches zero only under the lock */
+    struct intern_entry *next;
+} intern_entry;
+
+typedef enum {
+    INTERN_ADD = 1,
+    INTERN_UNION,
+    INTERN_DIFFERENCE,
+} intern_op;
+
+/* Memoised results, per thread so that a hit takes no lock.  Ids are never
+ * reused, so a match by operand ids is always right, and each entry holds a
+ * reference to its result */
+typedef struct {
+    intern_op op;
+    size_t x, y;
+    const index_set *result;
+} memo_entry;
+
+#define MEMO_SIZE 4096
+
+/* Sets are spread over shards by their hash, each with its own lock */
+#define NSHARDS 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    intern_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+} shard;
+
+static shard g_shards[NSHARDS];
+static size_t g_ids;            /* atomic */
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_memo_key;
+static __thread memo_entry *t_memo;
+
+static uint64_t
+_hash(const int *pows, size_t nzs)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325UL;
+    const unsigned char *p = (const unsigned char *) pows;
+    for (size_t i = 0; i < nzs * sizeof pows[0]; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3UL;
+    }
+    return h ^ nzs;
+}
+
+static shard *
+_shard(uint64_t hash)
+{
+    return &g_shards[(hash >> 32) % NSHARDS];
+}
+
+static void
+_memo_free(void *vmemo)
+{
+    memo_entry *memo = vmemo;
+    for (size_t i = 0; i < MEMO_SIZE; ++i)
+        index_set_release(memo[i].result);
+    free(memo);
+}
+
+static void
+_init(void)
+{
+    for (size_t i = 0; i < NSHARDS; ++i)
+        pthread_mutex_init(&g_shards[i].lock, NULL);
+    /* A thread's memo goes, with its references, when the thread exits */
+    (void) pthread_key_create(&g_memo_key, _memo_free);
+}
+
+static memo_entry *
+_memo(void)
+{
+    if (t_memo == NULL) {
+        pthread_once(&g_once, _init);
+        if ((t_memo = my_calloc(MEMO_SIZE, sizeof t_memo[0])) == NULL)
+            return NULL;
+        (void) pthread_setspecific(g_memo_key, t_memo);
+    }
+    return t_memo;
+}
+
+static void
+_grow(shard *sh)
+{
+    const size_t nbuckets = sh->nbuckets ? 2 * sh->nbuckets : 64;
+    intern_entry **buckets = my_calloc(nbuckets, sizeof buckets[0]);
+
+    if (buckets == NULL)
+        return;                 /* chains just get longer */
+    for (size_t i = 0; i < sh->nbuckets; ++i) {
+        intern_entry *e = sh->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+        }
+    }
+    free(sh->buckets);
+    sh->buckets = buckets;
+    sh->nbuckets = nbuckets;
+}
+
+/* Returns a reference to the set equal to pows, taking ownership of pows
+ * unless it finds one */
+static const index_set *
+_intern(int *pows, size_t nzs, bool *owned)
+{
+    const uint64_t hash = _hash(pows, nzs);
+    shard *sh = _shard(hash);
+    intern_entry *e = NULL;
+
+    pthread_once(&g_once, _init);
+    pthread_mutex_lock(&sh->lock);
+    if (sh->nbuckets) {
+        for (e = sh->buckets[hash & (sh->nbuckets - 1)]; e; e = e->next)
+            if (e->hash == hash && e->ix.nzs == nzs
+                && memcmp(e->ix.pows, pows, nzs * sizeof pows[0]) == 0)
+                break;
+    }
+    if (e) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        goto done;
+    }
+    if (sh->nentries >= sh->nbuckets)
+        _grow(sh);
+    if (sh->nbuckets == 0 || (e = my_calloc(1, sizeof e[0])) == NULL)
+        goto done;
+    e->ix.pows = pows;
+    e->ix.nzs = nzs;
+    e->ix.id = __atomic_add_fetch(&g_ids, 1, __ATOMIC_RELAXED);
+    e->hash = hash;
+    e->refs = 1;
+    e->next = sh->buckets[hash & (sh->nbuckets - 1)];
+    sh->buckets[hash & (sh->nbuckets - 1)] = e;
+    sh->nentries++;
+    *owned = true;
+done:
+    pthread_mutex_unlock(&sh->lock);
+    return e ? &e->ix : NULL;
+}
+
+static const index_set *
+_intern_copy(const index_set *ix)
+{
+    int *pows = my_calloc(ix->nzs, sizeof pows[0]);
+    bool owned = false;
+    const index_set *rop;
+
+    if (pows == NULL)
+        return NULL;
+    memcpy(pows, ix->pows, ix->nzs * sizeof pows[0]);
+    rop = _intern(pows, ix->nzs, &owned);
+    if (!owned)
+        free(pows);
+    return rop;
+}
+
+const index_set *
+index_set_acquire(const index_set *ix)
+{
+    /* The caller holds a reference, so the count cannot be zero here */
+    intern_entry *e = (intern_entry *) ix;
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+    return ix;
+}
+
+void
+index_set_release(const index_set *ix)
+{
+    intern_entry *e = (intern_entry *) ix, **pp;
+    shard *sh;
+    size_t refs;
+
+    if (ix == NULL)
+        return;
+    /* Dropping a reference that is not the last takes no lock */
+    refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+    while (refs > 1)
+        if (__atomic_compare_exchange_n(&e->refs, &refs, refs - 1, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    /* The last one may race a lookup, which only takes one under the lock */
+    sh = _shard(e->hash);
+    pthread_mutex_lock(&sh->lock);
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (pp = &sh->buckets[e->hash & (sh->nbuckets - 1)]; *pp != e; pp = &(*pp)->next)
+            ;
+        *pp = e->next;
+        sh->nentries--;
+        free(e->ix.pows);
+        free(e);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+const index_set *
+index_set_intern(const index_set *ix)
+{
+    if (ix->id)
+        return index_set_acquire(ix);
+    return _intern_copy(ix);
+}
+
+const index_set *
+index_set_intern_zero(size_t nzs)
+{
+    int *pows = my_calloc(nzs, sizeof pows[0]);
+    bool owned = false;
+    const index_set *rop;
+
+    if (pows == NULL)
+        return NULL;
+    rop = _intern(pows, nzs, &owned);
+    if (!owned)
+        free(pows);
+    return rop;
+}
+
+static const index_set *
+_intern_op(intern_op op, const index_set *x, const index_set *y)
+{
+    const index_set *rop = NULL, *tmp_x = NULL, *tmp_y = NULL;
+    memo_entry *memo, *m = NULL;
+    int *pows;
+    bool owned = false;
+
+    if (x->id == 0 && (x = tmp_x = _intern_copy(x)) == NULL)
+        goto done;
+    if (y->id == 0 && (y = tmp_y = _intern_copy(y)) == NULL)
+        goto done;
+    if ((memo = _memo())) {
+        m = &memo[(x->id * 31 + y->id * 7 + op) % MEMO_SIZE];
+        if (m->result && m->op == op && m->x == x->id && m->y == y->id) {
+            rop = index_set_acquire(m->result);
+            goto done;
+        }
+    }
+    if ((pows = my_calloc(x->nzs, sizeof pows[0])) == NULL)
+        goto done;
+    switch (op) {
+    case INTERN_ADD:
+        if (!_pows_add(pows, x->pows, y->pows, x->nzs)) {
+            fprintf(stderr, "error: overflow in index set\n");
+            free(pows);
+            goto done;
+        }
+        break;
+    case INTERN_UNION:
+        _pows_max(pows, x->pows, y->pows, x->nzs);
+        break;
+    case INTERN_DIFFERENCE:
+        if (!_pows_sub(pows, x->pows, y->pows, x->nzs)) {
+            fprintf(stderr, "error: negative difference in index set\n");
+            index_set_print(x);
+            index_set_print(y);
+            free(pows);
+            goto done;
+        }
+        break;
+    }
+    rop = _intern(pows, x->nzs, &owned);
+    if (!owned)
+        free(pows);
+    if (rop && m) {
+        index_set_release(m->result);
+        m->op = op;
+        m->x = x->id;
+        m->y = y->id;
+        m->result = index_set_acquire(rop);
+    }
+done:
+    index_set_release(tmp_x);
+    index_set_release(tmp_y);
+    return rop;
+}
+
+const index_set *
+index_set_intern_add(const index_set *x, const index_set *y)
+{
+    return _intern_op(INTERN_ADD, x, y);
+}
+
+const index_set *
+index_set_intern_union(const index_set *x, const index_set *y)
+{
+    return _intern_op(INTERN_UNION, x, y);
+}
+
+const index_set *
+index_set_intern_difference(const index_set *x, const index_set *y)
+{
+    return _intern_op(INTERN_DIFFERENCE, x, y);
+}
@@ -8,13 +8,14 @@
 typedef struct {
     int *pows;
     size_t nzs;
+    size_t id;                  // non-zero once interned
 } index_set;
 
 index_set * index_set_new(size_t nzs);
 void        index_set_free(index_set *ix);
 void        index_set_clear(index_set *ix);
 void        index_set_print(const index_set *ix);
-void        index_set_add(index_set *rop, const index_set *x, const index_set *y);
+int         index_set_add(index_set *rop, const index_set *x, const index_set *y);
 void        index_set_set(index_set *rop, const index_set *x);
 index_set * index_set_copy(const index_set *x);
 bool        index_set_eq(const index_set *x, const index_set *y);
@@ -22,3 +23,22 @@ index_set * index_set_union(const index_set *x, const index_set *y);
 index_set * index_set_difference(const index_set *x, const index_set *y);
 index_set * index_set_fread(FILE *fp);
 int         index_set_fwrite(const index_set *ix, FILE *fp);
+
+/* Interning: every equal set maps to one canonical, immutable copy, so that
+ * interned sets compare by pointer.  Each function returning an interned set
+ * gives the caller a reference, dropped with index_set_release, and a set is
+ * freed with its last reference, so long-running processes only keep the
+ * sets still in use.  The arithmetic below memoises its results by operand,
+ * per thread, and interns any operand that is not interned yet. */
+const index_set * index_set_intern(const index_set *ix);
+/* Takes another reference to interned |ix| */
+const index_set * index_set_acquire(const index_set *ix);
+/* Drops a reference to interned |ix|, which may be NULL */
+void              index_set_release(const index_set *ix);
+const index_set * index_set_intern_zero(size_t nzs);
+/* NULL if some exponent overflows */
+const index_set * index_set_intern_add(const index_set *x, const index_set *y);
+const index_set * index_set_intern_union(const index_set *x, const index_set *y);
+/* NULL if y exceeds x anywhere */
+const index_set * index_set_intern_difference(const index_set *x,
+                                              const index_set *y);
@@ -5,17 +5,25 @@
 #include <string.h>
 
 struct encoding_info {
-    index_set *index;
+    const index_set *index;      // interned
 };
 #define my(x) x->info
 
+/* Replaces rop's index set by |ix|, taking over the reference to it */
+static void
+_set_index(encoding *rop, const index_set *ix)
+{
+    index_set_release(my(rop)->index);
+    my(rop)->index = ix;
+}
+
 static int
 _encoding_new(const pp_vtable *vt, encoding *enc, const public_params *pp)
 {
     const obf_params_t *const mp = vt->params(pp);
     if ((my(enc) = calloc(1, sizeof my(enc)[0])) == NULL)
         return ERR;
-    my(enc)->index = index_set_new(mife_params_nzs(&mp->cp));
+    my(enc)->index = index_set_intern_zero(mife_params_nzs(&mp->cp));
     return OK;
 }
 
@@ -23,8 +31,7 @@ static void
 _encoding_free(encoding *enc)
 {
     if (my(enc)) {
-        if (my(enc)->index)
-            index_set_free(my(enc)->index);
+        index_set_release(my(enc)->index);
         free(my(enc));
     }
 }
@@ -41,7 +48,7 @@ _encode(encoding *rop, const void *ix_)
 {
     int *pows;
     const index_set *const ix = ix_;
-    index_set_set(rop->info->index, ix);
+    _set_index(rop, index_set_intern(ix));
     pows = calloc(ix->nzs, sizeof pows[0]);
     if (pows)
         memcpy(pows, ix->pows, ix->nzs * sizeof pows[0]);
@@ -51,7 +58,7 @@ _encode(encoding *rop, const void *ix_)
 static int
 _encoding_set(encoding *rop, const encoding *x)
 {
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -60,7 +67,10 @@ _encoding_mul(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp;
-    index_set_add(my(rop)->index, my(x)->index, my(y)->index);
+    const index_set *index;
+    if ((index = index_set_intern_add(my(x)->index, my(y)->index)) == NULL)
+        return ERR;
+    _set_index(rop, index);
     return OK;
 }
 
@@ -69,7 +79,7 @@ _encoding_add(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -78,7 +88,7 @@ _encoding_sub(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -98,9 +108,13 @@ _encoding_is_zero(const pp_vtable *vt, const encoding *x, const public_params *p
 static int
 _encoding_fread(encoding *x, FILE *fp)
 {
+    index_set *ix;
+
     x->info = calloc(1, sizeof x->info[0]);
-    if ((x->info->index = index_set_fread(fp)) == NULL)
+    if ((ix = index_set_fread(fp)) == NULL)
         goto error;
+    x->info->index = index_set_intern(ix);
+    index_set_free(ix);
     return OK;
 error:
     free(x->info);
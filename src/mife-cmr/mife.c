@@ -1,7 +1,11 @@
 #include "mife.h"
 
+#include "../eval_lanes.h"
 #include "../index_set.h"
 #include "mife_params.h"
+#include "../rand_streams.h"
+#include "../sched.h"
+#include "../sym.h"
 #include "../vtables.h"
 #include "../util.h"
 
@@ -57,6 +61,7 @@ struct mife_ek_t {
     encoding ***uhat;           /* [n][npowers] */
     mife_ct_t *constants;
     long *deg_max;              /* [n] */
+    sched_graph *graph;         /* decryption schedule, recorded once */
     bool local;
 };
 
@@ -235,6 +240,7 @@ mife_ek(const mife_t *mife)
     ek->npowers = mife->npowers;
     ek->uhat = mife->uhat;
     ek->constants = mife->constants;
+    ek->graph = sched_graph_new(ek->cp->circ, NULL);
     ek->local = false;
     return ek;
 }
@@ -262,6 +268,7 @@ mife_ek_free(mife_ek_t *ek)
             free(ek->uhat);
         }
     }
+    sched_graph_free(ek->graph);
     free(ek);
 }
 
@@ -298,6 +305,7 @@ mife_ek_fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     ek->cp = cp;
     ek->enc_vt = get_encoding_vtable(mmap);
     ek->pp_vt = get_pp_vtable(mmap);
+    ek->graph = sched_graph_new(cp->circ, NULL);
     ek->pp = public_params_fread(ek->pp_vt, op, fp);
     bool_fread(&has_consts, fp);
     if (has_consts) {
@@ -321,18 +329,6 @@ error:
     return NULL;
 }
 
-typedef struct {
-    const encoding_vtable *vt;
-    encoding *enc;
-    mpz_t *inps;
-    size_t nslots;
-    index_set *ix;
-    const secret_params *sp;
-    pthread_mutex_t *lock;
-    size_t *count;
-    size_t total;
-} encode_args_t;
-
 size_t
 mife_num_encodings_setup(const circ_params_t *cp, size_t npowers)
 {
@@ -383,41 +379,70 @@ populate_circ_input(const circ_params_t *cp, size_t slot, mpz_t **inputs,
     return OK;
 }
 
-static void
-encode_worker(void *wargs)
+/* The circuit as populate_circ_input sets it up for |slot|: only that slot's
+ * inputs, or the constants for the constants slot, are free */
+static residual *
+_slot_residual(const circ_params_t *cp, size_t slot)
 {
-    encode_args_t *const args = wargs;
+    const size_t nconsts = acirc_nconsts(cp->circ) + acirc_nsecrets(cp->circ);
+    const size_t has_consts = nconsts ? 1 : 0;
+    const size_t ninputs = circ_params_ninputs(cp);
+    mpz_srcptr inputs[ninputs + 1], consts[nconsts + 1];
+    residual *r;
+    size_t idx = 0;
+    mpz_t one;
+
+    mpz_init_set_ui(one, 1);
+    for (size_t i = 0; i < cp->nslots - has_consts; ++i) {
+        for (size_t j = 0; j < cp->ds[i]; ++j)
+            inputs[idx + j] = i == slot ? NULL : one;
+        idx += cp->ds[i];
+    }
+    for (size_t i = 0; i < nconsts; ++i)
+        consts[i] = has_consts && slot == cp->nslots - 1 ? NULL : one;
+    r = residual_new(cp->circ, inputs, consts);
+    if (g_verbose)
+        fprintf(stderr, "    C† for slot %lu: %lu of %lu gates\n", slot,
+                residual_ngates(r), acirc_ngates(cp->circ));
+    mpz_clear(one);
+    return r;
+}
 
-    encode(args->vt, args->enc, args->inps, args->nslots, args->ix, args->sp, 0);
-    if (g_verbose) {
-        pthread_mutex_lock(args->lock);
-        print_progress(++*args->count, args->total);
-        pthread_mutex_unlock(args->lock);
+/* Builds the residual circuit for |slot| once per cache */
+static residual *
+_cached_residual(mife_encrypt_cache_t *cache, const circ_params_t *cp, size_t slot)
+{
+    if (cache->residuals == NULL) {
+        cache->nresiduals = cp->nslots;
+        cache->residuals = my_calloc(cache->nresiduals, sizeof cache->residuals[0]);
     }
-    mpz_vect_free(args->inps, args->nslots);
-    index_set_free(args->ix);
-    free(args);
+    if (cache->residuals[slot] == NULL)
+        cache->residuals[slot] = _slot_residual(cp, slot);
+    return cache->residuals[slot];
 }
 
-static void
-__encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, mpz_t *inps,
-         size_t nslots, index_set *ix, const secret_params *sp,
-         pthread_mutex_t *lock, size_t *count, size_t total)
-{
-    encode_args_t *args = my_calloc(1, sizeof args[0]);
-    args->vt = vt;
-    args->enc = enc;
-    args->inps = my_calloc(nslots, sizeof args->inps[0]);
-    for (size_t i = 0; i < nslots; ++i) {
-        mpz_init_set(args->inps[i], inps[i]);
-    }
-    args->nslots = nslots;
-    args->ix = ix;
-    args->sp = sp;
-    args->lock = lock;
-    args->count = count;
-    args->total = total;
-    threadpool_add_job(pool, encode_worker, args);
+void
+mife_encrypt_cache_finish(mife_encrypt_cache_t *cache)
+{
+    if (cache->batch)
+        encode_batch_flush(cache->batch);
+    threadpool_destroy(cache->pool);
+    encode_batch_free(cache->batch);
+    progress_free(cache->progress);
+    for (size_t i = 0; i < cache->nresiduals; ++i)
+        residual_free(cache->residuals[i]);
+    free(cache->residuals);
+    /* The pool has finished with them now */
+    for (size_t i = 0; i < cache->nfailed; ++i)
+        mife_ct_free(cache->failed[i], cache->cp);
+    free(cache->failed);
+    cache->pool = NULL;
+    cache->batch = NULL;
+    cache->progress = NULL;
+    cache->residuals = NULL;
+    cache->nresiduals = 0;
+    cache->failed = NULL;
+    cache->nfailed = 0;
 }
 
 void
@@ -459,11 +484,11 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     mife_t *mife;
     const circ_params_t *cp = &op->cp;
     const size_t has_consts = acirc_nconsts(cp->circ) + acirc_nsecrets(cp->circ) ? 1 : 0;
-    threadpool *pool = threadpool_create(nthreads);
-    pthread_mutex_t lock;
-    size_t count = 0;
-    size_t total = mife_num_encodings_setup(cp, npowers);
-    index_set *ix;
+    mife_encrypt_cache_t cache = {
+        .pool = threadpool_create(nthreads),
+    };
+    index_set *ix = NULL;
+    const mpz_t *ones;
     mpz_t *moduli;
     mpz_t inps[1 + cp->nslots];
     mpz_vect_init(inps, 1 + cp->nslots);
@@ -485,48 +510,49 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     populate_circ_degrees(cp, mife->deg_max);
 
     moduli = mmap->sk->plaintext_fields(mife->sp->sk);
-    pthread_mutex_init(&lock, NULL);
-
-    if (g_verbose)
-        print_progress(count, total);
+    cache.progress = progress_new("encode", 0, mife_num_encodings_setup(cp, npowers));
+    cache.batch = encode_batch_new(cache.pool, mife->enc_vt, mife->sp,
+                                   1 + cp->nslots, nthreads, cache.progress);
+    for (size_t i = 0; i < 1 + cp->nslots; ++i)
+        mpz_set_ui(inps[i], 1);
+    ones = encode_batch_slots(cache.batch, inps);
+    ix = index_set_new(mife_params_nzs(cp));
 
     {
-        ix = index_set_new(mife_params_nzs(cp));
         if (mpz_cmp_ui(moduli[0], 2) == 0)
             mpz_set_ui(inps[0], 1);
         else
             mpz_randomm_inv(inps[0], rng, moduli[0]);
-        for (size_t i = 0; i < cp->nslots; ++i) {
-            mpz_set_ui(inps[1 + i], 1);
+        for (size_t i = 0; i < cp->nslots; ++i)
             IX_W(ix, cp, i) = 1;
-        }
         IX_Z(ix) = 1;
         /* Encode \hat z = [δ, 1, ..., 1] */
-        __encode(pool, mife->enc_vt, mife->zhat, inps, 1 + cp->nslots,
-                 ix, mife->sp, &lock, &count, total);
+        encode_batch_add(cache.batch, &(encode_job) {
+                .enc = mife->zhat,
+                .slots = ones,
+                .nover = 1,
+                .over = { 0 },
+                .value = { encode_batch_value(cache.batch, inps[0]) },
+                .ix = ix,
+            });
     }
-    for (size_t i = 0; i < 1 + cp->nslots; ++i)
-        mpz_set_ui(inps[i], 1);
     for (size_t i = 0; i < cp->nslots; ++i) {
         mife->uhat[i] = my_calloc(mife->npowers, sizeof mife->uhat[i][0]);
         for (size_t p = 0; p < mife->npowers; ++p) {
-            ix = index_set_new(mife_params_nzs(cp));
+            index_set_clear(ix);
             mife->uhat[i][p] = encoding_new(mife->enc_vt, mife->pp_vt, mife->pp);
             IX_X(ix, cp, i) = 1 << p;
             /* Encode \hat u_i,p = [1, ..., 1] */
-            __encode(pool, mife->enc_vt, mife->uhat[i][p], inps, 1 + cp->nslots,
-                     ix, mife->sp, &lock, &count, total);
+            encode_batch_add(cache.batch, &(encode_job) {
+                    .enc = mife->uhat[i][p],
+                    .slots = ones,
+                    .ix = ix,
+                });
         }
     }
     if (has_consts) {
         /* Encrypt constants as part of setup */
         const size_t nconsts = acirc_nconsts(cp->circ) + acirc_nsecrets(cp->circ);
-        mife_encrypt_cache_t cache = {
-            .pool = pool,
-            .lock = &lock,
-            .count = &count,
-            .total = total,
-        };
         long consts[nconsts];
         mife_sk_t *sk = mife_sk(mife);
         for (size_t i = 0; i < acirc_nconsts(cp->circ); ++i)
@@ -544,26 +570,30 @@ mife_setup(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         mife->Chatstar = NULL;
     } else {
         /* No constants, so encode \hat C* as normal */
-        ix = index_set_new(mife_params_nzs(cp));
+        index_set_clear(ix);
         mife->const_alphas = NULL;
         mife->constants = NULL;
         mife->Chatstar = encoding_new(mife->enc_vt, mife->pp_vt, mife->pp);
         mpz_set_ui(inps[0], 0);
-        for (size_t i = 0; i < cp->nslots; ++i) {
-            mpz_set_ui(inps[1 + i], 1);
+        for (size_t i = 0; i < cp->nslots; ++i)
             IX_X(ix, cp, i) = mife->deg_max[i];
-        }
         IX_Z(ix) = 1;
         /* Encode \hat C* = [0, 1, ..., 1] */
-        __encode(pool, mife->enc_vt, mife->Chatstar, inps, 1 + cp->nslots,
-                 ix, mife->sp, &lock, &count, total);
+        encode_batch_add(cache.batch, &(encode_job) {
+                .enc = mife->Chatstar,
+                .slots = ones,
+                .nover = 1,
+                .over = { 0 },
+                .value = { encode_batch_value(cache.batch, inps[0]) },
+                .ix = ix,
+            });
     }
 
     result = OK;
 cleanup:
+    mife_encrypt_cache_finish(&cache);
+    index_set_free(ix);
     mpz_vect_clear(inps, 1 + cp->nslots);
-    threadpool_destroy(pool);
-    pthread_mutex_destroy(&lock);
     if (result == OK)
         return mife;
     else {
@@ -577,7 +607,6 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
               size_t nthreads, aes_randstate_t rng, mife_encrypt_cache_t *cache,
               mpz_t *_alphas, bool parallelize_circ_eval)
 {
-    (void) parallelize_circ_eval;
     mife_ct_t *ct;
     double start, end, _start, _end;
     const circ_params_t *cp = sk->cp;
@@ -587,8 +616,11 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
     const size_t noutputs = acirc_noutputs(cp->circ);
     const mpz_t *moduli = sk->mmap->sk->plaintext_fields(sk->sp->sk);
     index_set *const ix = index_set_new(mife_params_nzs(cp));
+    mife_encrypt_cache_t own;
+    const mpz_t *ones;
     mpz_t *slots;
     mpz_t *alphas;
+    bool failed = false;
 
     if (g_verbose && !cache)
         fprintf(stderr, "  Encrypting...\n");
@@ -606,109 +638,142 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
     for (size_t o = 0; o < noutputs; ++o)
         ct->what[o] = encoding_new(sk->enc_vt, sk->pp_vt, sk->pp);
 
+    if (cache == NULL) {
+        own = (mife_encrypt_cache_t) {
+            .pool = threadpool_create(nthreads),
+        };
+    }
+    mife_encrypt_cache_t *const c = cache ? cache : &own;
+
     slots = mpz_vect_new(1 + cp->nslots);
     alphas = _alphas ? _alphas : mpz_vect_new(ninputs);
-    for (size_t j = 0; j < ninputs; ++j)
-        mpz_randomm_inv(alphas[j], rng, moduli[1 + slot]);
+    {   /* Each αⱼ is drawn from its own substream.  A shared pool may still
+         * be encoding earlier encryptions, which delays the sampling but
+         * still spreads it over the workers */
+        mpz_ptr *xs = my_calloc(ninputs, sizeof xs[0]);
+        mpz_srcptr *ms = my_calloc(ninputs, sizeof ms[0]);
+        rand_streams rs;
+
+        for (size_t j = 0; j < ninputs; ++j) {
+            xs[j] = alphas[j];
+            ms[j] = moduli[1 + slot];
+        }
+        rand_streams_init(&rs, rng);
+        rand_streams_units(&rs, 0, xs, ms, ninputs, c->pool, nthreads);
+        free(xs);
+        free(ms);
+    }
 
     _end = current_time();
     if (g_verbose && !cache)
         fprintf(stderr, "    Initialize: %.2fs\n", _end - _start);
 
-    threadpool *pool;
-    pthread_mutex_t *lock;
-    size_t *count, total;
-
-    if (cache) {
-        pool = cache->pool;
-        lock = cache->lock;
-        count = cache->count;
-        total = cache->total;
-    } else {
-        pool = threadpool_create(nthreads);
-        lock = my_calloc(1, sizeof lock[0]);
-        pthread_mutex_init(lock, NULL);
-        count = my_calloc(1, sizeof count[0]);
-        total = mife_num_encodings_encrypt(cp, slot);
-    }
-
     _start = current_time();
 
-    if (g_verbose && !cache)
-        print_progress(*count, total);
+    if (cache == NULL)
+        own.progress = progress_new("encode", 0, mife_num_encodings_encrypt(cp, slot));
+    if (c->batch == NULL)
+        c->batch = encode_batch_new(c->pool, sk->enc_vt, sk->sp, 1 + cp->nslots,
+                                    nthreads, c->progress);
+
+    for (size_t i = 0; i < 1 + cp->nslots; ++i)
+        mpz_set_ui(slots[i], 1);
+    ones = encode_batch_slots(c->batch, slots);
 
     /* Encode \hat xⱼ */
     index_set_clear(ix);
     IX_X(ix, cp, slot) = 1;
-    for (size_t i = 0; i < cp->nslots; ++i)
-        mpz_set_ui(slots[1 + i], 1);
     for (size_t j = 0; j < ninputs; ++j) {
-        mpz_set_ui(slots[0],        inputs[j]);
-        mpz_set   (slots[1 + slot], alphas[j]);
+        mpz_set_ui(slots[0], inputs[j]);
         /* Encode \hat xⱼ := [xⱼ, 1, ..., 1, αⱼ, 1, ..., 1] */
-        __encode(pool, sk->enc_vt, ct->xhat[j], slots, 1 + cp->nslots,
-                 index_set_copy(ix), sk->sp, lock, count, total);
+        encode_batch_add(c->batch, &(encode_job) {
+                .enc = ct->xhat[j],
+                .slots = ones,
+                .nover = 2,
+                .over = { 0, 1 + slot },
+                .value = {
+                    encode_batch_value(c->batch, slots[0]),
+                    encode_batch_value(c->batch, alphas[j]),
+                },
+                .ix = ix,
+            });
     }
     /* Encode \hat wₒ */
     if (!_alphas) {
         /* If `_alphas` is given, then we don't encode wₒ, because these will
          * be multiplied into the wₒ's of the first MIFE slot */
-        mpz_t **cs, **const_cs = NULL;
-        mpz_t **circ_inputs, **consts;
-
-        circ_inputs = calloc(circ_params_ninputs(cp), sizeof circ_inputs[0]);
-        for (size_t i = 0; i < circ_params_ninputs(cp); ++i)
-            circ_inputs[i] = mpz_vect_new(1);
-        consts = calloc(nconsts, sizeof consts[0]);
-        for (size_t i = 0; i < nconsts; ++i)
-            consts[i] = mpz_vect_new(1);
-
-        populate_circ_input(cp, slot, circ_inputs, consts, alphas);
-        cs = acirc_eval_mpz(cp->circ, circ_inputs, consts, moduli[1 + slot]);
-        if (slot == 0 && has_consts) {
-            populate_circ_input(cp, cp->nslots - 1, circ_inputs, consts, sk->const_alphas);
-            const_cs = acirc_eval_mpz(cp->circ, circ_inputs, consts, moduli[cp->nslots]);
+        const bool both = slot == 0 && has_consts;
+        /* Lane 0 evaluates C† for this slot, and lane 1 for the constants */
+        const size_t nlanes = both ? 2 : 1;
+        mpz_srcptr ms[2] = { moduli[1 + slot], moduli[cp->nslots] };
+        residual *residuals[2] = {
+            _cached_residual(c, cp, slot),
+            both ? _cached_residual(c, cp, cp->nslots - 1) : NULL,
+        };
+        mpz_t **circ_inputs[2], **consts[2];
+        mpz_t **outputs;
+
+        for (size_t l = 0; l < nlanes; ++l) {
+            circ_inputs[l] = calloc(circ_params_ninputs(cp), sizeof circ_inputs[l][0]);
+            for (size_t i = 0; i < circ_params_ninputs(cp); ++i)
+                circ_inputs[l][i] = mpz_vect_new(1);
+            consts[l] = calloc(nconsts, sizeof consts[l][0]);
+            for (size_t i = 0; i < nconsts; ++i)
+                consts[l][i] = mpz_vect_new(1);
         }
+        populate_circ_input(cp, slot, circ_inputs[0], consts[0], alphas);
+        if (both)
+            populate_circ_input(cp, cp->nslots - 1, circ_inputs[1], consts[1], sk->const_alphas);
+
+        /* The pool encodes the \hat xⱼ, and any earlier encryption sharing
+         * it, while the circuit is evaluated */
+        encode_batch_flush(c->batch);
+        outputs = eval_lanes(cp->circ, circ_inputs, consts, ms, residuals, nlanes,
+                             parallelize_circ_eval ? nthreads : 1);
 
         index_set_clear(ix);
         IX_W(ix, cp, slot) = 1;
-        if (slot == 0 && has_consts) {
+        if (both) {
             for (size_t i = 0; i < cp->nslots; ++i)
                 IX_X(ix, cp, i) = sk->deg_max[i];
             IX_W(ix, cp, cp->nslots - 1) = 1;
             IX_Z(ix) = 1;
         }
         mpz_set_ui(slots[0], 0);
-        for (size_t o = 0; o < noutputs; ++o) {
-            mpz_set(slots[1 + slot], *cs[o]);
-            mpz_vect_free(cs[o], 1);
-            if (slot == 0 && has_consts) {
-                mpz_set(slots[cp->nslots], *const_cs[o]);
-                mpz_vect_free(const_cs[o], 1);
-            }
+        mpz_srcptr zero = encode_batch_value(c->batch, slots[0]);
+        failed = outputs == NULL;
+        for (size_t o = 0; o < noutputs && !failed; ++o) {
             /* Encode \hat wₒ = [0, 1, ..., 1, C†ₒ, 1, ..., 1] */
-            __encode(pool, sk->enc_vt, ct->what[o], slots, 1 + cp->nslots,
-                     index_set_copy(ix), sk->sp, lock, count, total);
+            encode_batch_add(c->batch, &(encode_job) {
+                    .enc = ct->what[o],
+                    .slots = ones,
+                    .nover = both ? 3 : 2,
+                    .over = { 0, 1 + slot, cp->nslots },
+                    .value = {
+                        zero,
+                        encode_batch_value(c->batch, outputs[o][0]),
+                        both ? encode_batch_value(c->batch, outputs[o][1]) : NULL,
+                    },
+                    .ix = ix,
+                });
+            mpz_vect_free(outputs[o], nlanes);
+        }
+        free(outputs);
+        encode_batch_flush(c->batch);
+
+        for (size_t l = 0; l < nlanes; ++l) {
+            for (size_t i = 0; i < circ_params_ninputs(cp); ++i)
+                mpz_vect_free(circ_inputs[l][i], 1);
+            free(circ_inputs[l]);
+            for (size_t i = 0; i < nconsts; ++i)
+                mpz_vect_free(consts[l][i], 1);
+            free(consts[l]);
         }
-        free(cs);
-        if (const_cs)
-            free(const_cs);
-
-        for (size_t i = 0; i < circ_params_ninputs(cp); ++i)
-            mpz_vect_free(circ_inputs[i], 1);
-        free(circ_inputs);
-        for (size_t i = 0; i < nconsts; ++i)
-            mpz_vect_free(consts[i], 1);
-        free(consts);
         mpz_vect_free(alphas, ninputs);
     }
 
-    if (!cache) {
-        threadpool_destroy(pool);
-        pthread_mutex_destroy(lock);
-        free(lock);
-        free(count);
-    }
+    if (!cache)
+        mife_encrypt_cache_finish(&own);
 
     _end = current_time();
     if (g_verbose && !cache)
@@ -721,6 +786,22 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
     if (g_verbose && !cache)
         fprintf(stderr, "    Total: %.2fs\n", end - start);
 
+    if (failed) {
+        fprintf(stderr, "error: mife encrypt: unable to evaluate circuit\n");
+        if (cache) {
+            /* The \hat xⱼ may still be queued on the shared pool, so the
+             * ciphertext is freed once mife_encrypt_cache_finish drains it */
+            mife_ct_t **tmp;
+            if ((tmp = my_realloc(cache->failed, (cache->nfailed + 1) * sizeof tmp[0])) == NULL)
+                return NULL;    /* leaked rather than freed under the pool */
+            cache->failed = tmp;
+            cache->failed[cache->nfailed++] = ct;
+            cache->cp = cp;
+        } else {
+            mife_ct_free(ct, cp);
+        }
+        return NULL;
+    }
     return ct;
 }
 
@@ -732,30 +813,40 @@ mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
         fprintf(stderr, "error: mife encrypt: invalid input\n");
         return NULL;
     }
-    return _mife_encrypt(sk, slot, inputs, nthreads, rng, NULL, NULL, false);
+    return _mife_encrypt(sk, slot, inputs, nthreads, rng, NULL, NULL, true);
+}
+
+/* The largest power we have that fits within diff */
+static size_t
+_raise_power(size_t npowers, size_t diff)
+{
+    size_t p = 0;
+    while (((size_t) 1 << (p+1)) <= diff && (p+1) < npowers)
+        p++;
+    return p;
 }
 
 static void
 _raise_encoding(const mife_ek_t *ek, encoding *x, encoding **us, size_t diff)
 {
     while (diff > 0) {
-        size_t p = 0;
-        while (((size_t) 1 << (p+1)) <= diff && (p+1) < ek->npowers)
-            p++;
-        encoding_mul(ek->enc_vt, ek->pp_vt, x, x, us[p], ek->pp);
-        diff -= (1 << p);
+        const size_t p = _raise_power(ek->npowers, diff);
+        const size_t n = diff >> p;
+        encoding_raise_inplace(ek->enc_vt, ek->pp_vt, x, us[p], n, ek->pp);
+        diff -= n << p;
     }
 }
 
 static int
-raise_encoding(const mife_ek_t *ek, encoding *x, const index_set *target)
+raise_encoding(encoding *x, const void *target, void *vek)
 {
+    const mife_ek_t *const ek = vek;
     const circ_params_t *const cp = ek->cp;
     const size_t has_consts = acirc_nconsts(cp->circ) + acirc_nsecrets(cp->circ) ? 1 : 0;
-    index_set *ix;
+    const index_set *ix;
     size_t diff;
 
-    ix = index_set_difference(target, ek->enc_vt->mmap_set(x));
+    ix = index_set_intern_difference(target, ek->enc_vt->mmap_set(x));
     if (ix == NULL)
         return ERR;
     for (size_t i = 0; i < cp->nslots - has_consts; i++) {
@@ -768,48 +859,22 @@ raise_encoding(const mife_ek_t *ek, encoding *x, const index_set *target)
         if (diff > 0)
             _raise_encoding(ek, x, ek->uhat[cp->nslots - 1], diff);
     }
-    index_set_free(ix);
+    index_set_release(ix);
     return OK;
 }
 
-static int
-raise_encodings(const mife_ek_t *ek, encoding *x, encoding *y)
-{
-    index_set *ix;
-    int ret = ERR;
-    ix = index_set_union(ek->enc_vt->mmap_set(x), ek->enc_vt->mmap_set(y));
-    if (ix == NULL)
-        goto cleanup;
-    if (raise_encoding(ek, x, ix) == ERR)
-        goto cleanup;
-    if (raise_encoding(ek, y, ix) == ERR)
-        goto cleanup;
-    ret = OK;
-cleanup:
-    if (ix)
-        index_set_free(ix);
-    return ret;
-}
-
 typedef struct {
     circ_params_t *cp;
     const mife_ct_t **cts;
     mife_ek_t *ek;
     size_t *kappas;
+    encoding_pool *pool;
+    eval_cache *cache;          /* shared across a batch, if any */
+    const size_t *syms;         /* [nslots] symbol of each slot, for the cache */
+    encoding **hits;            /* [nrefs] cached gates for these ciphertexts */
+    const bool *needed;         /* [nrefs] refs these ciphertexts must compute */
 } decrypt_args_t;
 
-static void *
-copy_f(void *x, void *args_)
-{
-    decrypt_args_t *args = args_;
-    mife_ek_t *ek = args->ek;
-    encoding *out;
-
-    out = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-    encoding_set(ek->enc_vt, out, x);
-    return out;
-}
-
 static void *
 input_f(size_t ref, size_t i, void *args_)
 {
@@ -818,53 +883,73 @@ input_f(size_t ref, size_t i, void *args_)
     const size_t slot = circ_params_slot(args->cp, i);
     const size_t bit = circ_params_bit(args->cp, i);
     /* XXX: check that slot and bit are valid! */
-    return copy_f(args->cts[slot]->xhat[bit], args_);
+    if (!circ_params_needs_ref(args->cp, ref)
+        || (args->needed && !args->needed[ref]))
+        return NULL;
+    return encoding_ref(args->cts[slot]->xhat[bit]);
 }
 
 static void *
 const_f(size_t ref, size_t i, long val, void *args_)
 {
-    (void) ref; (void) val;
+    (void) val;
     decrypt_args_t *args = args_;
     const size_t bit = circ_params_bit(args->cp, acirc_ninputs(args->cp->circ) + i);
     /* XXX: check that bit is valid! */
-    return copy_f(args->ek->constants->xhat[bit], args_);
+    if (!circ_params_needs_ref(args->cp, ref)
+        || (args->needed && !args->needed[ref]))
+        return NULL;
+    return encoding_ref(args->ek->constants->xhat[bit]);
 }
 
 static void *
 eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref, const void *y_, void *args_)
 {
-    (void) ref; (void) xref; (void) yref;
+    (void) xref; (void) yref;
     decrypt_args_t *args = args_;
     mife_ek_t *ek = args->ek;
     const encoding *x = x_;
     const encoding *y = y_;
-    encoding *res;
+    encoding *res = NULL;
 
-    res = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+    if (!circ_params_needs_ref(args->cp, ref))
+        return NULL;
+    if (args->hits && args->hits[ref])
+        return encoding_ref(args->hits[ref]);
+    if (args->needed && !args->needed[ref])
+        return NULL;
     switch (op) {
     case ACIRC_OP_MUL:
+        res = encoding_pool_get(args->pool);
         encoding_mul(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
         break;
     case ACIRC_OP_ADD:
     case ACIRC_OP_SUB: {
-        encoding *tmp_x, *tmp_y;
-        tmp_x = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-        tmp_y = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-        encoding_set(ek->enc_vt, tmp_x, x);
-        encoding_set(ek->enc_vt, tmp_y, y);
-        if (!index_set_eq(ek->enc_vt->mmap_set(tmp_x), ek->enc_vt->mmap_set(tmp_y)))
-            raise_encodings(ek, tmp_x, tmp_y);
+        encoding *tmp_x = NULL, *tmp_y = NULL;
+        if (!index_set_eq(ek->enc_vt->mmap_set(x), ek->enc_vt->mmap_set(y)))
+            encoding_pool_raise_pair(args->pool, &x, &y, &tmp_x, &tmp_y,
+                                     raise_encoding, ek);
+        /* A raised copy is ours, so the result can overwrite it */
+        if (tmp_x) {
+            res = tmp_x;
+            tmp_x = NULL;
+        } else if (tmp_y) {
+            res = tmp_y;
+            tmp_y = NULL;
+        } else {
+            res = encoding_pool_get(args->pool);
+        }
         if (op == ACIRC_OP_ADD) {
-            encoding_add(ek->enc_vt, ek->pp_vt, res, tmp_x, tmp_y, ek->pp);
+            encoding_add(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
         } else {
-            encoding_sub(ek->enc_vt, ek->pp_vt, res, tmp_x, tmp_y, ek->pp);
+            encoding_sub(ek->enc_vt, ek->pp_vt, res, x, y, ek->pp);
         }
-        encoding_free(ek->enc_vt, tmp_x);
-        encoding_free(ek->enc_vt, tmp_y);
+        encoding_pool_put(args->pool, tmp_y);
         break;
     }
     }
+    if (args->cache)
+        eval_cache_offer(args->cache, args->syms, ref, res);
     return res;
 }
 
@@ -879,13 +964,15 @@ output_f(size_t ref, size_t o, void *x, void *args_)
     encoding *out, *lhs, *rhs;
     const index_set *const toplevel = ek->pp_vt->toplevel(ek->pp);
 
-    out = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-    lhs = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
-    rhs = encoding_new(ek->enc_vt, ek->pp_vt, ek->pp);
+    if (!circ_params_needs_output(cp, o))
+        return (void *) 0;
+    out = encoding_pool_get(args->pool);
+    lhs = encoding_pool_get(args->pool);
+    rhs = encoding_pool_get(args->pool);
 
     /* Compute LHS */
     encoding_mul(ek->enc_vt, ek->pp_vt, lhs, x, ek->zhat, ek->pp);
-    raise_encoding(ek, lhs, toplevel);
+    raise_encoding(lhs, toplevel, ek);
     if (!index_set_eq(ek->enc_vt->mmap_set(lhs), toplevel)) {
         fprintf(stderr, "error: lhs != toplevel\n");
         index_set_print(ek->enc_vt->mmap_set(lhs));
@@ -896,11 +983,11 @@ output_f(size_t ref, size_t o, void *x, void *args_)
     if (ek->Chatstar) {
         encoding_set(ek->enc_vt, rhs, ek->Chatstar);
         for (size_t i = 0; i < cp->nslots; ++i)
-            encoding_mul(ek->enc_vt, ek->pp_vt, rhs, rhs, args->cts[i]->what[o], ek->pp);
+            encoding_mul_inplace(ek->enc_vt, ek->pp_vt, rhs, args->cts[i]->what[o], ek->pp);
     } else {
         encoding_set(ek->enc_vt, rhs, args->cts[0]->what[o]);
         for (size_t i = 1; i < cp->nslots - 1; ++i)
-            encoding_mul(ek->enc_vt, ek->pp_vt, rhs, rhs, args->cts[i]->what[o], ek->pp);
+            encoding_mul_inplace(ek->enc_vt, ek->pp_vt, rhs, args->cts[i]->what[o], ek->pp);
     }
     if (!index_set_eq(ek->enc_vt->mmap_set(rhs), toplevel)) {
         fprintf(stderr, "error: rhs != toplevel\n");
@@ -914,9 +1001,9 @@ output_f(size_t ref, size_t o, void *x, void *args_)
         args->kappas[o] = encoding_get_degree(ek->enc_vt, out);
 
 cleanup:
-    encoding_free(ek->enc_vt, out);
-    encoding_free(ek->enc_vt, lhs);
-    encoding_free(ek->enc_vt, rhs);
+    encoding_pool_put(args->pool, out);
+    encoding_pool_put(args->pool, lhs);
+    encoding_pool_put(args->pool, rhs);
     return (void *) output;
 }
 
@@ -924,12 +1011,13 @@ static void
 free_f(void *x, void *args_)
 {
     decrypt_args_t *args = args_;
-    if (x)
-        encoding_free(args->ek->enc_vt, x);
+    encoding_pool_put(args->pool, x);
 }
 
-static int
-mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts, size_t nthreads, size_t *kappa)
+int
+_mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts,
+              size_t nthreads, size_t *kappa, eval_cache *cache,
+              const size_t *syms)
 {
     const circ_params_t *cp = ek->cp;
     acirc_t *circ = cp->circ;
@@ -939,9 +1027,16 @@ mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts, size_t nthre
         return ERR;
 
     size_t *kappas = NULL;
+    encoding **hits = NULL;
+    bool *needed = NULL;
 
     if (kappa)
         kappas = my_calloc(acirc_noutputs(cp->circ), sizeof kappas[0]);
+    if (cache) {
+        hits = my_calloc(acirc_nrefs(circ), sizeof hits[0]);
+        needed = my_calloc(acirc_nrefs(circ), sizeof needed[0]);
+        eval_cache_plan(cache, syms, hits, needed);
+    }
 
     {
         long *tmp;
@@ -950,13 +1045,27 @@ mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts, size_t nthre
             .cts = cts,
             .ek = ek,
             .kappas = kappas,
+            .pool = encoding_pool_new(ek->enc_vt, ek->pp_vt, ek->pp),
+            .cache = cache,
+            .syms = syms,
+            .hits = hits,
+            .needed = needed,
         };
-        tmp = (long *) acirc_traverse(circ, input_f, const_f, eval_f, output_f, free_f, &args, nthreads);
-        if (rop)
+        tmp = (long *) sched_graph_traverse(ek->graph, input_f, const_f,
+                                            eval_f, output_f, free_f, &args,
+                                            nthreads);
+        if (tmp == NULL)
+            ret = ERR;
+        else if (rop)
             for (size_t i = 0; i < acirc_noutputs(circ); ++i)
                 rop[i] = tmp[i];
         free(tmp);
+        if (g_verbose)
+            encoding_pool_print(args.pool);
+        encoding_pool_free(args.pool);
     }
+    free(hits);
+    free(needed);
 
     if (kappa) {
         size_t maxkappa = 0;
@@ -971,6 +1080,150 @@ mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts, size_t nthre
     return ret;
 }
 
+static int
+mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts, size_t nthreads, size_t *kappa)
+{
+    return _mife_decrypt(ek, rop, cts, nthreads, kappa, NULL, NULL);
+}
+
+/* Symbolic decryption for choosing κ */
+
+typedef struct {
+    const circ_params_t *cp;
+    size_t npowers;
+    const index_set *toplevel;
+    size_t max_npowers;
+    bool failed;
+} sym_args_t;
+
+static int
+sym_raise(sym_args_t *args, sym_t *x, const index_set *target)
+{
+    const circ_params_t *const cp = args->cp;
+    index_set *ix;
+
+    if ((ix = index_set_difference(target, x->ix)) == NULL)
+        return ERR;
+    for (size_t i = 0; i < cp->nslots; i++) {
+        size_t diff = IX_X(ix, cp, i);
+        while (diff > 0) {
+            const size_t p = _raise_power(args->npowers, diff);
+            if (p + 1 > args->max_npowers)
+                args->max_npowers = p + 1;
+            IX_X(x->ix, cp, i) += 1 << p;
+            x->degree++;
+            diff -= 1 << p;
+        }
+    }
+    index_set_free(ix);
+    return OK;
+}
+
+static void *
+sym_input_f(size_t ref, size_t i, void *args_)
+{
+    (void) ref;
+    sym_args_t *args = args_;
+    sym_t *x = sym_new(mife_params_nzs(args->cp), 1);
+    IX_X(x->ix, args->cp, circ_params_slot(args->cp, i)) = 1;
+    return x;
+}
+
+static void *
+sym_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) ref; (void) i; (void) val;
+    sym_args_t *args = args_;
+    sym_t *x = sym_new(mife_params_nzs(args->cp), 1);
+    IX_X(x->ix, args->cp, args->cp->nslots - 1) = 1;
+    return x;
+}
+
+static int
+sym_raise_operand(sym_t *x, const index_set *target, size_t ref, bool y,
+                  void *args)
+{
+    (void) ref; (void) y;
+    return sym_raise(args, x, target);
+}
+
+static void *
+sym_eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref,
+           const void *y_, void *args_)
+{
+    (void) xref; (void) yref;
+    sym_args_t *args = args_;
+    return sym_eval(mife_params_nzs(args->cp), ref, op, x_, y_,
+                    sym_raise_operand, args, &args->failed);
+}
+
+static void *
+sym_output_f(size_t ref, size_t o, void *x_, void *args_)
+{
+    (void) ref;
+    sym_args_t *args = args_;
+    const circ_params_t *const cp = args->cp;
+    const size_t has_consts = acirc_nconsts(cp->circ) + acirc_nsecrets(cp->circ) ? 1 : 0;
+    const sym_t *x = x_;
+    sym_t lhs = { index_set_copy(x->ix), x->degree + 1 };
+    size_t degree = 0;
+
+    /* Multiply by zhat */
+    IX_Z(lhs.ix) += 1;
+    for (size_t i = 0; i < cp->nslots; ++i)
+        IX_W(lhs.ix, cp, i) += 1;
+    if (sym_raise(args, &lhs, args->toplevel) == ERR
+        || !index_set_eq(lhs.ix, args->toplevel)) {
+        fprintf(stderr, "error: output %lu does not reach the top level\n", o);
+        args->failed = true;
+        goto cleanup;
+    }
+    /* Chatstar times every what, or the whats alone when the constants carry
+     * Chatstar */
+    degree = max(lhs.degree, has_consts ? cp->nslots - 1 : cp->nslots + 1);
+cleanup:
+    index_set_free(lhs.ix);
+    return (void *) degree;
+}
+
+static int
+mife_analyze(const obf_params_t *op, size_t npowers, size_t *kappa,
+             size_t *max_npowers, size_t *degrees)
+{
+    const circ_params_t *cp = &op->cp;
+    const size_t noutputs = acirc_noutputs(cp->circ);
+    index_set *toplevel;
+    long *tmp;
+    int ret = ERR;
+
+    toplevel = mife_params_new_toplevel(cp, mife_params_nzs(cp));
+    sym_args_t args = {
+        .cp = cp,
+        .npowers = npowers,
+        .toplevel = toplevel,
+        .max_npowers = 0,
+        .failed = false,
+    };
+    tmp = (long *) acirc_traverse(cp->circ, sym_input_f, sym_const_f, sym_eval_f,
+                                  sym_output_f, sym_free_f, &args, 1);
+    if (tmp == NULL || args.failed)
+        goto cleanup;
+    *kappa = 0;
+    for (size_t o = 0; o < noutputs; o++) {
+        if ((size_t) tmp[o] > *kappa)
+            *kappa = tmp[o];
+        if (degrees)
+            degrees[o] = tmp[o];
+    }
+    if (max_npowers)
+        *max_npowers = args.max_npowers;
+    ret = OK;
+cleanup:
+    free(tmp);
+    index_set_free(toplevel);
+    return ret;
+}
+
 mife_vtable mife_cmr_vtable = {
     .mife_setup = mife_setup,
     .mife_free = mife_free,
@@ -987,4 +1240,5 @@ mife_vtable mife_cmr_vtable = {
     .mife_ct_fread = mife_ct_fread,
     .mife_encrypt = mife_encrypt,
     .mife_decrypt = mife_decrypt,
+    .mife_analyze = mife_analyze,
 };
@@ -1,16 +1,30 @@
 #pragma once
 
+#include "../encode_batch.h"
+#include "../eval_cache.h"
+#include "../eval_lanes.h"
 #include "../mife.h"
 #include "../mmap.h"
 #include <threadpool.h>
 
+/* Shares a pool, and the progress count, between encryptions */
 typedef struct {
     threadpool *pool;
-    pthread_mutex_t *lock;
-    size_t *count;
-    size_t total;
+    encode_batch *batch;        /* NULL until the first encryption */
+    progress *progress;
+    residual **residuals;       /* [nresiduals] per slot, once C† is needed */
+    size_t nresiduals;
+    mife_ct_t **failed;         /* [nfailed] failed encryptions whose encodings
+                                 * may still be queued */
+    size_t nfailed;
+    const circ_params_t *cp;    /* theirs, for freeing them */
 } mife_encrypt_cache_t;
 
+/* Waits for the encryptions' encodings, and destroys the pool, progress,
+ * residuals and the failed encryptions */
+void
+mife_encrypt_cache_finish(mife_encrypt_cache_t *cache);
+
 typedef mife_t mife_cmr_mife_t;
 typedef mife_sk_t mife_cmr_mife_sk_t;
 
@@ -19,6 +33,13 @@ _mife_encrypt(const mife_sk_t *sk, const size_t slot, const long *inputs,
               size_t nthreads, aes_randstate_t rng, mife_encrypt_cache_t *cache,
               mpz_t *alphas, bool parallelize_circ_eval);
 
+/* Decrypts like mife_decrypt, reusing and adding to the gates in |cache|,
+ * which are keyed by |syms|, the symbol each ciphertext encrypts */
+int
+_mife_decrypt(const mife_ek_t *ek, long *rop, const mife_ct_t **cts,
+              size_t nthreads, size_t *kappa, eval_cache *cache,
+              const size_t *syms);
+
 extern mife_vtable mife_cmr_vtable;
 extern op_vtable mife_cmr_op_vtable;
 
@@ -28,4 +28,9 @@ typedef struct {
                                 size_t nthreads, aes_randstate_t rng);
     int         (*mife_decrypt)(const mife_ek_t *ek, long *rop, const mife_ct_t **cts,
                                 size_t nthreads, size_t *kappa);
+    /* Computes κ, the number of powers decryption uses and the degree of
+     * each output symbolically, without running setup */
+    int         (*mife_analyze)(const obf_params_t *op, size_t npowers,
+                                size_t *kappa, size_t *max_npowers,
+                                size_t *degrees);
 } mife_vtable;
@@ -381,6 +381,16 @@ mife_run_smart_kappa(const mife_vtable *vt, const char *circuit,
     if (g_verbose)
         fprintf(stderr, "Choosing κ smartly... ");
 
+    if (vt->mife_analyze) {
+        if (vt->mife_analyze(op, npowers, &kappa, NULL, NULL) == ERR) {
+            fprintf(stderr, "error: %s: unable to determine κ smartly\n", __func__);
+            kappa = 0;
+        }
+        if (g_verbose)
+            fprintf(stderr, "%lu\n", kappa);
+        return kappa;
+    }
+
     g_verbose = false;
     if (mife_run_setup(&dummy_vtable, vt, circuit, op, 8, &kappa, npowers, nthreads, rng) == ERR)
         goto cleanup;
@@ -1,5 +1,7 @@
 #include "mmap.h"
 #include "obfuscator.h"
+#include "progress.h"
+#include "sched.h"
 #include "util.h"
 
 #include "mife_run.h"
@@ -20,6 +22,7 @@
 #include <err.h>
 #include <getopt.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -128,6 +131,9 @@ args_usage(void)
 "    --mmap M           set mmap to M (options: CLT, DUMMY | default: %s)\n"
 "    --smart            be smart when choosing parameters\n"
 "    --nthreads N       set the number of threads to N (default: %lu)\n"
+"    --sched S          schedule gates across threads with S (options: STEAL, LIVE (both experimental), ACIRC | default: ACIRC)\n"
+"    --progress P       report progress when verbose as P (options: BAR, MACHINE | default: BAR)\n"
+"    --seed S           seed the randomness with the string S, for reproducible output\n"
 "    --verbose          be verbose\n"
 "    --help             print this message and exit\n",
 mmap, defaults.nthreads);
@@ -148,6 +154,60 @@ args_get_size_t(size_t *result, int *argc, char ***argv)
     return OK;
 }
 
+/* Parses a comma-separated list of output indices and ranges, e.g. 0,4-7,
+ * each less than |max|.  Done once the circuit is read, so it bounds the
+ * list before expanding any range */
+static int
+parse_outputs(const char *list, size_t max, size_t **outputs, size_t *noutputs)
+{
+    const char *str = list;
+    char *endptr;
+    size_t *tmp;
+
+    *outputs = NULL;
+    *noutputs = 0;
+    while (true) {
+        size_t lo, hi;
+        lo = hi = strtoul(str, &endptr, 10);
+        if (endptr == str)
+            goto error;
+        if (*endptr == '-') {
+            str = endptr + 1;
+            hi = strtoul(str, &endptr, 10);
+            if (endptr == str || hi < lo)
+                goto error;
+        }
+        if (hi >= max) {
+            fprintf(stderr, "%s: no output %lu (circuit has %lu)\n",
+                    errorstr, hi, max);
+            goto cleanup;
+        }
+        if (hi - lo + 1 > max - *noutputs) {
+            fprintf(stderr, "%s: output list '%s' is longer than the %lu outputs\n",
+                    errorstr, list, max);
+            goto cleanup;
+        }
+        if ((tmp = my_realloc(*outputs, (*noutputs + hi - lo + 1) * sizeof tmp[0])) == NULL)
+            goto cleanup;
+        *outputs = tmp;
+        for (size_t o = lo; o <= hi; ++o)
+            (*outputs)[(*noutputs)++] = o;
+        if (*endptr == '\0')
+            break;
+        if (*endptr != ',')
+            goto error;
+        str = endptr + 1;
+    }
+    return OK;
+error:
+    fprintf(stderr, "%s: invalid output list '%s'\n", errorstr, list);
+cleanup:
+    free(*outputs);
+    *outputs = NULL;
+    *noutputs = 0;
+    return ERR;
+}
+
 typedef struct {
     size_t secparam;
     size_t npowers;
@@ -231,9 +291,21 @@ mife_encrypt_handle_options(int *argc, char ***argv, void *vargs)
     return OK;
 }
 
-#define mife_decrypt_args_t mife_encrypt_args_t
-#define mife_decrypt_args_init mife_encrypt_args_init
-#define mife_decrypt_handle_options mife_encrypt_handle_options
+typedef struct {
+    mife_scheme_e scheme;
+    const char *outputs_list;   /* parsed once the circuit is read */
+    size_t *outputs;
+    size_t noutputs;
+} mife_decrypt_args_t;
+
+static void
+mife_decrypt_args_init(mife_decrypt_args_t *args)
+{
+    args->scheme = MIFE_SCHEME_DEFAULT;
+    args->outputs_list = NULL;
+    args->outputs = NULL;
+    args->noutputs = 0;
+}
 
 static void
 mife_decrypt_usage(bool longform, int ret)
@@ -241,12 +313,30 @@ mife_decrypt_usage(bool longform, int ret)
     printf("usage: %s mife decrypt [<args>] circuit\n", progname);
     if (longform) {
         printf("\nAvailable arguments:\n\n");
+        printf("    --outputs LIST     only compute outputs LIST (e.g. 0,4-7)\n");
         args_usage();
         printf("\n");
     }
     exit(ret);
 }
 
+static int
+mife_decrypt_handle_options(int *argc, char ***argv, void *vargs)
+{
+    mife_decrypt_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    if (!strcmp(cmd, "--scheme")) {
+        if (args_get_mife_scheme(&args->scheme, argc, argv) == ERR) return ERR;
+    } else if (!strcmp(cmd, "--outputs")) {
+        if (*argc <= 1) return ERR;
+        args->outputs_list = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else {
+        return ERR;
+    }
+    return OK;
+}
+
 typedef struct {
     size_t secparam;
     size_t npowers;
@@ -348,6 +438,7 @@ typedef struct {
     size_t kappa;
     size_t wordsize;
     obf_scheme_e scheme;
+    const char *checkpoint;
 } obf_obfuscate_args_t;
 
 static void
@@ -358,6 +449,7 @@ obf_obfuscate_args_init(obf_obfuscate_args_t *args)
     args->scheme = OBF_SCHEME_CMR;
     args->kappa = 0;
     args->wordsize = WORDSIZE_DEFAULT;
+    args->checkpoint = NULL;
 }
 
 static void
@@ -371,6 +463,7 @@ obf_obfuscate_or_test_usage(bool longform, int ret, const char *cmd)
 "    --npowers N        set the number of powers to N (default: %d)\n"
 "    --scheme S         set obfuscation scheme to S (options: CMR, LZ, POLYLOG | default: %s)\n"
 "    --kappa Κ          set multilinearity to Κ\n"
+"    --checkpoint DIR   record progress in DIR and resume from it (LZ only)\n"
 , SECPARAM_DEFAULT, NPOWERS_DEFAULT, OBF_SCHEME_DEFAULT_STR);
         args_usage();
         printf(
@@ -403,6 +496,10 @@ obf_obfuscate_handle_options(int *argc, char ***argv, void *vargs)
         if (args_get_size_t(&args->kappa, argc, argv) == ERR) return ERR;
     } else if (!strcmp(cmd, "--wordsize")) {
         if (args_get_size_t(&args->wordsize, argc, argv) == ERR) return ERR;
+    } else if (!strcmp(cmd, "--checkpoint")) {
+        if (*argc <= 1) return ERR;
+        args->checkpoint = (*argv)[1];
+        (*argv)++; (*argc)--;
     } else {
         return ERR;
     }
@@ -412,24 +509,40 @@ obf_obfuscate_handle_options(int *argc, char ***argv, void *vargs)
 typedef struct {
     size_t npowers;
     obf_scheme_e scheme;
+    const char *outputs_list;   /* parsed once the circuit is read */
+    size_t *outputs;
+    size_t noutputs;
+    char *batch;
+    size_t budget;
 } obf_evaluate_args_t;
 
+#define CACHE_BUDGET_DEFAULT 1024
+
 static void
 obf_evaluate_args_init(obf_evaluate_args_t *args)
 {
     args->npowers = NPOWERS_DEFAULT;
     args->scheme = OBF_SCHEME_CMR;
+    args->outputs_list = NULL;
+    args->outputs = NULL;
+    args->noutputs = 0;
+    args->batch = NULL;
+    args->budget = CACHE_BUDGET_DEFAULT;
 }
 
 static void
 obf_evaluate_usage(bool longform, int ret)
 {
     printf("usage: %s obf evaluate [<args>] circuit input\n", progname);
+    printf("       %s obf evaluate [<args>] --batch FILE circuit\n", progname);
     if (longform) {
         printf("\nAvailable arguments:\n\n");
         printf("    --scheme S         set obfuscation scheme to S (options: CMR, LZ, POLYLOG | default: CMR)\n"
-               "    --npowers N        set the number of powers to N (default: %d)\n",
-               NPOWERS_DEFAULT);
+               "    --npowers N        set the number of powers to N (default: %d)\n"
+               "    --outputs LIST     only compute outputs LIST (e.g. 0,4-7)\n"
+               "    --batch FILE       evaluate each input in FILE, one per line\n"
+               "    --cache-budget MB  reuse up to MB of gate encodings across a batch (default: %d)\n",
+               NPOWERS_DEFAULT, CACHE_BUDGET_DEFAULT);
         args_usage();
         printf("\n");
     }
@@ -445,6 +558,66 @@ obf_evaluate_handle_options(int *argc, char ***argv, void *vargs)
         if (args_get_size_t(&args->npowers, argc, argv) == ERR) return ERR;
     } else if (!strcmp(cmd, "--scheme")) {
         if (args_get_obf_scheme(&args->scheme, argc, argv) == ERR) return ERR;
+    } else if (!strcmp(cmd, "--outputs")) {
+        if (*argc <= 1) return ERR;
+        args->outputs_list = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else if (!strcmp(cmd, "--batch")) {
+        if (*argc <= 1) return ERR;
+        args->batch = (*argv)[1];
+        (*argv)++; (*argc)--;
+    } else if (!strcmp(cmd, "--cache-budget")) {
+        if (args_get_size_t(&args->budget, argc, argv) == ERR) return ERR;
+    } else {
+        return ERR;
+    }
+    return OK;
+}
+
+typedef struct {
+    size_t npowers;
+    obf_scheme_e scheme;
+    char *socket;
+} obf_serve_args_t;
+
+static void
+obf_serve_args_init(obf_serve_args_t *args)
+{
+    args->npowers = NPOWERS_DEFAULT;
+    args->scheme = OBF_SCHEME_CMR;
+    args->socket = NULL;
+}
+
+static void
+obf_serve_usage(bool longform, int ret)
+{
+    printf("usage: %s obf serve [<args>] circuit\n", progname);
+    if (longform) {
+        printf("\nReads one input per line and writes one result per line.\n");
+        printf("\nAvailable arguments:\n\n");
+        printf("    --scheme S         set obfuscation scheme to S (options: CMR, LZ, POLYLOG | default: CMR)\n"
+               "    --npowers N        set the number of powers to N (default: %d)\n"
+               "    --socket PATH      serve on UNIX domain socket PATH instead of stdin\n",
+               NPOWERS_DEFAULT);
+        args_usage();
+        printf("\n");
+    }
+    exit(ret);
+}
+
+static int
+obf_serve_handle_options(int *argc, char ***argv, void *vargs)
+{
+    obf_serve_args_t *args = vargs;
+    const char *cmd = (*argv)[0];
+    if (!strcmp(cmd, "--npowers")) {
+        if (args_get_size_t(&args->npowers, argc, argv) == ERR) return ERR;
+    } else if (!strcmp(cmd, "--scheme")) {
+        if (args_get_obf_scheme(&args->scheme, argc, argv) == ERR) return ERR;
+    } else if (!strcmp(cmd, "--socket")) {
+        if (*argc <= 1) return ERR;
+        args->socket = (*argv)[1];
+        (*argv)++; (*argc)--;
     } else {
         return ERR;
     }
@@ -513,6 +686,41 @@ handle_options(int *argc, char ***argv, int left, args_t *args, void *others,
         } else if (!strcmp(cmd, "--nthreads")) {
             if (args_get_size_t(&args->nthreads, argc, argv) == ERR)
                 f(false, EXIT_FAILURE);
+        } else if (!strcmp(cmd, "--sched")) {
+            if (*argc <= 1)
+                f(false, EXIT_FAILURE);
+            const char *sched = (*argv)[1];
+            if (!strcmp(sched, "STEAL")) {
+                g_sched = SCHED_STEAL;
+            } else if (!strcmp(sched, "LIVE")) {
+                g_sched = SCHED_LIVE;
+            } else if (!strcmp(sched, "ACIRC")) {
+                g_sched = SCHED_ACIRC;
+            } else {
+                fprintf(stderr, "%s: unknown scheduler \"%s\"\n", errorstr, sched);
+                f(true, EXIT_FAILURE);
+            }
+            (*argv)++; (*argc)--;
+        } else if (!strcmp(cmd, "--progress")) {
+            if (*argc <= 1)
+                f(false, EXIT_FAILURE);
+            const char *progress = (*argv)[1];
+            if (!strcmp(progress, "BAR")) {
+                g_progress = PROGRESS_BAR;
+            } else if (!strcmp(progress, "MACHINE")) {
+                g_progress = PROGRESS_MACHINE;
+            } else {
+                fprintf(stderr, "%s: unknown progress format \"%s\"\n", errorstr, progress);
+                f(true, EXIT_FAILURE);
+            }
+            (*argv)++; (*argc)--;
+        } else if (!strcmp(cmd, "--seed")) {
+            if (*argc <= 1)
+                f(false, EXIT_FAILURE);
+            char *seed = (*argv)[1];
+            aes_randclear(args->rng);
+            aes_randinit_seedn(args->rng, seed, strlen(seed), NULL, 0);
+            (*argv)++; (*argc)--;
         } else if (!strcmp(cmd, "--verbose")) {
             g_verbose = true;
         } else if (!strcmp(cmd, "--help") || !strcmp(cmd, "-h")) {
@@ -646,6 +854,14 @@ cmd_mife_decrypt(int argc, char **argv, args_t *args)
     if (mife_select_scheme(args_.scheme, args->circ, &vt, &op_vt, &op) == ERR)
         goto cleanup;
     nslots = obf_params_cp(op)->nslots;
+    if (args_.outputs_list
+        && parse_outputs(args_.outputs_list, acirc_noutputs(args->circ),
+                         &args_.outputs, &args_.noutputs) == ERR)
+        goto cleanup;
+    if (args_.outputs
+        && circ_params_select_outputs(obf_params_cp(op), args_.outputs,
+                                      args_.noutputs) == ERR)
+        goto cleanup;
 
     length = snprintf(NULL, 0, "%s.ek\n", args->circuit);
     ek = my_calloc(length, sizeof ek[0]);
@@ -662,8 +878,12 @@ cmd_mife_decrypt(int argc, char **argv, args_t *args)
         goto cleanup;
     }
     printf("result: ");
-    for (size_t o = 0; o < acirc_noutputs(args->circ); ++o) {
-        printf("%ld", rop[o]);
+    if (args_.outputs) {
+        for (size_t i = 0; i < args_.noutputs; ++i)
+            printf("%ld", rop[args_.outputs[i]]);
+    } else {
+        for (size_t o = 0; o < acirc_noutputs(args->circ); ++o)
+            printf("%ld", rop[o]);
     }
     printf("\n");
     ret = OK;
@@ -679,6 +899,8 @@ cleanup:
         op_vt->free(op);
     if (rop)
         free(rop);
+    if (args_.outputs)
+        free(args_.outputs);
     return ret;
 }
 
@@ -875,8 +1097,8 @@ cmd_obf_obfuscate(int argc, char **argv, args_t *args)
     if (args_.kappa)
         kappa = args_.kappa;
 
-    if (obf_run_obfuscate(args->vt, vt, fname, op, args_.secparam, &kappa,
-                          args->nthreads, args->rng) == ERR)
+    if (obf_run_obfuscate(args->vt, vt, fname, args_.checkpoint, op,
+                          args_.secparam, &kappa, args->nthreads, args->rng) == ERR)
         goto cleanup;
 
     ret = OK;
@@ -888,6 +1110,72 @@ cleanup:
     return ret;
 }
 
+static void
+print_result(const long *output, size_t noutputs, const size_t *os, size_t nos)
+{
+    printf("result: ");
+    if (os) {
+        for (size_t i = 0; i < nos; ++i)
+            printf("%c", long_to_char(output[os[i]]));
+    } else {
+        for (size_t i = 0; i < noutputs; ++i)
+            printf("%c", long_to_char(output[i]));
+    }
+    printf("\n");
+}
+
+/* Reads one input per line of |fname|, skipping blank lines */
+static long **
+read_batch(const char *fname, size_t ninputs, size_t *n)
+{
+    long **inputs = NULL, **tmp;
+    char *line = NULL;
+    size_t size = 0, lineno = 0;
+    ssize_t len;
+    FILE *fp;
+
+    *n = 0;
+    if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%s: unable to open '%s' for reading\n", errorstr, fname);
+        return NULL;
+    }
+    while ((len = getline(&line, &size, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t) len != ninputs) {
+            fprintf(stderr, "%s: %s:%lu: expected %lu inputs, got %ld\n",
+                    errorstr, fname, lineno, ninputs, len);
+            goto error;
+        }
+        if ((tmp = my_realloc(inputs, (*n + 1) * sizeof inputs[0])) == NULL)
+            goto error;
+        inputs = tmp;
+        inputs[*n] = my_calloc(ninputs, sizeof inputs[0][0]);
+        (*n)++;
+        for (size_t i = 0; i < ninputs; ++i) {
+            if ((inputs[*n - 1][i] = char_to_long(line[i])) < 0) {
+                fprintf(stderr, "%s: %s:%lu: bad input character at column %lu\n",
+                        errorstr, fname, lineno, i + 1);
+                goto error;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    return inputs ? inputs : my_calloc(1, sizeof inputs[0]);
+error:
+    for (size_t b = 0; b < *n; ++b)
+        free(inputs[b]);
+    free(inputs);
+    *n = 0;
+    free(line);
+    fclose(fp);
+    return NULL;
+}
+
 static int
 cmd_obf_evaluate(int argc, char **argv, args_t *args)
 {
@@ -896,17 +1184,31 @@ cmd_obf_evaluate(int argc, char **argv, args_t *args)
     op_vtable *op_vt = NULL;
     obf_params_t *op = NULL;
     long *input = NULL, *output = NULL;
+    long **inputs = NULL, **outputs = NULL;
     char *fname = NULL;
-    size_t length;
+    size_t length, n = 0;
+    int left = 1;
     int ret = ERR;
 
     argv++; argc--;
+    /* A batch file stands in for the input argument */
+    for (int i = 0; i < argc; ++i)
+        if (!strcmp(argv[i], "--batch"))
+            left = 0;
     obf_evaluate_args_init(&args_);
-    handle_options(&argc, &argv, 1, args, &args_, obf_evaluate_handle_options,
+    handle_options(&argc, &argv, left, args, &args_, obf_evaluate_handle_options,
                    obf_evaluate_usage);
     if (obf_select_scheme(args_.scheme, args->circ, args_.npowers, 0,
                           &vt, &op_vt, &op) == ERR)
         goto cleanup;
+    if (args_.outputs_list
+        && parse_outputs(args_.outputs_list, acirc_noutputs(args->circ),
+                         &args_.outputs, &args_.noutputs) == ERR)
+        goto cleanup;
+    if (args_.outputs
+        && circ_params_select_outputs(obf_params_cp(op), args_.outputs,
+                                      args_.noutputs) == ERR)
+        goto cleanup;
 
     length = snprintf(NULL, 0, "%s.obf\n", args->circuit);
     if ((fname = my_calloc(length, sizeof fname[0])) == NULL)
@@ -915,6 +1217,27 @@ cmd_obf_evaluate(int argc, char **argv, args_t *args)
 
     if (args_.scheme == OBF_SCHEME_POLYLOG && args->vt == &clt_vtable)
         args->vt = &clt_pl_vtable;
+    if (args_.batch) {
+        const size_t noutputs = acirc_noutputs(args->circ);
+        if ((inputs = read_batch(args_.batch, acirc_ninputs(args->circ), &n)) == NULL)
+            goto cleanup;
+        if (args_.budget > SIZE_MAX >> 20) {
+            fprintf(stderr, "%s: cache budget of %lu MB is too large\n",
+                    errorstr, args_.budget);
+            goto cleanup;
+        }
+        outputs = my_calloc(n, sizeof outputs[0]);
+        for (size_t b = 0; b < n; ++b)
+            outputs[b] = my_calloc(noutputs, sizeof outputs[b][0]);
+        if (obf_run_batch(args->vt, vt, fname, op, inputs,
+                          acirc_ninputs(args->circ), outputs, noutputs, n,
+                          args->nthreads, args_.budget << 20) == ERR)
+            goto cleanup;
+        for (size_t b = 0; b < n; ++b)
+            print_result(outputs[b], noutputs, args_.outputs, args_.noutputs);
+        ret = OK;
+        goto cleanup;
+    }
     if ((input = my_calloc(strlen(argv[0]), sizeof input[0])) == NULL)
         goto cleanup;
     if ((output = my_calloc(acirc_noutputs(args->circ), sizeof output[0])) == NULL)
@@ -927,11 +1250,7 @@ cmd_obf_evaluate(int argc, char **argv, args_t *args)
     if (obf_run_evaluate(args->vt, vt, fname, op, input, strlen(argv[0]), output,
                          acirc_noutputs(args->circ), args->nthreads, NULL, NULL) == ERR)
         goto cleanup;
-
-    printf("result: ");
-    for (size_t i = 0; i < acirc_noutputs(args->circ); ++i)
-        printf("%c", long_to_char(output[i]));
-    printf("\n");
+    print_result(output, acirc_noutputs(args->circ), args_.outputs, args_.noutputs);
 
     ret = OK;
 cleanup:
@@ -939,6 +1258,53 @@ cleanup:
         free(input);
     if (output)
         free(output);
+    for (size_t b = 0; b < n; ++b) {
+        free(inputs[b]);
+        if (outputs)
+            free(outputs[b]);
+    }
+    free(inputs);
+    free(outputs);
+    if (fname)
+        free(fname);
+    if (op)
+        op_vt->free(op);
+    if (args_.outputs)
+        free(args_.outputs);
+    return ret;
+}
+
+static int
+cmd_obf_serve(int argc, char **argv, args_t *args)
+{
+    obf_serve_args_t args_;
+    obfuscator_vtable *vt = NULL;
+    op_vtable *op_vt = NULL;
+    obf_params_t *op = NULL;
+    char *fname = NULL;
+    size_t length;
+    int ret = ERR;
+
+    argv++; argc--;
+    obf_serve_args_init(&args_);
+    handle_options(&argc, &argv, 0, args, &args_, obf_serve_handle_options,
+                   obf_serve_usage);
+    if (obf_select_scheme(args_.scheme, args->circ, args_.npowers, 0,
+                          &vt, &op_vt, &op) == ERR)
+        goto cleanup;
+
+    length = snprintf(NULL, 0, "%s.obf\n", args->circuit);
+    if ((fname = my_calloc(length, sizeof fname[0])) == NULL)
+        goto cleanup;
+    snprintf(fname, length, "%s.obf", args->circuit);
+
+    if (args_.scheme == OBF_SCHEME_POLYLOG && args->vt == &clt_vtable)
+        args->vt = &clt_pl_vtable;
+    if (obf_run_serve(args->vt, vt, fname, op, args_.socket, args->nthreads) == ERR)
+        goto cleanup;
+
+    ret = OK;
+cleanup:
     if (fname)
         free(fname);
     if (op)
@@ -954,6 +1320,7 @@ cmd_obf_test(int argc, char **argv, args_t *args)
     op_vtable *op_vt = NULL;
     obf_params_t *op = NULL;
     char *fname = NULL;
+    long **outputs = NULL;
     size_t length, kappa = 0;
     bool passed = true;
     int ret = ERR;
@@ -978,24 +1345,29 @@ cmd_obf_test(int argc, char **argv, args_t *args)
     if ((fname = my_calloc(length, sizeof fname[0])) == NULL)
         goto cleanup;
     snprintf(fname, length, "%s.obf", args->circuit);
-    if (obf_run_obfuscate(args->vt, vt, fname, op, args_.secparam, &kappa,
-                          args->nthreads, args->rng) == ERR)
+    if (obf_run_obfuscate(args->vt, vt, fname, args_.checkpoint, op,
+                          args_.secparam, &kappa, args->nthreads, args->rng) == ERR)
         goto cleanup;
 
+    outputs = my_calloc(acirc_ntests(args->circ), sizeof outputs[0]);
+    for (size_t t = 0; t < acirc_ntests(args->circ); ++t)
+        outputs[t] = my_calloc(acirc_noutputs(args->circ), sizeof outputs[t][0]);
+    if (obf_run_test(args->vt, vt, fname, op, outputs, args->nthreads, &kappa) == ERR)
+        goto cleanup;
     for (size_t t = 0; t < acirc_ntests(args->circ); ++t) {
-        long outp[acirc_noutputs(args->circ)];
-        if (obf_run_evaluate(args->vt, vt, fname, op, acirc_test_input(args->circ, t),
-                             acirc_ninputs(args->circ), outp, acirc_noutputs(args->circ),
-                             args->nthreads, &kappa, NULL) == ERR)
-            goto cleanup;
         if (!print_test_output(t + 1, acirc_test_input(args->circ, t), acirc_ninputs(args->circ),
-                               acirc_test_output(args->circ, t), outp, acirc_noutputs(args->circ),
-                               false))
+                               acirc_test_output(args->circ, t), outputs[t],
+                               acirc_noutputs(args->circ), false))
             passed = false;
     }
     if (passed)
         ret = OK;
 cleanup:
+    if (outputs) {
+        for (size_t t = 0; t < acirc_ntests(args->circ); ++t)
+            free(outputs[t]);
+        free(outputs);
+    }
     if (fname)
         free(fname);
     if (op)
@@ -1025,7 +1397,7 @@ cmd_obf_get_kappa(int argc, char **argv, args_t *args)
         if (kappa == 0)
             goto cleanup;
     } else {
-        if (obf_run_obfuscate(args->vt, vt, NULL, op, 8, &kappa,
+        if (obf_run_obfuscate(args->vt, vt, NULL, NULL, op, 8, &kappa,
                               args->nthreads, args->rng) == ERR)
             goto cleanup;
     }
@@ -1045,6 +1417,7 @@ obf_usage(bool longform, int ret)
         printf("\nAvailable commands:\n\n"
                "   obfuscate    run circuit obfuscation\n"
                "   evaluate     run circuit evaluation\n"
+               "   serve        evaluate inputs against a loaded obfuscation\n"
                "   test         run test suite\n"
                "   get-kappa    get κ value\n"
                "   help         print this message and exit\n\n");
@@ -1069,6 +1442,8 @@ cmd_obf(int argc, char **argv)
         ret = cmd_obf_obfuscate(argc, argv, &args);
     } else if (!strcmp(cmd, "evaluate")) {
         ret = cmd_obf_evaluate(argc, argv, &args);
+    } else if (!strcmp(cmd, "serve")) {
+        ret = cmd_obf_serve(argc, argv, &args);
     } else if (!strcmp(cmd, "test")) {
         ret = cmd_obf_test(argc, argv, &args);
     } else if (!strcmp(cmd, "get-kappa")) {
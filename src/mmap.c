@@ -1,8 +1,10 @@
 #include "mmap.h"
+#include "index_set.h"
 #include "util.h"
 #include "obf-polylog/extra.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <mmap/mmap_clt_pl.h>
 
@@ -39,6 +41,10 @@ obf_params_new(const op_vtable *vt, acirc_t *circ, void *vparams)
         cp->ds[cp->nslots - 1] = acirc_nconsts(circ) + acirc_nsecrets(circ);
         cp->qs[cp->nslots - 1] = 1;
     }
+    if (vt->init && vt->init(op) == ERR) {
+        vt->free(op);
+        return NULL;
+    }
     if (g_verbose) {
         circ_params_print(cp);
         if (vt->print)
@@ -256,6 +262,24 @@ encoding_sub(const encoding_vtable *vt, const pp_vtable *pp_vt, encoding *rop,
     return OK;
 }
 
+int
+encoding_mul_inplace(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                     encoding *rop, const encoding *x, const public_params *p)
+{
+    return encoding_mul(vt, pp_vt, rop, rop, x, p);
+}
+
+int
+encoding_raise_inplace(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                       encoding *rop, const encoding *u, size_t n,
+                       const public_params *p)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (encoding_mul(vt, pp_vt, rop, rop, u, p) == ERR)
+            return ERR;
+    return OK;
+}
+
 int
 encoding_is_zero(const encoding_vtable *vt, const pp_vtable *pp_vt,
                  const encoding *x, const public_params *pp)
@@ -288,3 +312,171 @@ encoding_fwrite(const encoding_vtable *vt, const encoding *x, FILE *fp)
     vt->mmap->enc->fwrite(x->enc, fp);
     return OK;
 }
+
+size_t
+encoding_size(const encoding_vtable *vt, const encoding *x)
+{
+    char *buf = NULL;
+    size_t length = 0;
+    FILE *fp;
+
+    if ((fp = open_memstream(&buf, &length)) == NULL)
+        return 0;
+    (void) encoding_fwrite(vt, x, fp);
+    fclose(fp);
+    free(buf);
+    return length;
+}
+
+struct encoding_pool {
+    const encoding_vtable *vt;
+    const pp_vtable *pp_vt;
+    const public_params *pp;
+    pthread_mutex_t lock;
+    encoding **free;
+    size_t nfree;
+    size_t size;
+    size_t nallocated;
+    size_t nadopted;            /* put here without coming from the pool */
+};
+
+encoding_pool *
+encoding_pool_new(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                  const public_params *pp)
+{
+    encoding_pool *pool;
+
+    pool = my_calloc(1, sizeof pool[0]);
+    pool->vt = vt;
+    pool->pp_vt = pp_vt;
+    pool->pp = pp;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void
+encoding_pool_free(encoding_pool *pool)
+{
+    if (pool == NULL)
+        return;
+    for (size_t i = 0; i < pool->nfree; ++i)
+        encoding_free(pool->vt, pool->free[i]);
+    free(pool->free);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+encoding *
+encoding_pool_get(encoding_pool *pool)
+{
+    encoding *x = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree)
+        x = pool->free[--pool->nfree];
+    pthread_mutex_unlock(&pool->lock);
+    if (x == NULL) {
+        x = encoding_new(pool->vt, pool->pp_vt, pool->pp);
+        x->pool = pool;
+        __sync_fetch_and_add(&pool->nallocated, 1);
+    }
+    return x;
+}
+
+size_t
+encoding_pool_peak(encoding_pool *pool, size_t *nbytes)
+{
+    size_t n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = __atomic_load_n(&pool->nallocated, __ATOMIC_RELAXED) + pool->nadopted;
+    if (nbytes)
+        *nbytes = pool->nfree ? n * encoding_size(pool->vt, pool->free[0]) : 0;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+void
+encoding_pool_print(encoding_pool *pool)
+{
+    size_t nbytes, peak;
+
+    peak = encoding_pool_peak(pool, &nbytes);
+    fprintf(stderr, "  Peak encodings: %lu (%lu KB)\n", peak, nbytes / 1024);
+}
+
+encoding *
+encoding_pool_copy(encoding_pool *pool, const encoding *x)
+{
+    encoding *rop;
+
+    rop = encoding_pool_get(pool);
+    encoding_set(pool->vt, rop, x);
+    return rop;
+}
+
+static int
+_raise_copy(encoding_pool *pool, const encoding **x, const index_set *target,
+            encoding **tmp, encoding_raise_f raise, void *args)
+{
+    if (index_set_eq(pool->vt->mmap_set(*x), target))
+        return OK;
+    *tmp = encoding_pool_copy(pool, *x);
+    *x = *tmp;
+    return raise(*tmp, target, args);
+}
+
+int
+encoding_pool_raise_pair(encoding_pool *pool, const encoding **x,
+                         const encoding **y, encoding **tmp_x, encoding **tmp_y,
+                         encoding_raise_f raise, void *args)
+{
+    const index_set *ix;
+    int ret = ERR;
+
+    ix = index_set_intern_union(pool->vt->mmap_set(*x), pool->vt->mmap_set(*y));
+    if (ix == NULL)
+        return ERR;
+    if (_raise_copy(pool, x, ix, tmp_x, raise, args) == OK
+        && _raise_copy(pool, y, ix, tmp_y, raise, args) == OK)
+        ret = OK;
+    index_set_release(ix);
+    return ret;
+}
+
+void
+encoding_pool_put(encoding_pool *pool, encoding *x)
+{
+    if (x == NULL)
+        return;
+    if (x->refs) {
+        __sync_fetch_and_sub(&x->refs, 1);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree == pool->size) {
+        const size_t size = pool->size ? 2 * pool->size : 64;
+        encoding **free_;
+        if ((free_ = my_realloc(pool->free, size * sizeof free_[0])) == NULL) {
+            /* Unable to keep it, so let it go */
+            pthread_mutex_unlock(&pool->lock);
+            encoding_free(pool->vt, x);
+            return;
+        }
+        pool->free = free_;
+        pool->size = size;
+    }
+    if (x->pool != pool) {
+        x->pool = pool;
+        pool->nadopted++;
+    }
+    pool->free[pool->nfree++] = x;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+encoding *
+encoding_ref(encoding *x)
+{
+    __sync_fetch_and_add(&x->refs, 1);
+    return x;
+}
@@ -23,6 +23,8 @@ typedef struct {
     int (*fwrite)(const obf_params_t *, FILE *);
     obf_params_t * (*fread)(acirc_t *, FILE *);
     void (*print)(const obf_params_t *);
+    /* Optional: finishes parameters that depend on the circuit parameters */
+    int (*init)(obf_params_t *);
 } op_vtable;
 
 obf_params_t * obf_params_new(const op_vtable *vt, acirc_t *circ, void *vparams);
@@ -72,6 +74,8 @@ typedef struct encoding_info encoding_info;
 typedef struct {
     encoding_info *info;
     mmap_enc enc;
+    unsigned int refs;          // borrowed references, see encoding_ref
+    struct encoding_pool *pool; // pool counting it in its peak, if any
 } encoding;
 
 typedef struct {
@@ -81,6 +85,7 @@ typedef struct {
     int (*print)(const encoding *);
     int * (*encode)(encoding *, const void *);
     int (*set)(encoding *, const encoding *);
+    /* rop may alias either operand, or both */
     int (*mul)(const pp_vtable *, encoding *, const encoding *,
                const encoding *, const public_params *);
     int (*add)(const pp_vtable *, encoding *, const encoding *,
@@ -127,8 +132,52 @@ int        encoding_add(const encoding_vtable *vt, const pp_vtable *pp_vt, encod
                         const encoding *x, const encoding *y, const public_params *p);
 int        encoding_sub(const encoding_vtable *vt, const pp_vtable *pp_vt, encoding *rop,
                         const encoding *x, const encoding *y, const public_params *p);
+/* rop = rop * x; every operation allows its result to alias its operands,
+ * so this needs no temporary */
+int        encoding_mul_inplace(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                                encoding *rop, const encoding *x,
+                                const public_params *p);
+/* rop = rop * u^n; u must not alias rop */
+int        encoding_raise_inplace(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                                  encoding *rop, const encoding *u, size_t n,
+                                  const public_params *p);
 unsigned int encoding_get_degree(const encoding_vtable *vt, const encoding *x);
 int        encoding_is_zero(const encoding_vtable *vt, const pp_vtable *pp_vt,
                              const encoding *x, const public_params *p);
 encoding * encoding_fread(const encoding_vtable *vt, FILE *fp);
 int        encoding_fwrite(const encoding_vtable *vt, const encoding *x, FILE *fp);
+/* Bytes x takes when serialized, close to what it takes in memory */
+size_t     encoding_size(const encoding_vtable *vt, const encoding *x);
+
+/* Recycles encodings, together with their index sets and mmap elements, so
+ * that evaluation allocates once per live wire rather than once per gate.
+ * An encoding taken from the pool holds an unspecified value until it is
+ * written.  Safe to share between threads. */
+typedef struct encoding_pool encoding_pool;
+encoding_pool * encoding_pool_new(const encoding_vtable *vt, const pp_vtable *pp_vt,
+                                  const public_params *pp);
+void            encoding_pool_free(encoding_pool *pool);
+encoding *      encoding_pool_get(encoding_pool *pool);
+encoding *      encoding_pool_copy(encoding_pool *pool, const encoding *x);
+/* Returns x, allocated by encoding_new, encoding_fread or the pool, to the
+ * pool; if x is a borrowed reference, drops the reference instead */
+void            encoding_pool_put(encoding_pool *pool, encoding *x);
+/* The number of encodings the pool has held, whether it allocated them or
+ * they came in through encoding_pool_put, and if |nbytes| is set their size.
+ * The pool frees none until encoding_pool_free, so this is its peak */
+size_t          encoding_pool_peak(encoding_pool *pool, size_t *nbytes);
+void            encoding_pool_print(encoding_pool *pool);
+/* Raises x in place to index set |target| */
+typedef int (*encoding_raise_f)(encoding *x, const void *target, void *args);
+/* Raises *x and *y to the union of their index sets.  Operands may be
+ * borrowed, so a raise first copies its operand from the pool into *tmp_x or
+ * *tmp_y, which then stands in for it; an operand already at the union is
+ * left alone */
+int             encoding_pool_raise_pair(encoding_pool *pool, const encoding **x,
+                                         const encoding **y, encoding **tmp_x,
+                                         encoding **tmp_y, encoding_raise_f raise,
+                                         void *args);
+/* Borrows x read-only in place of copying it.  The reference is dropped with
+ * encoding_pool_put, and x's owner must keep it alive until every reference
+ * has been dropped.  Copy before writing: encodings are copy-on-write. */
+encoding *      encoding_ref(encoding *x);
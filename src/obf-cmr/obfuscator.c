@@ -1,17 +1,65 @@
 #include "obfuscator.h"
 #include "obf_params.h"
+#include "../container.h"
+#include "../eval_cache.h"
 #include "../mife-cmr/mife.h"
 #include "../util.h"
+#include "../vtables.h"
 
 #include <string.h>
 
 typedef struct obfuscation {
+    const mmap_vtable *mmap;
     const obf_params_t *op;
     mife_t *mife;
     mife_ek_t *ek;
     mife_ct_t ***cts;   /* [n][Σ] */
+    container *container;   /* backing file, if read from disk */
 } obfuscation;
 
+/* Container layout: the evaluation key forms the preamble, followed by one
+ * entry per ciphertext cts[i][j] */
+
+static size_t
+_entry_ct(const circ_params_t *cp, size_t i, size_t j)
+{
+    size_t idx = 0;
+    for (size_t k = 0; k < i; ++k)
+        idx += cp->qs[k];
+    return idx + j;
+}
+
+static void *
+_ct_read(FILE *fp, void *vobf)
+{
+    const obfuscation *obf = vobf;
+    return mife_cmr_vtable.mife_ct_fread(obf->mmap, obf_params_cp(obf->op), fp);
+}
+
+static int
+_ct_write(const void *ct, FILE *fp, void *vobf)
+{
+    const obfuscation *obf = vobf;
+    return mife_cmr_vtable.mife_ct_fwrite(ct, obf_params_cp(obf->op), fp);
+}
+
+static void
+_ct_free(void *ct, void *vobf)
+{
+    const obfuscation *obf = vobf;
+    mife_cmr_vtable.mife_ct_free(ct, obf_params_cp(obf->op));
+}
+
+/* Returns ciphertext cts[i][j], decoding a private copy from the backing
+ * container if there is one */
+static mife_ct_t *
+_ct(const obfuscation *obf, size_t i, size_t j)
+{
+    if (obf->container == NULL)
+        return obf->cts[i][j];
+    return container_read(obf->container, _entry_ct(obf_params_cp(obf->op), i, j),
+                          _ct_read, (void *) obf);
+}
 static void
 _free(obfuscation *obf)
 {
@@ -38,6 +86,7 @@ _free(obfuscation *obf)
     }
     if (obf->mife)
         vt->mife_free(obf->mife);
+    container_close(obf->container);
     free(obf);
 }
 
@@ -48,8 +97,6 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     obfuscation *obf;
     mife_sk_t *sk;
     mife_encrypt_cache_t cache;
-    pthread_mutex_t lock;
-    size_t count = 0;
     double start, end, _start, _end;
     int res = ERR;
 
@@ -61,6 +108,7 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     start = _start = current_time();
 
     obf = my_calloc(1, sizeof obf[0]);
+    obf->mmap = mmap;
     obf->op = op;
     obf->mife = vt->mife_setup(mmap, op, secparam, kappa, op->npowers, nthreads, rng);
     obf->ek = vt->mife_ek(obf->mife);
@@ -74,12 +122,14 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     /* MIFE encryption */
     _start = current_time();
 
-    pthread_mutex_init(&lock, NULL);
-    cache.pool = threadpool_create(nthreads);
-    cache.lock = &lock;
-    cache.count = &count;
-    cache.total = mobf_num_encodings(op);
+    cache = (mife_encrypt_cache_t) {
+        .pool = threadpool_create(nthreads),
+        .progress = progress_new("encode", 0, mobf_num_encodings(op)),
+    };
 
+    /* Each encryption queues its encodings on the shared pool and returns
+     * without waiting for them, so the circuit evaluation for one symbol
+     * overlaps the encoding of the symbols before it */
     for (size_t i = 0; i < ninputs; ++i) {
         obf->cts[i] = my_calloc(cp->qs[i], sizeof obf->cts[i][0]);
         for (size_t j = 0; j < cp->qs[i]; ++j) {
@@ -97,13 +147,14 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
                     inputs[k] = j;
                 }
             }
-            obf->cts[i][j] = _mife_encrypt(sk, i, inputs, nthreads, rng, &cache, NULL, false);
+            obf->cts[i][j] = _mife_encrypt(sk, i, inputs, nthreads, rng, &cache, NULL, true);
+            if (obf->cts[i][j] == NULL)
+                goto cleanup;
         }
     }
     res = OK;
 cleanup:
-    threadpool_destroy(cache.pool);
-    pthread_mutex_destroy(&lock);
+    mife_encrypt_cache_finish(&cache);
     vt->mife_sk_free(sk);
     if (res == OK) {
         end = _end = current_time();
@@ -118,70 +169,127 @@ cleanup:
     }
 }
 
+/* Decrypts the ciphertexts |inputs| selects, sharing gates through |cache|
+ * if it is set */
 static int
-_evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
-          const long *inputs, size_t ninputs, size_t nthreads, size_t *kappa,
-          size_t *npowers)
+_decrypt(const obfuscation *obf, long *outputs, const long *inputs,
+         size_t nthreads, size_t *kappa, eval_cache *cache)
 {
-    (void) npowers;
     const circ_params_t *cp = obf_params_cp(obf->op);
     const acirc_t *circ = cp->circ;
     const size_t has_consts = acirc_nconsts(circ) + acirc_nsecrets(circ) ? 1 : 0;
-    const mife_vtable *vt = &mife_cmr_vtable;
     mife_ct_t **cts = NULL;
     size_t *input_syms = NULL;
     int ret = ERR;
 
-    if (ninputs != acirc_ninputs(circ)) {
-        fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
-        goto cleanup;
-    } else if (noutputs != acirc_noutputs(circ)) {
-        fprintf(stderr, "error: obf evaluate: invalid number of outputs\n");
-        goto cleanup;
-    }
-
     {
         bool *sigmas;
         sigmas = my_calloc(cp->nslots - has_consts, sizeof sigmas[0]);
         for (size_t i = 0; i < cp->nslots - has_consts; ++i)
             sigmas[i] = acirc_is_sigma(circ, i);
-        input_syms = get_input_syms(inputs, ninputs, cp->nslots - has_consts,
-                                    cp->ds, cp->qs, sigmas);
+        input_syms = get_input_syms(inputs, acirc_ninputs(circ),
+                                    cp->nslots - has_consts, cp->ds, cp->qs,
+                                    sigmas);
         free(sigmas);
         if (input_syms == NULL)
             goto cleanup;
     }
     cts = my_calloc(cp->nslots, sizeof cts[0]);
     for (size_t i = 0; i < cp->nslots - has_consts; ++i) {
-        cts[i] = obf->cts[i][input_syms[i]];
+        if ((cts[i] = _ct(obf, i, input_syms[i])) == NULL)
+            goto cleanup;
     }
-    if (has_consts)
-        cts[cp->nslots - 1] = obf->cts[cp->nslots - 1][0];
-    if (vt->mife_decrypt(obf->ek, outputs, (const mife_ct_t **) cts, nthreads, kappa) == ERR)
+    if (has_consts && (cts[cp->nslots - 1] = _ct(obf, cp->nslots - 1, 0)) == NULL)
+        goto cleanup;
+    if (_mife_decrypt(obf->ek, outputs, (const mife_ct_t **) cts, nthreads,
+                      kappa, cache, input_syms) == ERR)
         goto cleanup;
 
     ret = OK;
 cleanup:
-    if (cts)
+    if (cts) {
+        /* Only the ciphertexts selected by this input were decoded */
+        if (obf->container)
+            for (size_t i = 0; i < cp->nslots; ++i)
+                _ct_free(cts[i], (void *) obf);
         free(cts);
+    }
     if (input_syms)
         free(input_syms);
     return ret;
 }
 
+static int
+_evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
+          const long *inputs, size_t ninputs, size_t nthreads, size_t *kappa,
+          size_t *npowers)
+{
+    (void) npowers;
+    const acirc_t *circ = obf_params_cp(obf->op)->circ;
+
+    if (ninputs != acirc_ninputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
+        return ERR;
+    } else if (noutputs != acirc_noutputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of outputs\n");
+        return ERR;
+    }
+    return _decrypt(obf, outputs, inputs, nthreads, kappa, NULL);
+}
+
+static int
+_evaluate_batch(const obfuscation *obf, long **outputs, size_t noutputs,
+                long **inputs, size_t ninputs, size_t n, size_t nthreads,
+                size_t budget)
+{
+    const circ_params_t *cp = obf_params_cp(obf->op);
+    const acirc_t *circ = cp->circ;
+    eval_cache *cache;
+    int ret = ERR;
+
+    if (ninputs != acirc_ninputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
+        return ERR;
+    } else if (noutputs != acirc_noutputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of outputs\n");
+        return ERR;
+    }
+
+    cache = eval_cache_new(cp, get_encoding_vtable(obf->mmap), budget);
+    for (size_t b = 0; b < n; ++b)
+        if (_decrypt(obf, outputs[b], inputs[b], nthreads, NULL, cache) == ERR)
+            goto cleanup;
+    if (g_verbose)
+        eval_cache_print(cache);
+    ret = OK;
+cleanup:
+    eval_cache_free(cache);
+    return ret;
+}
+
 static int
 _fwrite(const obfuscation *const obf, FILE *const fp)
 {
     const circ_params_t *cp = &obf->op->cp;
     const size_t ninputs = cp->nslots;
     const mife_vtable *vt = &mife_cmr_vtable;
-    vt->mife_ek_fwrite(obf->ek, fp);
+    container_writer *w;
+
+    if ((w = container_writer_new(fp, _entry_ct(cp, ninputs, 0))) == NULL)
+        return ERR;
+    if (vt->mife_ek_fwrite(obf->ek, fp) == ERR)
+        goto error;
     for (size_t i = 0; i < ninputs; ++i) {
         for (size_t j = 0; j < cp->qs[i]; ++j) {
-            vt->mife_ct_fwrite(obf->cts[i][j], cp, fp);
+            if (container_writer_add(w, _entry_ct(cp, i, j), obf->cts[i][j],
+                                     _ct_write, (void *) obf) == ERR)
+                goto error;
         }
     }
-    return OK;
+    return container_writer_finish(w);
+error:
+    container_writer_free(w);
+    return ERR;
 }
 
 static obfuscation *
@@ -192,28 +300,39 @@ _fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
     const size_t ninputs = cp->nslots;
     const mife_vtable *vt = &mife_cmr_vtable;
     obf = my_calloc(1, sizeof obf[0]);
+    obf->mmap = mmap;
     obf->op = op;
+    if ((obf->container = container_open(fp)) == NULL)
+        goto error;
+    if (container_nentries(obf->container) != _entry_ct(cp, ninputs, 0)) {
+        fprintf(stderr, "%s: obfuscation does not match circuit\n", errorstr);
+        goto error;
+    }
     if ((obf->ek = vt->mife_ek_fread(mmap, op, fp)) == NULL)
         goto error;
     obf->mife = NULL;
+    /* Ciphertexts are decoded from the container as evaluation needs them */
     obf->cts = my_calloc(ninputs, sizeof obf->cts[0]);
-    for (size_t i = 0; i < ninputs; ++i) {
+    for (size_t i = 0; i < ninputs; ++i)
         obf->cts[i] = my_calloc(cp->qs[i], sizeof obf->cts[i][0]);
-        for (size_t j = 0; j < cp->qs[i]; ++j) {
-            if ((obf->cts[i][j] = vt->mife_ct_fread(mmap, cp, fp)) == NULL)
-                goto error;
-        }
-    }
     return obf;
 error:
     _free(obf);
     return NULL;
 }
 
+static int
+_analyze(const obf_params_t *op, size_t *kappa, size_t *npowers, size_t *degrees)
+{
+    return mife_cmr_vtable.mife_analyze(op, op->npowers, kappa, npowers, degrees);
+}
+
 obfuscator_vtable mobf_obfuscator_vtable = {
     .free = _free,
     .obfuscate = _obfuscate,
     .evaluate = _evaluate,
+    .evaluate_batch = _evaluate_batch,
     .fwrite = _fwrite,
     .fread = _fread,
+    .analyze = _analyze,
 };
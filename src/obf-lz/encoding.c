@@ -5,16 +5,24 @@
 #include <string.h>
 
 struct encoding_info {
-    index_set *index;
+    const index_set *index;      // interned
 };
 #define my(x) x->info
 
+/* Replaces rop's index set by |ix|, taking over the reference to it */
+static void
+_set_index(encoding *rop, const index_set *ix)
+{
+    index_set_release(my(rop)->index);
+    my(rop)->index = ix;
+}
+
 static int
 _encoding_new(const pp_vtable *vt, encoding *enc, const public_params *pp)
 {
     const obf_params_t *const op = vt->params(pp);
     enc->info = calloc(1, sizeof enc->info[0]);
-    enc->info->index = index_set_new(obf_params_nzs(&op->cp));
+    enc->info->index = index_set_intern_zero(obf_params_nzs(&op->cp));
     return OK;
 }
 
@@ -22,8 +30,7 @@ static void
 _encoding_free(encoding *enc)
 {
     if (enc->info) {
-        if (enc->info->index)
-            index_set_free(enc->info->index);
+        index_set_release(my(enc)->index);
         free(enc->info);
     }
 }
@@ -41,7 +48,7 @@ _encode(encoding *rop, const void *set)
     int *pows;
     const index_set *const ix = set;
 
-    index_set_set(rop->info->index, ix);
+    _set_index(rop, index_set_intern(ix));
     pows = my_calloc(ix->nzs, sizeof pows[0]);
     memcpy(pows, ix->pows, ix->nzs * sizeof pows[0]);
     return pows;
@@ -50,7 +57,7 @@ _encode(encoding *rop, const void *set)
 static int
 _encoding_set(encoding *rop, const encoding *x)
 {
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -59,7 +66,10 @@ _encoding_mul(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp;
-    index_set_add(my(rop)->index, my(x)->index, my(y)->index);
+    const index_set *index;
+    if ((index = index_set_intern_add(my(x)->index, my(y)->index)) == NULL)
+        return ERR;
+    _set_index(rop, index);
     return OK;
 }
 
@@ -68,7 +78,7 @@ _encoding_add(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -77,7 +87,7 @@ _encoding_sub(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->index, my(x)->index);
+    _set_index(rop, index_set_acquire(my(x)->index));
     return OK;
 }
 
@@ -97,12 +107,15 @@ _encoding_is_zero(const pp_vtable *vt, const encoding *x, const public_params *p
 static int
 _encoding_fread(encoding *x, FILE *fp)
 {
+    index_set *ix;
+
     x->info = calloc(1, sizeof x->info[0]);
-    x->info->index = index_set_fread(fp);
-    if (x->info->index == NULL) {
+    if ((ix = index_set_fread(fp)) == NULL) {
         free(x->info);
         return ERR;
     }
+    x->info->index = index_set_intern(ix);
+    index_set_free(ix);
     return OK;
 }
 
@@ -1,5 +1,6 @@
 #include "obf_params.h"
 #include "obfuscator.h"
+#include "plan.h"
 #include "../mmap.h"
 #include "../util.h"
 
@@ -37,19 +38,64 @@ obf_params_num_encodings(const obf_params_t *op)
     const circ_params_t *cp = &op->cp;
     const size_t nconsts = acirc_nconsts(cp->circ);
     const size_t noutputs = acirc_noutputs(cp->circ);
-    size_t sum = nconsts + op->npowers + noutputs;
+    size_t sum = nconsts + op_nlevels(op, acirc_nsymbols(cp->circ)) + noutputs;
     for (size_t i = 0; i < acirc_nsymbols(cp->circ); ++i) {
         sum += cp->qs[i] * cp->ds[i];
-        sum += cp->qs[i] * op->npowers;
+        sum += cp->qs[i] * op_nlevels(op, i);
         sum += cp->qs[i] * noutputs * 2;
     }
     return sum;
 }
 
+/* The raise levels are tailored to the circuit when the parameters are made,
+ * so an obfuscation records the ones its encodings were made at, and
+ * loading it checks that they are made the same way again */
+PRIVATE int
+obf_params_levels_fwrite(const obf_params_t *op, FILE *fp)
+{
+    for (size_t k = 0; k <= acirc_nsymbols(op->cp.circ); ++k) {
+        if (size_t_fwrite(op->nlevels[k], fp) == ERR)
+            return ERR;
+        for (size_t p = 0; p < op->nlevels[k]; ++p)
+            if (size_t_fwrite(op->levels[k][p], fp) == ERR)
+                return ERR;
+    }
+    return OK;
+}
+
+PRIVATE int
+obf_params_levels_check(const obf_params_t *op, FILE *fp)
+{
+    for (size_t k = 0; k <= acirc_nsymbols(op->cp.circ); ++k) {
+        size_t n, level;
+        if (size_t_fread(&n, fp) == ERR)
+            return ERR;
+        if (n != op->nlevels[k])
+            goto mismatch;
+        for (size_t p = 0; p < n; ++p) {
+            if (size_t_fread(&level, fp) == ERR)
+                return ERR;
+            if (level != op->levels[k][p])
+                goto mismatch;
+        }
+    }
+    return OK;
+mismatch:
+    fprintf(stderr, "%s: raise levels do not match the obfuscation's "
+            "(was it made with another --npowers?)\n", errorstr);
+    return ERR;
+}
+
 static void
 _free(obf_params_t *op)
 {
     if (op) {
+        if (op->levels) {
+            for (size_t k = 0; k <= acirc_nsymbols(op->cp.circ); ++k)
+                free(op->levels[k]);
+            free(op->levels);
+        }
+        free(op->nlevels);
         circ_params_clear(&op->cp);
         free(op);
     }
@@ -58,21 +104,46 @@ _free(obf_params_t *op)
 static obf_params_t *
 _new(acirc_t *circ, void *vparams)
 {
-    (void) circ;
     const lz_obf_params_t *params = vparams;
+    const size_t nsymbols = acirc_nsymbols(circ);
     obf_params_t *op;
 
     if ((op = calloc(1, sizeof op[0])) == NULL)
         return NULL;
     op->npowers = params->npowers;
+    /* Powers of two until _init tailors them to the circuit */
+    op->nlevels = my_calloc(nsymbols + 1, sizeof op->nlevels[0]);
+    op->levels = my_calloc(nsymbols + 1, sizeof op->levels[0]);
+    for (size_t k = 0; k <= nsymbols; ++k) {
+        op->nlevels[k] = op->npowers;
+        op->levels[k] = my_calloc(op->npowers, sizeof op->levels[k][0]);
+        for (size_t p = 0; p < op->npowers; ++p)
+            op->levels[k][p] = (size_t) 1 << p;
+    }
     return op;
 }
 
+static int
+_init(obf_params_t *op)
+{
+    if (op->npowers == 0)
+        return OK;
+    return plan_levels(op);
+}
+
 static void
 _print(const obf_params_t *op)
 {
     fprintf(stderr, "Obfuscation parameters:\n");
     fprintf(stderr, "* # powers: .. %lu\n", op->npowers);
+    fprintf(stderr, "* levels: .... ");
+    for (size_t k = 0; k <= acirc_nsymbols(op->cp.circ); ++k) {
+        fprintf(stderr, "[");
+        for (size_t p = 0; p < op_nlevels(op, k); ++p)
+            fprintf(stderr, p ? " %lu" : "%lu", op_level(op, k, p));
+        fprintf(stderr, "] ");
+    }
+    fprintf(stderr, "\n");
     fprintf(stderr, "* # encodings: %lu\n", obf_params_num_encodings(op));
 }
 
@@ -82,12 +153,13 @@ _fwrite(const obf_params_t *op, FILE *fp)
     circ_params_fwrite(&op->cp, fp);
     int_fwrite(op->sigma, fp);
     size_t_fwrite(op->npowers, fp);
-    return OK;
+    return obf_params_levels_fwrite(op, fp);
 }
 
 static obf_params_t *
 _fread(acirc_t *circ, FILE *fp)
 {
+    const size_t nsymbols = acirc_nsymbols(circ);
     obf_params_t *op;
 
     if ((op = calloc(1, sizeof op[0])) == NULL)
@@ -95,7 +167,24 @@ _fread(acirc_t *circ, FILE *fp)
     circ_params_fread(&op->cp, circ, fp);
     int_fread(&op->sigma, fp);
     size_t_fread(&op->npowers, fp);
+    op->nlevels = my_calloc(nsymbols + 1, sizeof op->nlevels[0]);
+    op->levels = my_calloc(nsymbols + 1, sizeof op->levels[0]);
+    for (size_t k = 0; k <= nsymbols; ++k) {
+        if (size_t_fread(&op->nlevels[k], fp) == ERR)
+            goto error;
+        op->levels[k] = my_calloc(op->nlevels[k], sizeof op->levels[k][0]);
+        for (size_t p = 0; p < op->nlevels[k]; ++p)
+            if (size_t_fread(&op->levels[k][p], fp) == ERR)
+                goto error;
+        if (op->nlevels[k] == 0 || op->levels[k][0] != 1) {
+            fprintf(stderr, "%s: invalid raise levels\n", errorstr);
+            goto error;
+        }
+    }
     return op;
+error:
+    _free(op);
+    return NULL;
 }
 
 op_vtable lz_op_vtable =
@@ -105,4 +194,5 @@ op_vtable lz_op_vtable =
     .fwrite = _fwrite,
     .fread = _fread,
     .print = _print,
+    .init = _init,
 };
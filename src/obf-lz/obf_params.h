@@ -10,9 +10,25 @@
 struct obf_params_t {
     circ_params_t cp;
     int sigma;
-    size_t npowers;
+    size_t npowers;             // most raise levels any one slot may use
+    size_t *nlevels;            // [c+1]
+    size_t **levels;            // [c+1][nlevels] exponents, ascending
 };
 
+/* Raise levels: uhat[k][s][p] is encoded at exponent levels[k][p] of (k, s),
+ * and vhat[p] at exponent levels[c][p] of y, where c is the number of
+ * symbols.  levels[k][0] is always one, so every difference is reachable. */
+static inline size_t
+op_nlevels(const obf_params_t *op, size_t k)
+{
+    return op->nlevels[k];
+}
+static inline size_t
+op_level(const obf_params_t *op, size_t k, size_t p)
+{
+    return op->levels[k][p];
+}
+
 static inline void
 ix_y_set(index_set *ix, const circ_params_t *cp, int pow)
 {
@@ -52,6 +68,23 @@ ix_w_set(index_set *ix, const circ_params_t *cp, size_t k, int pow)
     ix->pows[has_consts + (1 + cp->qs[k]) * (cp->nslots - has_consts) + k] = pow;
 }
 
+/* Index set of zhat[k][s][o], given the constant and per-slot variable
+ * degrees of each output */
+static inline void
+ix_zhat_set(index_set *ix, const circ_params_t *cp, const long *const_deg,
+            long const_deg_max, long *const *var_deg, const long *var_deg_max,
+            size_t k, size_t s, size_t o)
+{
+    if (k == 0)
+        ix_y_set(ix, cp, const_deg_max - const_deg[o]);
+    for (size_t r = 0; r < cp->qs[k]; r++)
+        ix_s_set(ix, cp, k, r, r == s ? var_deg_max[k] - var_deg[k][o] : var_deg_max[k]);
+    ix_z_set(ix, cp, k, 1);
+    ix_w_set(ix, cp, k, 1);
+}
+
 size_t obf_params_nzs(const circ_params_t *cp);
 index_set * obf_params_new_toplevel(const circ_params_t *cp, size_t nzs);
 size_t obf_params_num_encodings(const obf_params_t *op);
+int obf_params_levels_fwrite(const obf_params_t *op, FILE *fp);
+int obf_params_levels_check(const obf_params_t *op, FILE *fp);
@@ -1,9 +1,17 @@
 #include "obfuscator.h"
 #include "obf_params.h"
+#include "plan.h"
+#include "../checkpoint.h"
+#include "../container.h"
+#include "../encode_batch.h"
+#include "../eval_cache.h"
+#include "../rand_streams.h"
+#include "../sched.h"
 #include "../vtables.h"
 #include "../util.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 #include <threadpool.h>
 
@@ -16,57 +24,148 @@ struct obfuscation {
     secret_params *sp;
     public_params *pp;
     encoding ****shat;          // [c][Σ][ℓ]
-    encoding ****uhat;          // [c][Σ][npowers]
+    encoding ****uhat;          // [c][Σ][nlevels]
     encoding ****zhat;          // [c][Σ][γ]
     encoding ****what;          // [c][Σ][γ]
     encoding **yhat;            // [m]
-    encoding **vhat;            // [npowers]
+    encoding **vhat;            // [nlevels]
     encoding **Chatstar;        // [γ]
+    container *container;       // backing file, if read from disk
+    checkpoint *checkpoint;     // earlier progress, while obfuscating
+    raise_plan *plan;           // raises for evaluation, if plannable
+    sched_graph *graph;         // evaluation schedule, weighted by the plan
+    container *consts;          // precomputed constant gates, if read
+    size_t *seeds;              // [nrefs] entry in consts, or SEED_*
+    encoding **seeded;          // [container_nentries(consts)]
 };
 
-typedef struct {
-    const encoding_vtable *vt;
-    encoding *enc;
-    mpz_t inps[2];
-    index_set *ix;
-    const secret_params *sp;
-    pthread_mutex_t *count_lock;
-    size_t *count;
-    size_t total;
-} obf_args;
+/* How evaluation treats a ref once the constant gates are precomputed: as
+ * usual, skipped because only seeded gates read it, or else read from the
+ * constants sidecar at the given entry */
+#define SEED_NONE SIZE_MAX
+#define SEED_SKIP (SIZE_MAX - 1)
+
+/* Container layout: per slot k and symbol s, the block shat, uhat, zhat and
+ * what, followed by yhat, vhat and Chatstar */
 
-static void obf_worker(void *wargs)
+static size_t
+_entry_ks(const obf_params_t *op, size_t k, size_t s)
 {
-    obf_args *const args = wargs;
+    const circ_params_t *cp = &op->cp;
+    const size_t noutputs = acirc_noutputs(cp->circ);
+    size_t idx = 0;
+    for (size_t i = 0; i < k; ++i)
+        idx += cp->qs[i] * (cp->ds[i] + op_nlevels(op, i) + 2 * noutputs);
+    return idx + s * (cp->ds[k] + op_nlevels(op, k) + 2 * noutputs);
+}
 
-    encode(args->vt, args->enc, args->inps, 2, args->ix, args->sp, 0);
-    if (g_verbose) {
-        pthread_mutex_lock(args->count_lock);
-        print_progress(++*args->count, args->total);
-        pthread_mutex_unlock(args->count_lock);
-    }
-    mpz_vect_clear(args->inps, 2);
-    index_set_free(args->ix);
-    free(args);
+static size_t
+_entry_shat(const obf_params_t *op, size_t k, size_t s, size_t j)
+{
+    return _entry_ks(op, k, s) + j;
+}
+
+static size_t
+_entry_uhat(const obf_params_t *op, size_t k, size_t s, size_t p)
+{
+    return _entry_ks(op, k, s) + op->cp.ds[k] + p;
+}
+
+static size_t
+_entry_zhat(const obf_params_t *op, size_t k, size_t s, size_t o)
+{
+    return _entry_ks(op, k, s) + op->cp.ds[k] + op_nlevels(op, k) + 2 * o;
+}
+
+static size_t
+_entry_what(const obf_params_t *op, size_t k, size_t s, size_t o)
+{
+    return _entry_zhat(op, k, s, o) + 1;
+}
+
+static size_t
+_entry_yhat(const obf_params_t *op, size_t i)
+{
+    return _entry_ks(op, acirc_nsymbols(op->cp.circ), 0) + i;
+}
+
+static size_t
+_entry_vhat(const obf_params_t *op, size_t p)
+{
+    return _entry_yhat(op, acirc_nconsts(op->cp.circ)) + p;
+}
+
+static size_t
+_entry_Chatstar(const obf_params_t *op, size_t o)
+{
+    return _entry_vhat(op, op_nlevels(op, acirc_nsymbols(op->cp.circ))) + o;
+}
+
+/* Accessors for the input-independent encodings (and the rarely needed
+ * unselected powers); these decode from the backing container on first use */
+
+static encoding *
+_uhat(const obfuscation *obf, size_t k, size_t s, size_t p)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->uhat[k][s][p],
+                                  _entry_uhat(obf->op, k, s, p));
+}
+
+static encoding *
+_yhat(const obfuscation *obf, size_t i)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->yhat[i],
+                                  _entry_yhat(obf->op, i));
+}
+
+static encoding *
+_vhat(const obfuscation *obf, size_t p)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->vhat[p],
+                                  _entry_vhat(obf->op, p));
+}
+
+static encoding *
+_Chatstar(const obfuscation *obf, size_t o)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->Chatstar[o],
+                                  _entry_Chatstar(obf->op, o));
+}
+
+static encoding *
+_seeded(const obfuscation *obf, size_t i)
+{
+    return container_get_encoding(obf->consts, obf->enc_vt, &obf->seeded[i], i);
 }
 
+/* Queues an encoding of [x, y] at |ix| for container entry |idx|.  Without a
+ * stream the encoding is stored in |slot|; with one it is handed to the
+ * stream's writer once encoded, and never stored in |obf|.  Entries restored
+ * from a checkpoint are skipped.  |base| (two slots), |x| and |y| must live
+ * until the batch's pool is destroyed. */
 static void
-__encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, mpz_t inps[2],
-         index_set *ix, const secret_params *sp, pthread_mutex_t *count_lock,
-         size_t *count, size_t total)
-{
-    obf_args *args = my_calloc(1, sizeof args[0]);
-    args->vt = vt;
-    args->enc = enc;
-    mpz_vect_init(args->inps, 2);
-    mpz_set(args->inps[0], inps[0]);
-    mpz_set(args->inps[1], inps[1]);
-    args->ix = ix;
-    args->sp = sp;
-    args->count_lock = count_lock;
-    args->count = count;
-    args->total = total;
-    threadpool_add_job(pool, obf_worker, args);
+__encode(encode_batch *batch, const obfuscation *obf, container_stream *stream,
+         encoding **slot, size_t idx, const mpz_t *base, mpz_srcptr x,
+         mpz_srcptr y, const index_set *ix)
+{
+    if (obf->checkpoint && checkpoint_done(obf->checkpoint, idx))
+        return;
+    if (stream && container_stream_failed(stream))
+        return;
+    encode_job job = {
+        .stream = stream,
+        .idx = idx,
+        .slots = base,
+        .nover = 2,
+        .over = { 0, 1 },
+        .value = { x, y },
+        .ix = ix,
+    };
+    if (stream == NULL) {
+        job.enc = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        *slot = job.enc;
+    }
+    encode_batch_add(batch, &job);
 }
 
 static obfuscation *
@@ -96,13 +195,13 @@ _alloc(const mmap_vtable *mmap, const obf_params_t *op)
         obf->what[k] = my_calloc(cp->qs[k], sizeof obf->what[0][0]);
         for (size_t s = 0; s < cp->qs[k]; s++) {
             obf->shat[k][s] = my_calloc(cp->ds[k], sizeof obf->shat[0][0][0]);
-            obf->uhat[k][s] = my_calloc(op->npowers, sizeof obf->uhat[0][0][0]);
+            obf->uhat[k][s] = my_calloc(op_nlevels(op, k), sizeof obf->uhat[0][0][0]);
             obf->zhat[k][s] = my_calloc(noutputs, sizeof obf->zhat[0][0][0]);
             obf->what[k][s] = my_calloc(noutputs, sizeof obf->what[0][0][0]);
         }
     }
     obf->yhat = my_calloc(nconsts, sizeof obf->yhat[0]);
-    obf->vhat = my_calloc(op->npowers, sizeof obf->vhat[0]);
+    obf->vhat = my_calloc(op_nlevels(op, nsymbols), sizeof obf->vhat[0]);
     obf->Chatstar = my_calloc(noutputs, sizeof obf->Chatstar[0]);
 
     return obf;
@@ -124,7 +223,7 @@ _free(obfuscation *obf)
         for (size_t s = 0; s < cp->qs[k]; s++) {
             for (size_t j = 0; j < cp->ds[k]; j++)
                 encoding_free(obf->enc_vt, obf->shat[k][s][j]);
-            for (size_t p = 0; p < op->npowers; p++)
+            for (size_t p = 0; p < op_nlevels(op, k); p++)
                 encoding_free(obf->enc_vt, obf->uhat[k][s][p]);
             for (size_t o = 0; o < noutputs; o++) {
                 encoding_free(obf->enc_vt, obf->zhat[k][s][o]);
@@ -147,7 +246,7 @@ _free(obfuscation *obf)
     for (size_t i = 0; i < nconsts; i++)
         encoding_free(obf->enc_vt, obf->yhat[i]);
     free(obf->yhat);
-    for (size_t p = 0; p < op->npowers; p++)
+    for (size_t p = 0; p < op_nlevels(op, nsymbols); p++)
         encoding_free(obf->enc_vt, obf->vhat[p]);
     free(obf->vhat);
     for (size_t i = 0; i < noutputs; i++)
@@ -158,15 +257,156 @@ _free(obfuscation *obf)
         public_params_free(obf->pp_vt, obf->pp);
     if (obf->sp)
         secret_params_free(obf->sp_vt, obf->sp);
+    container_close(obf->container);
+    checkpoint_free(obf->checkpoint);
+    raise_plan_free(obf->plan);
+    sched_graph_free(obf->graph);
+    if (obf->consts) {
+        for (size_t i = 0; i < container_nentries(obf->consts); ++i)
+            encoding_free(obf->enc_vt, obf->seeded[i]);
+        free(obf->seeded);
+        free(obf->seeds);
+        container_close(obf->consts);
+    }
 
     free(obf);
 }
 
+/* Restores the secret parameters from the checkpoint, or generates and
+ * checkpoints them */
+static secret_params *
+_secret_params(const obfuscation *obf, size_t secparam, size_t *kappa,
+               size_t nthreads, aes_randstate_t rng)
+{
+    const size_t nentries = obf_params_num_encodings(obf->op);
+    secret_params *sp;
+    size_t n, lambda;
+    FILE *fp;
+
+    if (obf->checkpoint == NULL)
+        return secret_params_new(obf->sp_vt, obf->op, secparam, kappa, nthreads, rng);
+    if ((fp = checkpoint_state_fopen(obf->checkpoint, "secret_params"))) {
+        sp = NULL;
+        if (size_t_fread(&n, fp) == ERR || size_t_fread(&lambda, fp) == ERR
+            || size_t_fread(kappa, fp) == ERR)
+            goto done;
+        if (n != nentries || lambda != secparam) {
+            fprintf(stderr, "%s: checkpoint does not match circuit or secparam\n",
+                    errorstr);
+            goto done;
+        }
+        sp = secret_params_fread(obf->sp_vt, &obf->op->cp, fp);
+    done:
+        fclose(fp);
+        return sp;
+    }
+    sp = secret_params_new(obf->sp_vt, obf->op, secparam, kappa, nthreads, rng);
+    if (sp == NULL)
+        return NULL;
+    if ((fp = checkpoint_state_create(obf->checkpoint, "secret_params")) == NULL)
+        goto error;
+    if (size_t_fwrite(nentries, fp) == ERR || size_t_fwrite(secparam, fp) == ERR
+        || size_t_fwrite(*kappa, fp) == ERR
+        || secret_params_fwrite(obf->sp_vt, sp, fp) == ERR) {
+        fclose(fp);
+        goto error;
+    }
+    if (checkpoint_state_commit(obf->checkpoint, "secret_params", fp) == ERR)
+        goto error;
+    return sp;
+error:
+    secret_params_free(obf->sp_vt, sp);
+    return NULL;
+}
+
+/* Restores the sampled randomness |xs| from the checkpoint, if it has been
+ * saved there */
+static int
+_randomness_fread(const obfuscation *obf, mpz_t **xs, size_t n, bool *restored)
+{
+    FILE *fp;
+
+    *restored = false;
+    if (obf->checkpoint == NULL
+        || (fp = checkpoint_state_fopen(obf->checkpoint, "randomness")) == NULL)
+        return OK;
+    for (size_t i = 0; i < n; ++i) {
+        if (mpz_fread(xs[i], fp) == ERR) {
+            fprintf(stderr, "%s: corrupt checkpoint randomness\n", errorstr);
+            fclose(fp);
+            return ERR;
+        }
+    }
+    fclose(fp);
+    *restored = true;
+    return OK;
+}
+
+static int
+_randomness_fwrite(const obfuscation *obf, mpz_t **xs, size_t n)
+{
+    FILE *fp;
+
+    if (obf->checkpoint == NULL)
+        return OK;
+    if ((fp = checkpoint_state_create(obf->checkpoint, "randomness")) == NULL)
+        return ERR;
+    for (size_t i = 0; i < n; ++i) {
+        if (mpz_fwrite(*xs[i], fp) == ERR) {
+            fclose(fp);
+            return ERR;
+        }
+    }
+    return checkpoint_state_commit(obf->checkpoint, "randomness", fp);
+}
+
+/* What each ref costs beyond its gate: the multiplications raising its
+ * operands and, for outputs, checking the result */
+static size_t *
+_extra_costs(const obfuscation *obf)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    const size_t ninputs = acirc_ninputs(cp->circ);
+    circ_operands_t ops;
+    size_t *extra;
+
+    if (obf->plan == NULL)
+        return NULL;
+    extra = my_calloc(obf->plan->nrefs, sizeof extra[0]);
+    for (size_t ref = 0; ref < obf->plan->nrefs; ++ref)
+        extra[ref] = (obf->plan->x[ref].nsteps + obf->plan->y[ref].nsteps)
+            * SCHED_COST_MUL;
+    circ_params_operands(cp, &ops);
+    for (size_t o = 0; o < obf->plan->noutputs; ++o)
+        extra[ops.outrefs[o]] += (2 * ninputs + obf->plan->out[o].nsteps)
+            * SCHED_COST_MUL;
+    circ_operands_clear(&ops);
+    return extra;
+}
+
+/* Plans the raises evaluation does and the schedule weighted by them */
+static void
+_plan(obfuscation *obf)
+{
+    size_t *extra;
+
+    obf->plan = raise_plan_new(obf->op);
+    extra = _extra_costs(obf);
+    obf->graph = sched_graph_new(obf->op->cp.circ, extra);
+    free(extra);
+}
+
+/* Obfuscates, either keeping every encoding in memory or, when |fp| is
+ * given, writing the obfuscation to |fp| as the encodings finish.  With a
+ * checkpoint directory, resumes from and records progress there. */
 static obfuscation *
-_obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
-           size_t *kappa, size_t nthreads, aes_randstate_t rng)
+__obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
+            size_t *kappa, size_t nthreads, aes_randstate_t rng, FILE *fp,
+            const char *ckdir)
 {
     obfuscation *obf;
+    container_stream *stream = NULL;
+    encoding_pool *encs = NULL;
 
     const circ_params_t *cp = &op->cp;
     const size_t nsymbols = acirc_nsymbols(cp->circ);
@@ -179,7 +419,14 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         return NULL;
 
     obf = _alloc(mmap, op);
-    obf->sp = secret_params_new(obf->sp_vt, op, secparam, kappa, nthreads, rng);
+    if (ckdir) {
+        obf->checkpoint = checkpoint_new(ckdir, obf->enc_vt, obf_params_num_encodings(op));
+        if (obf->checkpoint == NULL) {
+            _free(obf);
+            return NULL;
+        }
+    }
+    obf->sp = _secret_params(obf, secparam, kappa, nthreads, rng);
     if (obf->sp == NULL) {
         _free(obf);
         return NULL;
@@ -189,27 +436,41 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         _free(obf);
         return NULL;
     }
-
-    for (size_t k = 0; k < nsymbols; k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t j = 0; j < cp->ds[k]; j++) {
-                obf->shat[k][s][j] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            }
-            for (size_t p = 0; p < op->npowers; p++) {
-                obf->uhat[k][s][p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-            }
-            for (size_t o = 0; o < noutputs; o++) {
-                obf->zhat[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-                obf->what[k][s][o] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (fp) {
+        container_writer *w;
+        if ((w = container_writer_new(fp, obf_params_num_encodings(op))) == NULL) {
+            _free(obf);
+            return NULL;
+        }
+        public_params_fwrite(obf->pp_vt, obf->pp, fp);
+        if (obf_params_levels_fwrite(op, fp) == ERR) {
+            container_writer_free(w);
+            _free(obf);
+            return NULL;
+        }
+        if (obf->checkpoint) {
+            if (checkpoint_replay(obf->checkpoint) == ERR) {
+                container_writer_free(w);
+                _free(obf);
+                return NULL;
             }
+            if (g_verbose)
+                fprintf(stderr, "Resuming with %lu encodings from checkpoint\n",
+                        checkpoint_ndone(obf->checkpoint));
+        }
+        /* Bound the encodings alive at once to a few per thread */
+        encs = encoding_pool_new(obf->enc_vt, obf->pp_vt, obf->pp);
+        stream = container_stream_new(w, obf->enc_vt, encs, 4 * (nthreads ? nthreads : 1),
+                                      obf->checkpoint ? checkpoint_restore : NULL,
+                                      obf->checkpoint ? checkpoint_add_encoding : NULL,
+                                      obf->checkpoint);
+        if (stream == NULL) {
+            container_writer_free(w);
+            encoding_pool_free(encs);
+            _free(obf);
+            return NULL;
         }
     }
-    for (size_t i = 0; i < nconsts; i++)
-        obf->yhat[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    for (size_t p = 0; p < op->npowers; p++)
-        obf->vhat[p] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    for (size_t i = 0; i < noutputs; i++)
-        obf->Chatstar[i] = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
 
     const mpz_t *moduli = obf->mmap->sk->plaintext_fields(obf->sp->sk);
 
@@ -222,51 +483,99 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     mpz_t gamma[nsymbols][q][noutputs];
     mpz_t delta[nsymbols][q][noutputs];
     mpz_t Cstar[noutputs];
+    mpz_t **randomness;
+    mpz_srcptr *rmoduli;
+    size_t nrand = 0;
+    bool restored, failed = false;
     threadpool *pool = threadpool_create(nthreads);
+    encode_batch *batch;
+    progress *progress;
+    mpz_srcptr zero, one;
+
+    long *const_deg = NULL;
+    long const_deg_max = 0;
+    long *var_deg[nsymbols];
+    long var_deg_max[nsymbols];
+
+    memset(var_deg, '\0', sizeof var_deg);
+    memset(var_deg_max, '\0', sizeof var_deg_max);
 
     alpha = calloc(nsymbols * ell, sizeof alpha[0]);
     for (size_t i = 0; i < nsymbols * ell; ++i)
         alpha[i] = mpz_vect_new(1);
-
-    pthread_mutex_t count_lock;
-    size_t count = 0;
-    const size_t total = obf_params_num_encodings(op);
-
-    pthread_mutex_init(&count_lock, NULL);
-    mpz_vect_init(inps, 2);
-
-    assert(obf->mmap->sk->nslots(obf->sp->sk) >= 2);
-
-    for (size_t k = 0; k < nsymbols; k++) {
-        for (size_t j = 0; j < cp->ds[k]; j++) {
-            mpz_randomm_inv(*alpha[k * cp->ds[k] + j], rng, moduli[1]);
-        }
-    }
     for (size_t k = 0; k < nsymbols; k++) {
         for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t o = 0; o < noutputs; o++) {
+            for (size_t o = 0; o < noutputs; o++)
                 mpz_inits(gamma[k][s][o], delta[k][s][o], NULL);
-                mpz_randomm_inv(delta[k][s][o], rng, moduli[0]);
-                mpz_randomm_inv(gamma[k][s][o], rng, moduli[1]);
-            }
         }
     }
-
     if (nconsts) {
         beta = calloc(nconsts, sizeof beta[0]);
-        for (size_t i = 0; i < nconsts; i++) {
+        for (size_t i = 0; i < nconsts; i++)
             beta[i] = mpz_vect_new(1);
-            mpz_randomm_inv(*beta[i], rng, moduli[1]);
+    }
+    for (size_t o = 0; o < noutputs; o++)
+        mpz_init(Cstar[o]);
+
+    /* All sampled randomness, in a fixed order for checkpointing, with the
+     * modulus each value is drawn from */
+    randomness = my_calloc(nsymbols * ell + 2 * nsymbols * q * noutputs + nconsts,
+                           sizeof randomness[0]);
+    rmoduli = my_calloc(nsymbols * ell + 2 * nsymbols * q * noutputs + nconsts,
+                        sizeof rmoduli[0]);
+    for (size_t i = 0; i < nsymbols * ell; ++i) {
+        rmoduli[nrand] = moduli[1];
+        randomness[nrand++] = alpha[i];
+    }
+    for (size_t k = 0; k < nsymbols; k++) {
+        for (size_t s = 0; s < cp->qs[k]; s++) {
+            for (size_t o = 0; o < noutputs; o++) {
+                rmoduli[nrand] = moduli[1];
+                randomness[nrand++] = &gamma[k][s][o];
+                rmoduli[nrand] = moduli[0];
+                randomness[nrand++] = &delta[k][s][o];
+            }
         }
     }
+    for (size_t i = 0; i < nconsts; i++) {
+        rmoduli[nrand] = moduli[1];
+        randomness[nrand++] = beta[i];
+    }
 
-    long *const_deg;
-    long const_deg_max = 0;
-    long *var_deg[nsymbols];
-    long var_deg_max[nsymbols];
+    mpz_vect_init(inps, 2);
+    progress = progress_new("encode",
+                            obf->checkpoint ? checkpoint_ndone(obf->checkpoint) : 0,
+                            obf_params_num_encodings(op));
+    batch = encode_batch_new(pool, obf->enc_vt, obf->sp, 2, nthreads, progress);
+    /* Every job replaces both slots of inps, so it only serves as a base */
+    mpz_set_ui(inps[0], 0);
+    mpz_set_ui(inps[1], 1);
+    zero = inps[0];
+    one = inps[1];
+    ix = index_set_new(obf_params_nzs(cp));
 
-    memset(var_deg, '\0', sizeof var_deg);
-    memset(var_deg_max, '\0', sizeof var_deg_max);
+    assert(obf->mmap->sk->nslots(obf->sp->sk) >= 2);
+
+    if (_randomness_fread(obf, randomness, nrand, &restored) == ERR) {
+        failed = true;
+        goto cleanup;
+    }
+    if (!restored) {
+        /* Each value is drawn from its own substream, on the pool, so value
+         * i of the checkpoint always comes from substream i */
+        mpz_ptr *xs = my_calloc(nrand, sizeof xs[0]);
+        rand_streams rs;
+
+        for (size_t i = 0; i < nrand; ++i)
+            xs[i] = *randomness[i];
+        rand_streams_init(&rs, rng);
+        rand_streams_units(&rs, 0, xs, rmoduli, nrand, pool, nthreads);
+        free(xs);
+        if (_randomness_fwrite(obf, randomness, nrand) == ERR) {
+            failed = true;
+            goto cleanup;
+        }
+    }
 
     const_deg = acirc_const_degrees(circ);
     for (size_t o = 0; o < noutputs; o++) {
@@ -282,71 +591,56 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
         }
     }
 
-    if (g_verbose)
-        print_progress(count, total);
-
     for (size_t k = 0; k < nsymbols; k++) {
         for (size_t s = 0; s < cp->qs[k]; s++) {
             for (size_t j = 0; j < cp->ds[k]; j++) {
-                ix = index_set_new(obf_params_nzs(cp));
-                mpz_set_ui(inps[0], op->sigma ? s == j : bit(s, j));
-                mpz_set   (inps[1], *alpha[k * cp->ds[k] + j]);
+                index_set_clear(ix);
                 ix_s_set(ix, cp, k, s, 1);
-                __encode(pool, obf->enc_vt, obf->shat[k][s][j], inps,
-                         ix, obf->sp, &count_lock, &count, total);
+                __encode(batch, obf, stream, &obf->shat[k][s][j], _entry_shat(op, k, s, j),
+                         inps, (op->sigma ? s == j : bit(s, j)) ? one : zero,
+                         *alpha[k * cp->ds[k] + j], ix);
             }
-            ix = index_set_new(obf_params_nzs(cp));
-            mpz_set_ui(inps[0], 1);
-            mpz_set_ui(inps[1], 1);
-            for (size_t p = 0; p < op->npowers; p++) {
-                ix_s_set(ix, cp, k, s, 1 << p);
-                __encode(pool, obf->enc_vt, obf->uhat[k][s][p], inps,
-                         ix, obf->sp, &count_lock, &count, total);
+            for (size_t p = 0; p < op_nlevels(op, k); p++) {
+                index_set_clear(ix);
+                ix_s_set(ix, cp, k, s, op_level(op, k, p));
+                __encode(batch, obf, stream, &obf->uhat[k][s][p], _entry_uhat(op, k, s, p),
+                         inps, one, one, ix);
             }
             for (size_t o = 0; o < noutputs; o++) {
-                ix = index_set_new(obf_params_nzs(cp));
-                if (k == 0)
-                    ix_y_set(ix, cp, const_deg_max - const_deg[o]);
-                for (size_t r = 0; r < cp->qs[k]; r++)
-                    ix_s_set(ix, cp, k, r, r == s ? var_deg_max[k] - var_deg[k][o] : var_deg_max[k]);
-                ix_z_set(ix, cp, k, 1);
-                ix_w_set(ix, cp, k, 1);
-                mpz_set(inps[0], delta[k][s][o]);
-                mpz_set(inps[1], gamma[k][s][o]);
-                __encode(pool, obf->enc_vt, obf->zhat[k][s][o], inps,
-                         ix, obf->sp, &count_lock, &count, total);
-                ix = index_set_new(obf_params_nzs(cp));
+                index_set_clear(ix);
+                ix_zhat_set(ix, cp, const_deg, const_deg_max, var_deg, var_deg_max,
+                            k, s, o);
+                __encode(batch, obf, stream, &obf->zhat[k][s][o], _entry_zhat(op, k, s, o),
+                         inps, delta[k][s][o], gamma[k][s][o], ix);
+                index_set_clear(ix);
                 ix_w_set(ix, cp, k, 1);
-                mpz_set_ui(inps[0], 0);
-                mpz_set   (inps[1], gamma[k][s][o]);
-                __encode(pool, obf->enc_vt, obf->what[k][s][o], inps,
-                         ix, obf->sp, &count_lock, &count, total);
+                __encode(batch, obf, stream, &obf->what[k][s][o], _entry_what(op, k, s, o),
+                         inps, zero, gamma[k][s][o], ix);
             }
         }
     }
 
     for (size_t i = 0; i < nconsts; i++) {
-        ix = index_set_new(obf_params_nzs(cp));
+        mpz_t c;
+        mpz_init_set_si(c, acirc_const(circ, i));
+        index_set_clear(ix);
         ix_y_set(ix, cp, 1);
-        mpz_set_si(inps[0], acirc_const(circ, i));
-        mpz_set   (inps[1], *beta[i]);
-        __encode(pool, obf->enc_vt, obf->yhat[i], inps, ix,
-                 obf->sp, &count_lock, &count, total);
+        __encode(batch, obf, stream, &obf->yhat[i], _entry_yhat(op, i), inps,
+                 encode_batch_value(batch, c), *beta[i], ix);
+        mpz_clear(c);
     }
-    for (size_t p = 0; p < op->npowers; p++) {
-        ix = index_set_new(obf_params_nzs(cp));
-        ix_y_set(ix, cp, 1 << p);
-        mpz_set_ui(inps[0], 1);
-        mpz_set_ui(inps[1], 1);
-        __encode(pool, obf->enc_vt, obf->vhat[p], inps, ix,
-                 obf->sp, &count_lock, &count, total);
+    for (size_t p = 0; p < op_nlevels(op, nsymbols); p++) {
+        index_set_clear(ix);
+        ix_y_set(ix, cp, op_level(op, nsymbols, p));
+        __encode(batch, obf, stream, &obf->vhat[p], _entry_vhat(op, p), inps,
+                 one, one, ix);
     }
 
     {
         mpz_t **outputs;
         outputs = acirc_eval_mpz(circ, alpha, beta, moduli[1]);
         for (size_t o = 0; o < noutputs; ++o) {
-            mpz_init_set(Cstar[o], *outputs[o]);
+            mpz_set(Cstar[o], *outputs[o]);
             mpz_clear(*outputs[o]);
             free(outputs[o]);
         }
@@ -354,7 +648,7 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     }
 
     for (size_t i = 0; i < noutputs; i++) {
-        ix = index_set_new(obf_params_nzs(cp));
+        index_set_clear(ix);
         ix_y_set(ix, cp, const_deg_max);
         for (size_t k = 0; k < nsymbols; k++) {
             for (size_t s = 0; s < cp->qs[k]; s++) {
@@ -362,19 +656,21 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
             }
             ix_z_set(ix, cp, k, 1);
         }
-
-        mpz_set_ui(inps[0], 0);
-        mpz_set   (inps[1], Cstar[i]);
-
-        __encode(pool, obf->enc_vt, obf->Chatstar[i], inps,
-                 ix, obf->sp, &count_lock, &count, total);
+        __encode(batch, obf, stream, &obf->Chatstar[i], _entry_Chatstar(op, i),
+                 inps, zero, Cstar[i], ix);
     }
 
+cleanup:
+    encode_batch_flush(batch);
     if (nthreads)
         threadpool_destroy(pool);
-    pthread_mutex_destroy(&count_lock);
+    encode_batch_free(batch);
+    progress_free(progress);
+    index_set_free(ix);
 
     mpz_vect_clear(inps, 2);
+    free(randomness);
+    free(rmoduli);
 
     for (size_t k = 0; k < nsymbols; k++) {
         for (size_t j = 0; j < cp->ds[k]; j++) {
@@ -401,9 +697,39 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
 
     /* mpz_vect_free(moduli, obf->mmap->sk->nslots(obf->sp->sk)); */
 
+    if (stream && container_stream_finish(stream) == ERR)
+        failed = true;
+    encoding_pool_free(encs);
+    if (failed) {
+        _free(obf);
+        return NULL;
+    }
+    if (stream == NULL)
+        _plan(obf);
     return obf;
 }
 
+static obfuscation *
+_obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
+           size_t *kappa, size_t nthreads, aes_randstate_t rng)
+{
+    return __obfuscate(mmap, op, secparam, kappa, nthreads, rng, NULL, NULL);
+}
+
+static int
+_obfuscate_fwrite(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp,
+                  const char *checkpoint, size_t secparam, size_t *kappa,
+                  size_t nthreads, aes_randstate_t rng)
+{
+    obfuscation *obf;
+
+    obf = __obfuscate(mmap, op, secparam, kappa, nthreads, rng, fp, checkpoint);
+    if (obf == NULL)
+        return ERR;
+    _free(obf);
+    return OK;
+}
+
 static int
 _fwrite(const obfuscation *const obf, FILE *const fp)
 {
@@ -412,27 +738,40 @@ _fwrite(const obfuscation *const obf, FILE *const fp)
     const circ_params_t *cp = &op->cp;
     const size_t nconsts = acirc_nconsts(cp->circ);
     const size_t noutputs = acirc_noutputs(cp->circ);
+    container_writer *w;
+
+#define ADD(idx, enc)                                                   \
+    if (container_writer_add_encoding(w, (idx), obf->enc_vt, (enc)) == ERR) \
+        goto error
 
+    if ((w = container_writer_new(fp, obf_params_num_encodings(op))) == NULL)
+        return ERR;
     public_params_fwrite(obf->pp_vt, obf->pp, fp);
+    if (obf_params_levels_fwrite(op, fp) == ERR)
+        goto error;
     for (size_t k = 0; k < acirc_nsymbols(cp->circ); k++) {
         for (size_t s = 0; s < cp->qs[k]; s++) {
             for (size_t j = 0; j < cp->ds[k]; j++)
-                encoding_fwrite(obf->enc_vt, obf->shat[k][s][j], fp);
-            for (size_t p = 0; p < op->npowers; p++)
-                encoding_fwrite(obf->enc_vt, obf->uhat[k][s][p], fp);
+                ADD(_entry_shat(op, k, s, j), obf->shat[k][s][j]);
+            for (size_t p = 0; p < op_nlevels(op, k); p++)
+                ADD(_entry_uhat(op, k, s, p), obf->uhat[k][s][p]);
             for (size_t o = 0; o < noutputs; o++) {
-                encoding_fwrite(obf->enc_vt, obf->zhat[k][s][o], fp);
-                encoding_fwrite(obf->enc_vt, obf->what[k][s][o], fp);
+                ADD(_entry_zhat(op, k, s, o), obf->zhat[k][s][o]);
+                ADD(_entry_what(op, k, s, o), obf->what[k][s][o]);
             }
         }
     }
     for (size_t j = 0; j < nconsts; j++)
-        encoding_fwrite(obf->enc_vt, obf->yhat[j], fp);
-    for (size_t p = 0; p < op->npowers; p++)
-        encoding_fwrite(obf->enc_vt, obf->vhat[p], fp);
-    for (size_t k = 0; k < noutputs; k++)
-        encoding_fwrite(obf->enc_vt, obf->Chatstar[k], fp);
-    return OK;
+        ADD(_entry_yhat(op, j), obf->yhat[j]);
+    for (size_t p = 0; p < op_nlevels(op, acirc_nsymbols(cp->circ)); p++)
+        ADD(_entry_vhat(op, p), obf->vhat[p]);
+    for (size_t o = 0; o < noutputs; o++)
+        ADD(_entry_Chatstar(op, o), obf->Chatstar[o]);
+#undef ADD
+    return container_writer_finish(w);
+error:
+    container_writer_free(w);
+    return ERR;
 }
 
 static obfuscation *
@@ -440,108 +779,274 @@ _fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
 {
     obfuscation *obf;
 
-    const circ_params_t *cp = &op->cp;
-    const size_t nconsts = acirc_nconsts(cp->circ);
-    const size_t noutputs = acirc_noutputs(cp->circ);
-
     if ((obf = _alloc(mmap, op)) == NULL)
         return NULL;
-
-    obf->pp = public_params_fread(obf->pp_vt, op, fp);
-    for (size_t k = 0; k < acirc_nsymbols(cp->circ); k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            for (size_t j = 0; j < cp->ds[k]; j++)
-                obf->shat[k][s][j] = encoding_fread(obf->enc_vt, fp);
-            for (size_t p = 0; p < op->npowers; p++)
-                obf->uhat[k][s][p] = encoding_fread(obf->enc_vt, fp);
-            for (size_t o = 0; o < noutputs; o++) {
-                obf->zhat[k][s][o] = encoding_fread(obf->enc_vt, fp);
-                obf->what[k][s][o] = encoding_fread(obf->enc_vt, fp);
-            }
-        }
+    if ((obf->container = container_open(fp)) == NULL)
+        goto error;
+    if (container_nentries(obf->container) != obf_params_num_encodings(op)) {
+        fprintf(stderr, "%s: obfuscation does not match circuit\n", errorstr);
+        goto error;
     }
-    for (size_t i = 0; i < nconsts; i++)
-        obf->yhat[i] = encoding_fread(obf->enc_vt, fp);
-    for (size_t p = 0; p < op->npowers; p++)
-        obf->vhat[p] = encoding_fread(obf->enc_vt, fp);
-    for (size_t i = 0; i < noutputs; i++)
-        obf->Chatstar[i] = encoding_fread(obf->enc_vt, fp);
+    /* Encodings are decoded from the container as evaluation needs them */
+    obf->pp = public_params_fread(obf->pp_vt, op, fp);
+    if (obf_params_levels_check(op, fp) == ERR)
+        goto error;
+    _plan(obf);
     return obf;
+error:
+    _free(obf);
+    return NULL;
 }
 
-static size_t g_max_npowers = 0;
+/* The input-dependent encodings used by a single evaluation: shat and uhat
+ * for the chosen symbol of each slot, and zhat and what for each input */
+typedef struct {
+    encoding ***shat;           // [c][ℓ]
+    encoding ***uhat;           // [c][nlevels]
+    encoding ***zhat;           // [n][γ]
+    encoding ***what;           // [n][γ]
+    bool local;                 // decoded for this evaluation only
+} selection;
+
+typedef struct {
+    const container *c;
+    const encoding_vtable *vt;
+    size_t idx;
+    encoding **slot;
+} select_args;
 
 static void
-_raise_encoding(const obfuscation *obf, encoding *x, encoding **ys, size_t diff)
+select_worker(void *vargs)
 {
-    while (diff > 0) {
-        // want to find the largest power we obfuscated to multiply by
-        size_t p = 0;
-        while (((size_t) 1 << (p+1)) <= diff && (p+1) < obf->op->npowers)
-            p++;
-        if (g_max_npowers < p + 1)
-            g_max_npowers = p + 1;
-        encoding_mul(obf->enc_vt, obf->pp_vt, x, x, ys[p], obf->pp);
-        diff -= (1 << p);
+    select_args *args = vargs;
+    *args->slot = container_read_encoding(args->c, args->vt, args->idx);
+    free(args);
+}
+
+static void
+_select_row(threadpool *pool, const obfuscation *obf, encoding ***row,
+            encoding **src, size_t n, size_t (*entry)(const obf_params_t *, size_t, size_t, size_t),
+            size_t k, size_t s)
+{
+    if (obf->container == NULL) {
+        *row = src;
+        return;
+    }
+    *row = my_calloc(n, sizeof row[0][0]);
+    for (size_t i = 0; i < n; ++i) {
+        select_args *args = my_calloc(1, sizeof args[0]);
+        args->c = obf->container;
+        args->vt = obf->enc_vt;
+        args->idx = entry(obf->op, k, s, i);
+        args->slot = &(*row)[i];
+        threadpool_add_job(pool, select_worker, args);
     }
 }
 
-static int
-raise_encoding(const obfuscation *obf, encoding *x, const index_set *target)
+static void
+_select_free(const obfuscation *obf, selection *sel)
 {
     const circ_params_t *cp = &obf->op->cp;
-    index_set *ix;
-    size_t diff;
+    const size_t nsymbols = acirc_nsymbols(cp->circ);
+    const size_t ninputs = acirc_ninputs(cp->circ);
+    const size_t noutputs = acirc_noutputs(cp->circ);
 
-    if ((ix = index_set_difference(target, obf->enc_vt->mmap_set(x))) == NULL)
-        return ERR;
-    for (size_t k = 0; k < acirc_nsymbols(cp->circ); k++) {
-        for (size_t s = 0; s < cp->qs[k]; s++) {
-            diff = ix_s_get(ix, cp, k, s);
-            _raise_encoding(obf, x, obf->uhat[k][s], diff);
+    if (sel->local) {
+        for (size_t k = 0; k < nsymbols; ++k) {
+            for (size_t j = 0; j < cp->ds[k]; ++j)
+                encoding_free(obf->enc_vt, sel->shat[k][j]);
+            for (size_t p = 0; p < op_nlevels(obf->op, k); ++p)
+                encoding_free(obf->enc_vt, sel->uhat[k][p]);
+            free(sel->shat[k]);
+            free(sel->uhat[k]);
+        }
+        for (size_t k = 0; k < ninputs; ++k) {
+            for (size_t o = 0; o < noutputs; ++o) {
+                encoding_free(obf->enc_vt, sel->zhat[k][o]);
+                encoding_free(obf->enc_vt, sel->what[k][o]);
+            }
+            free(sel->zhat[k]);
+            free(sel->what[k]);
         }
     }
-    diff = ix_y_get(ix, cp);
-    _raise_encoding(obf, x, obf->vhat, diff);
-    index_set_free(ix);
-    return OK;
+    free(sel->shat);
+    free(sel->uhat);
+    free(sel->zhat);
+    free(sel->what);
 }
 
+/* Seeks to and decodes only the encodings selected by the input */
 static int
-raise_encodings(const obfuscation *obf, encoding *x, encoding *y)
+_select(const obfuscation *obf, selection *sel, const size_t *input_syms,
+        const long *inputs, size_t nthreads)
 {
-    int ret = ERR;
-    index_set *ix;
+    const obf_params_t *op = obf->op;
+    const circ_params_t *cp = &op->cp;
+    const size_t nsymbols = acirc_nsymbols(cp->circ);
+    const size_t ninputs = acirc_ninputs(cp->circ);
+    const size_t noutputs = acirc_noutputs(cp->circ);
+    threadpool *pool;
 
-    ix = index_set_union(obf->enc_vt->mmap_set(x),
-                         obf->enc_vt->mmap_set(y));
-    if (raise_encoding(obf, x, ix) == ERR)
-        goto cleanup;
-    if (raise_encoding(obf, y, ix) == ERR)
-        goto cleanup;
-    ret = OK;
-cleanup:
-    index_set_free(ix);
-    return ret;
+    sel->local = obf->container != NULL;
+    sel->shat = my_calloc(nsymbols, sizeof sel->shat[0]);
+    sel->uhat = my_calloc(nsymbols, sizeof sel->uhat[0]);
+    sel->zhat = my_calloc(ninputs, sizeof sel->zhat[0]);
+    sel->what = my_calloc(ninputs, sizeof sel->what[0]);
+
+    pool = threadpool_create(nthreads ? nthreads : 1);
+    for (size_t k = 0; k < nsymbols; ++k) {
+        const size_t s = input_syms[k];
+        _select_row(pool, obf, &sel->shat[k], obf->shat[k][s], cp->ds[k],
+                    _entry_shat, k, s);
+        _select_row(pool, obf, &sel->uhat[k], obf->uhat[k][s], op_nlevels(op, k),
+                    _entry_uhat, k, s);
+    }
+    for (size_t k = 0; k < ninputs; ++k) {
+        const size_t s = inputs[k];
+        _select_row(pool, obf, &sel->zhat[k], obf->zhat[k][s], noutputs,
+                    _entry_zhat, k, s);
+        _select_row(pool, obf, &sel->what[k], obf->what[k][s], noutputs,
+                    _entry_what, k, s);
+    }
+    threadpool_destroy(pool);
+
+    if (sel->local) {
+        for (size_t k = 0; k < nsymbols; ++k) {
+            for (size_t j = 0; j < cp->ds[k]; ++j)
+                if (sel->shat[k][j] == NULL) goto error;
+            for (size_t p = 0; p < op_nlevels(op, k); ++p)
+                if (sel->uhat[k][p] == NULL) goto error;
+        }
+        for (size_t k = 0; k < ninputs; ++k)
+            for (size_t o = 0; o < noutputs; ++o)
+                if (sel->zhat[k][o] == NULL || sel->what[k][o] == NULL)
+                    goto error;
+    }
+    return OK;
+error:
+    _select_free(obf, sel);
+    return ERR;
 }
 
 typedef struct {
     const obfuscation *obf;
+    const selection *sel;
     size_t *input_syms;
     long *inputs;
     size_t *kappas;
+    size_t max_npowers;
+    encoding_pool *pool;
+    const size_t *seeds;        // [nrefs] while precomputing constant gates
+    encoding **consts;          // their results, by seed entry
+    eval_cache *cache;          // shared across a batch, if any
+    encoding **hits;            // [nrefs] cached gates for this input
+    const bool *needed;         // [nrefs] refs this input must compute
+    bool failed;                // an encoding could not be read; atomic
 } obf_args_t;
 
+/* Marks the evaluation as failed; gates past this point compute nothing */
 static void *
-copy_f(void *x, void *args_)
+_fail(obf_args_t *args)
+{
+    __atomic_store_n(&args->failed, true, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static bool
+_failed(obf_args_t *args)
+{
+    return __atomic_load_n(&args->failed, __ATOMIC_RELAXED);
+}
+
+/* Multiplies x by uhat[k][s] (or by vhat if k is the number of symbols) until
+ * its exponent has grown by diff */
+static int
+_raise_encoding(obf_args_t *args, encoding *x, size_t k, size_t s, size_t diff)
+{
+    const obfuscation *const obf = args->obf;
+    const size_t nsymbols = acirc_nsymbols(obf->op->cp.circ);
+
+    while (diff > 0) {
+        const size_t p = raise_power(obf->op, k, diff);
+        const size_t n = diff / op_level(obf->op, k, p);
+        size_t cur;
+        const encoding *u;
+        /* gates are raised concurrently, so keep the maximum atomically */
+        while ((cur = args->max_npowers) < p + 1
+               && !__sync_bool_compare_and_swap(&args->max_npowers, cur, p + 1))
+            ;
+        if (k == nsymbols)
+            u = _vhat(obf, p);
+        else if (s == args->input_syms[k])
+            u = args->sel->uhat[k][p];
+        else
+            u = _uhat(obf, k, s, p);
+        if (u == NULL)
+            return ERR;
+        /* the largest level is taken until it no longer fits */
+        encoding_raise_inplace(obf->enc_vt, obf->pp_vt, x, u, n, obf->pp);
+        diff -= n * op_level(obf->op, k, p);
+    }
+    return OK;
+}
+
+static int
+raise_encoding(encoding *x, const void *target, void *args_)
 {
     obf_args_t *args = args_;
     const obfuscation *const obf = args->obf;
-    encoding *out;
+    const circ_params_t *cp = &obf->op->cp;
+    const index_set *ix;
+    size_t diff;
+    int ret = ERR;
 
-    out = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    encoding_set(obf->enc_vt, out, x);
-    return out;
+    if ((ix = index_set_intern_difference(target, obf->enc_vt->mmap_set(x))) == NULL)
+        return ERR;
+    for (size_t k = 0; k < acirc_nsymbols(cp->circ); k++) {
+        for (size_t s = 0; s < cp->qs[k]; s++) {
+            diff = ix_s_get(ix, cp, k, s);
+            if (_raise_encoding(args, x, k, s, diff) == ERR)
+                goto cleanup;
+        }
+    }
+    diff = ix_y_get(ix, cp);
+    ret = _raise_encoding(args, x, acirc_nsymbols(cp->circ), 0, diff);
+cleanup:
+    index_set_release(ix);
+    return ret;
+}
+
+/* Performs the raises recorded in the plan, which are all by the powers of
+ * the input's selected symbols (or by vhat) */
+static int
+raise_planned(obf_args_t *args, encoding *x, const raise_list *list)
+{
+    const obfuscation *const obf = args->obf;
+    const size_t nsymbols = acirc_nsymbols(obf->op->cp.circ);
+
+    for (size_t i = 0; i < list->nsteps; ++i) {
+        const raise_step *step = &list->steps[i];
+        const encoding *u;
+        if (step->k == nsymbols)
+            u = _vhat(obf, step->p);
+        else
+            u = args->sel->uhat[step->k][step->p];
+        if (u == NULL)
+            return ERR;
+        encoding_mul_inplace(obf->enc_vt, obf->pp_vt, x, u, obf->pp);
+    }
+    return OK;
+}
+
+static int
+raise_planned_copy(obf_args_t *args, const encoding **x, const raise_list *list,
+                   encoding **tmp)
+{
+    if (list->nsteps == 0)
+        return OK;
+    *tmp = encoding_pool_copy(args->pool, *x);
+    *x = *tmp;
+    return raise_planned(args, *tmp, list);
 }
 
 static void *
@@ -552,54 +1057,99 @@ input_f(size_t ref, size_t i, void *args_)
     const obfuscation *const obf = args->obf;
     const circ_params_t *cp = &obf->op->cp;
     const size_t slot = circ_params_slot(cp, i);
-    const size_t sym = args->input_syms[slot];
     const size_t bit = circ_params_bit(cp, i);
-    return copy_f(obf->shat[slot][sym][bit], args_);
+    if (!circ_params_needs_ref(cp, ref) || args->consts
+        || (args->needed && !args->needed[ref]))
+        return NULL;
+    return encoding_ref(args->sel->shat[slot][bit]);
 }
 
 static void *
 const_f(size_t ref, size_t i, long val, void *args_)
 {
-    (void) ref; (void) val;
+    (void) val;
     obf_args_t *args = args_;
     const obfuscation *const obf = args->obf;
-    return copy_f(obf->yhat[i], args_);
+    if (!circ_params_needs_ref(&obf->op->cp, ref)
+        || (args->needed && !args->needed[ref]))
+        return NULL;
+    encoding *y = _yhat(obf, i);
+    return y ? encoding_ref(y) : _fail(args);
 }
 
 static void *
 eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref, const void *y_, void *args_)
 {
-    (void) ref; (void) xref; (void) yref;
-    const obf_args_t *const args = args_;
+    (void) xref; (void) yref;
+    obf_args_t *const args = args_;
     const obfuscation *const obf = args->obf;
     const encoding *x = x_;
     const encoding *y = y_;
-    encoding *res;
+    encoding *res = NULL;
 
-    res = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (!circ_params_needs_ref(&obf->op->cp, ref))
+        return NULL;
+    if (args->hits && args->hits[ref])
+        return encoding_ref(args->hits[ref]);
+    if (args->needed && !args->needed[ref])
+        return NULL;
+    if (args->consts) {
+        /* Precomputing, so only the input-independent gates */
+        if (args->seeds[ref] == SEED_NONE)
+            return NULL;
+    } else if (obf->seeds && obf->seeds[ref] != SEED_NONE) {
+        if (obf->seeds[ref] == SEED_SKIP)
+            return NULL;
+        encoding *seeded = _seeded(obf, obf->seeds[ref]);
+        return seeded ? encoding_ref(seeded) : _fail(args);
+    }
+    /* An operand is missing because an earlier read failed */
+    if (_failed(args) || x == NULL || y == NULL)
+        return _fail(args);
     switch (op) {
     case ACIRC_OP_MUL:
+        res = encoding_pool_get(args->pool);
         encoding_mul(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
         break;
     case ACIRC_OP_ADD:
     case ACIRC_OP_SUB: {
-        encoding *tmp_x, *tmp_y;
-        tmp_x = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        tmp_y = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-        encoding_set(obf->enc_vt, tmp_x, x);
-        encoding_set(obf->enc_vt, tmp_y, y);
-        if (!index_set_eq(obf->enc_vt->mmap_set(tmp_x), obf->enc_vt->mmap_set(tmp_y)))
-            raise_encodings(obf, tmp_x, tmp_y);
+        encoding *tmp_x = NULL, *tmp_y = NULL;
+        int raised = OK;
+        if (obf->plan) {
+            if ((raised = raise_planned_copy(args, &x, &obf->plan->x[ref], &tmp_x)) == OK)
+                raised = raise_planned_copy(args, &y, &obf->plan->y[ref], &tmp_y);
+        } else if (!index_set_eq(obf->enc_vt->mmap_set(x), obf->enc_vt->mmap_set(y))) {
+            raised = encoding_pool_raise_pair(args->pool, &x, &y, &tmp_x, &tmp_y,
+                                              raise_encoding, args);
+        }
+        if (raised == ERR) {
+            encoding_pool_put(args->pool, tmp_x);
+            encoding_pool_put(args->pool, tmp_y);
+            return _fail(args);
+        }
+        /* A raised copy is ours, so the result can overwrite it */
+        if (tmp_x) {
+            res = tmp_x;
+            tmp_x = NULL;
+        } else if (tmp_y) {
+            res = tmp_y;
+            tmp_y = NULL;
+        } else {
+            res = encoding_pool_get(args->pool);
+        }
         if (op == ACIRC_OP_ADD) {
-            encoding_add(obf->enc_vt, obf->pp_vt, res, tmp_x, tmp_y, obf->pp);
+            encoding_add(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
         } else if (op == ACIRC_OP_SUB) {
-            encoding_sub(obf->enc_vt, obf->pp_vt, res, tmp_x, tmp_y, obf->pp);
+            encoding_sub(obf->enc_vt, obf->pp_vt, res, x, y, obf->pp);
         }
-        encoding_free(obf->enc_vt, tmp_x);
-        encoding_free(obf->enc_vt, tmp_y);
+        encoding_pool_put(args->pool, tmp_y);
         break;
     }
     }
+    if (args->consts && args->seeds[ref] < SEED_SKIP)
+        args->consts[args->seeds[ref]] = encoding_ref(res);
+    if (args->cache)
+        eval_cache_offer(args->cache, args->input_syms, ref, res);
     return res;
 }
 
@@ -609,26 +1159,32 @@ output_f(size_t ref, size_t o, void *x, void *args_)
     (void) ref;
     long output = 1;
     obf_args_t *args = args_;
-    const long *inputs = args->inputs;
     const obfuscation *const obf = args->obf;
     const acirc_t *const circ = obf->op->cp.circ;
-    encoding *out, *lhs, *rhs, *tmp;
+    encoding *out, *lhs, *rhs;
+    const encoding *Chatstar;
     const index_set *const toplevel = obf->pp_vt->toplevel(obf->pp);
 
-    out = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    lhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    rhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    tmp = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (!circ_params_needs_output(&obf->op->cp, o) || args->consts)
+        return (void *) 0;
+    if (x == NULL || (Chatstar = _Chatstar(obf, o)) == NULL) {
+        _fail(args);
+        return (void *) output;
+    }
+    out = encoding_pool_get(args->pool);
+    lhs = encoding_pool_get(args->pool);
+    rhs = encoding_pool_get(args->pool);
 
     /* Compute LHS */
     encoding_set(obf->enc_vt, lhs, x);
-    for (size_t k = 0; k < acirc_ninputs(circ); k++) {
-        encoding_set(obf->enc_vt, tmp, lhs);
-        encoding_mul(obf->enc_vt, obf->pp_vt, lhs, tmp,
-                     obf->zhat[k][inputs[k]][o], obf->pp);
-    }
-    if (raise_encoding(obf, lhs, toplevel) == ERR)
+    for (size_t k = 0; k < acirc_ninputs(circ); k++)
+        encoding_mul_inplace(obf->enc_vt, obf->pp_vt, lhs,
+                             args->sel->zhat[k][o], obf->pp);
+    if ((obf->plan ? raise_planned(args, lhs, &obf->plan->out[o])
+         : raise_encoding(lhs, toplevel, args)) == ERR) {
+        _fail(args);
         goto cleanup;
+    }
     if (!index_set_eq(obf->enc_vt->mmap_set(lhs), toplevel)) {
         fprintf(stderr, "lhs != toplevel\n");
         index_set_print(obf->enc_vt->mmap_set(lhs));
@@ -637,12 +1193,10 @@ output_f(size_t ref, size_t o, void *x, void *args_)
     }
 
     /* Compute RHS */
-    encoding_set(obf->enc_vt, rhs, obf->Chatstar[o]);
-    for (size_t k = 0; k < acirc_ninputs(circ); k++) {
-        encoding_set(obf->enc_vt, tmp, rhs);
-        encoding_mul(obf->enc_vt, obf->pp_vt, rhs, tmp,
-                     obf->what[k][inputs[k]][o], obf->pp);
-    }
+    encoding_set(obf->enc_vt, rhs, Chatstar);
+    for (size_t k = 0; k < acirc_ninputs(circ); k++)
+        encoding_mul_inplace(obf->enc_vt, obf->pp_vt, rhs,
+                             args->sel->what[k][o], obf->pp);
     if (!index_set_eq(obf->enc_vt->mmap_set(rhs), toplevel)) {
         fprintf(stderr, "rhs != toplevel\n");
         index_set_print(obf->enc_vt->mmap_set(rhs));
@@ -655,10 +1209,9 @@ output_f(size_t ref, size_t o, void *x, void *args_)
         args->kappas[o] = encoding_get_degree(obf->enc_vt, out);
 
 cleanup:
-    encoding_free(obf->enc_vt, out);
-    encoding_free(obf->enc_vt, lhs);
-    encoding_free(obf->enc_vt, rhs);
-    encoding_free(obf->enc_vt, tmp);
+    encoding_pool_put(args->pool, out);
+    encoding_pool_put(args->pool, lhs);
+    encoding_pool_put(args->pool, rhs);
     return (void *) output;
 }
 
@@ -666,9 +1219,39 @@ static void
 free_f(void *x, void *args_)
 {
     obf_args_t *args = args_;
-    const obfuscation *const obf = args->obf;
-    if (x)
-        encoding_free(obf->enc_vt, x);
+    encoding_pool_put(args->pool, x);
+}
+
+/* The symbol each slot of |inputs| selects */
+static size_t *
+_input_syms(const obfuscation *obf, const long *inputs)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    acirc_t *circ = cp->circ;
+    const size_t has_consts = acirc_nconsts(circ) + acirc_nsecrets(circ) ? 1 : 0;
+    size_t *input_syms;
+    bool *sigmas;
+
+    sigmas = my_calloc(cp->nslots - has_consts, sizeof sigmas[0]);
+    for (size_t i = 0; i < cp->nslots - has_consts; ++i)
+        sigmas[i] = acirc_is_sigma(circ, i);
+    input_syms = get_input_syms(inputs, acirc_ninputs(circ),
+                                cp->nslots - has_consts, cp->ds, cp->qs,
+                                sigmas);
+    free(sigmas);
+    return input_syms;
+}
+
+/* Evaluates with the schedule built when the obfuscation was loaded */
+static long *
+_traverse(const obfuscation *obf, obf_args_t *args, size_t nthreads)
+{
+    if (obf->graph)
+        return (long *) sched_graph_traverse(obf->graph, input_f, const_f,
+                                             eval_f, output_f, free_f, args,
+                                             nthreads);
+    return (long *) sched_traverse(obf->op->cp.circ, NULL, input_f, const_f,
+                                   eval_f, output_f, free_f, args, nthreads);
 }
 
 static int
@@ -678,9 +1261,10 @@ _evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
 {
     const circ_params_t *cp = &obf->op->cp;
     acirc_t *circ = cp->circ;
-    const size_t has_consts = acirc_nconsts(circ) + acirc_nsecrets(circ) ? 1 : 0;
     size_t *kappas = NULL;
     size_t *input_syms;
+    selection sel;
+    bool scheduled;
     int ret = ERR;
 
     if (ninputs != acirc_ninputs(circ)) {
@@ -692,37 +1276,40 @@ _evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
         return ERR;
     }
 
-    g_max_npowers = 0;
-
     if (kappa)
         kappas = calloc(acirc_noutputs(circ), sizeof kappas[0]);
+    if ((input_syms = _input_syms(obf, inputs)) == NULL)
+        goto finish;
+    if (_select(obf, &sel, input_syms, inputs, nthreads) == ERR)
+        goto finish;
+
+    obf_args_t args = {
+        .obf = obf,
+        .sel = &sel,
+        .input_syms = input_syms,
+        .inputs = inputs,
+        .kappas = kappas,
+        .max_npowers = 0,
+        .pool = encoding_pool_new(obf->enc_vt, obf->pp_vt, obf->pp),
+    };
     {
-        bool *sigmas;
-        sigmas = my_calloc(cp->nslots - has_consts, sizeof sigmas[0]);
-        for (size_t i = 0; i < cp->nslots - has_consts; ++i)
-            sigmas[i] = acirc_is_sigma(circ, i);
-        input_syms = get_input_syms(inputs, acirc_ninputs(circ),
-                                    cp->nslots - has_consts, cp->ds, cp->qs,
-                                    sigmas);
-        free(sigmas);
-        if (input_syms == NULL)
-            goto finish;
-    }
-
-    {
-        long *tmp;
-        obf_args_t args = {
-            .obf = obf,
-            .input_syms = input_syms,
-            .inputs = inputs,
-            .kappas = kappas,
-        };
-        tmp = (long *) acirc_traverse(circ, input_f, const_f, eval_f, output_f, free_f, &args, nthreads);
-        if (outputs)
+        long *tmp = _traverse(obf, &args, nthreads);
+        scheduled = tmp != NULL;
+        if (tmp && outputs)
             for (size_t i = 0; i < acirc_noutputs(circ); ++i)
                 outputs[i] = tmp[i];
         free(tmp);
     }
+    if (g_verbose)
+        encoding_pool_print(args.pool);
+    encoding_pool_free(args.pool);
+    _select_free(obf, &sel);
+    if (!scheduled)
+        goto finish;
+    if (args.failed) {
+        fprintf(stderr, "%s: unable to read obfuscation\n", errorstr);
+        goto finish;
+    }
     ret = OK;
 
     if (kappas) {
@@ -734,7 +1321,7 @@ _evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
         *kappa = maxkappa;
     }
     if (npowers)
-        *npowers = g_max_npowers;
+        *npowers = obf->plan ? obf->plan->npowers : args.max_npowers;
 finish:
     if (kappas)
         free(kappas);
@@ -744,10 +1331,181 @@ finish:
     return ret;
 }
 
+static int
+_evaluate_batch(const obfuscation *obf, long **outputs, size_t noutputs,
+                long **inputs, size_t ninputs, size_t n, size_t nthreads,
+                size_t budget)
+{
+    const circ_params_t *cp = &obf->op->cp;
+    acirc_t *circ = cp->circ;
+    eval_cache *cache;
+    encoding_pool *pool;
+    encoding **hits;
+    bool *needed;
+    int ret = ERR;
+
+    if (ninputs != acirc_ninputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
+        return ERR;
+    }
+    if (noutputs != acirc_noutputs(circ)) {
+        fprintf(stderr, "error: obf evaluate: invalid number of outputs\n");
+        return ERR;
+    }
+
+    cache = eval_cache_new(cp, obf->enc_vt, budget);
+    pool = encoding_pool_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    hits = my_calloc(acirc_nrefs(circ), sizeof hits[0]);
+    needed = my_calloc(acirc_nrefs(circ), sizeof needed[0]);
+    for (size_t b = 0; b < n; ++b) {
+        size_t *input_syms;
+        selection sel;
+        bool scheduled;
+        long *tmp;
+
+        if ((input_syms = _input_syms(obf, inputs[b])) == NULL)
+            goto cleanup;
+        if (_select(obf, &sel, input_syms, inputs[b], nthreads) == ERR) {
+            free(input_syms);
+            goto cleanup;
+        }
+        eval_cache_plan(cache, input_syms, hits, needed);
+        obf_args_t args = {
+            .obf = obf,
+            .sel = &sel,
+            .input_syms = input_syms,
+            .inputs = inputs[b],
+            .pool = pool,
+            .cache = cache,
+            .hits = hits,
+            .needed = needed,
+        };
+        tmp = _traverse(obf, &args, nthreads);
+        scheduled = tmp != NULL;
+        if (tmp)
+            for (size_t o = 0; o < noutputs; ++o)
+                outputs[b][o] = tmp[o];
+        free(tmp);
+        _select_free(obf, &sel);
+        free(input_syms);
+        if (!scheduled)
+            goto cleanup;
+        if (args.failed) {
+            fprintf(stderr, "%s: unable to read obfuscation\n", errorstr);
+            goto cleanup;
+        }
+    }
+    if (g_verbose) {
+        eval_cache_print(cache);
+        encoding_pool_print(pool);
+    }
+    ret = OK;
+cleanup:
+    free(hits);
+    free(needed);
+    eval_cache_free(cache);
+    encoding_pool_free(pool);
+    return ret;
+}
+
+/* Numbers the constant gates that an input-dependent gate or an output reads;
+ * these are precomputed, and the constant gates below them skipped */
+static size_t *
+_seeds(const obf_params_t *op, size_t *nseeds)
+{
+    const size_t nrefs = acirc_nrefs(op->cp.circ);
+    bool *constant, *needed;
+    size_t *seeds;
+
+    constant = my_calloc(nrefs, sizeof constant[0]);
+    needed = my_calloc(nrefs, sizeof needed[0]);
+    seeds = my_calloc(nrefs, sizeof seeds[0]);
+    circ_params_constants(&op->cp, constant, needed);
+    *nseeds = 0;
+    for (size_t ref = 0; ref < nrefs; ++ref) {
+        if (!constant[ref])
+            seeds[ref] = SEED_NONE;
+        else if (needed[ref])
+            seeds[ref] = (*nseeds)++;
+        else
+            seeds[ref] = SEED_SKIP;
+    }
+    free(constant);
+    free(needed);
+    return seeds;
+}
+
+static int
+_consts_fwrite(const obfuscation *obf, FILE *fp, size_t nthreads)
+{
+    container_writer *w;
+    long *results;
+    size_t nseeds;
+    int ret = ERR;
+
+    obf_args_t args = {
+        .obf = obf,
+        .pool = encoding_pool_new(obf->enc_vt, obf->pp_vt, obf->pp),
+    };
+    args.seeds = _seeds(obf->op, &nseeds);
+    args.consts = my_calloc(nseeds, sizeof args.consts[0]);
+    if ((results = _traverse(obf, &args, nthreads)) == NULL)
+        goto cleanup;
+    free(results);
+    if (args.failed) {
+        fprintf(stderr, "%s: unable to read obfuscation\n", errorstr);
+        goto cleanup;
+    }
+    if (g_verbose)
+        fprintf(stderr, "  Constant gates kept: %lu\n", nseeds);
+    if ((w = container_writer_new(fp, nseeds)) == NULL)
+        goto cleanup;
+    for (size_t i = 0; i < nseeds; ++i) {
+        if (container_writer_add_encoding(w, i, obf->enc_vt, args.consts[i]) == ERR) {
+            container_writer_free(w);
+            goto cleanup;
+        }
+    }
+    ret = container_writer_finish(w);
+cleanup:
+    for (size_t i = 0; i < nseeds; ++i)
+        encoding_pool_put(args.pool, args.consts[i]);
+    free(args.consts);
+    free((size_t *) args.seeds);
+    encoding_pool_free(args.pool);
+    return ret;
+}
+
+static int
+_consts_fread(obfuscation *obf, FILE *fp)
+{
+    size_t nseeds;
+
+    if ((obf->consts = container_open(fp)) == NULL)
+        return ERR;
+    obf->seeds = _seeds(obf->op, &nseeds);
+    if (container_nentries(obf->consts) != nseeds) {
+        fprintf(stderr, "%s: constants do not match circuit\n", errorstr);
+        container_close(obf->consts);
+        obf->consts = NULL;
+        free(obf->seeds);
+        obf->seeds = NULL;
+        return ERR;
+    }
+    /* Seeded encodings are decoded as evaluation reaches them */
+    obf->seeded = my_calloc(nseeds, sizeof obf->seeded[0]);
+    return OK;
+}
+
 obfuscator_vtable lz_obfuscator_vtable = {
     .free = _free,
     .obfuscate = _obfuscate,
     .evaluate = _evaluate,
     .fwrite = _fwrite,
+    .obfuscate_fwrite = _obfuscate_fwrite,
     .fread = _fread,
+    .analyze = plan_analyze,
+    .consts_fwrite = _consts_fwrite,
+    .consts_fread = _consts_fread,
+    .evaluate_batch = _evaluate_batch,
 };
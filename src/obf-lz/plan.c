@@ -0,0 +1,424 @@
+#include "plan.h"
+#include "../sym.h"
+#include "../util.h"
+
+#include <string.h>
+
+/* Symbolic evaluation following the evaluator's raise logic, used both to
+ * choose κ and to record the raises of a plan */
+
+typedef struct {
+    const obf_params_t *op;
+    const size_t *input_syms;
+    const long *inputs;
+    const index_set *toplevel;
+    const long *const_deg;
+    long const_deg_max;
+    long *const *var_deg;
+    const long *var_deg_max;
+    raise_plan *plan;
+    size_t **hist;              // [c+1][hist_len] count of each raise difference
+    const size_t *hist_len;
+    size_t max_npowers;
+    bool failed;
+} sym_args_t;
+
+static int
+raise_list_add(raise_list *list, size_t k, size_t p)
+{
+    /* grow by doubling */
+    if ((list->nsteps & (list->nsteps - 1)) == 0) {
+        raise_step *steps;
+        steps = my_realloc(list->steps, (list->nsteps ? 2 * list->nsteps : 1)
+                           * sizeof list->steps[0]);
+        if (steps == NULL)
+            return ERR;
+        list->steps = steps;
+    }
+    list->steps[list->nsteps].k = k;
+    list->steps[list->nsteps].p = p;
+    list->nsteps++;
+    return OK;
+}
+
+static void
+sym_raise_by(sym_args_t *args, sym_t *x, index_set *up, raise_list *rec,
+             size_t k, size_t s, size_t diff)
+{
+    const circ_params_t *cp = &args->op->cp;
+    const size_t nsymbols = acirc_nsymbols(cp->circ);
+
+    /* A plan only records raises by the selected symbol's powers */
+    if (rec && diff > 0 && k < nsymbols && s != args->input_syms[k])
+        args->failed = true;
+    if (args->hist && diff > 0 && diff < args->hist_len[k])
+        args->hist[k][diff]++;
+    while (diff > 0) {
+        const size_t p = raise_power(args->op, k, diff);
+        const size_t level = op_level(args->op, k, p);
+        if (p + 1 > args->max_npowers)
+            args->max_npowers = p + 1;
+        if (k == nsymbols)
+            ix_y_set(up, cp, ix_y_get(up, cp) + level);
+        else
+            ix_s_set(up, cp, k, s, ix_s_get(up, cp, k, s) + level);
+        if (rec && raise_list_add(rec, k, p) == ERR)
+            args->failed = true;
+        x->degree++;
+        diff -= level;
+    }
+}
+
+static int
+sym_raise(sym_args_t *args, sym_t *x, const index_set *target, raise_list *rec)
+{
+    const circ_params_t *cp = &args->op->cp;
+    index_set *ix, *up;
+    int ret;
+
+    if ((ix = index_set_difference(target, x->ix)) == NULL)
+        return ERR;
+    up = index_set_new(ix->nzs);
+    for (size_t k = 0; k < acirc_nsymbols(cp->circ); k++)
+        for (size_t s = 0; s < cp->qs[k]; s++)
+            sym_raise_by(args, x, up, rec, k, s, ix_s_get(ix, cp, k, s));
+    sym_raise_by(args, x, up, rec, acirc_nsymbols(cp->circ), 0, ix_y_get(ix, cp));
+    ret = index_set_add(x->ix, x->ix, up);
+    index_set_free(up);
+    index_set_free(ix);
+    return ret;
+}
+
+static void *
+sym_input_f(size_t ref, size_t i, void *args_)
+{
+    (void) ref;
+    sym_args_t *args = args_;
+    const circ_params_t *cp = &args->op->cp;
+    const size_t slot = circ_params_slot(cp, i);
+    sym_t *x = sym_new(obf_params_nzs(cp), 1);
+    ix_s_set(x->ix, cp, slot, args->input_syms[slot], 1);
+    return x;
+}
+
+static void *
+sym_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    (void) ref; (void) i; (void) val;
+    sym_args_t *args = args_;
+    sym_t *x = sym_new(obf_params_nzs(&args->op->cp), 1);
+    ix_y_set(x->ix, &args->op->cp, 1);
+    return x;
+}
+
+/* Raises an operand of gate |ref|, recording the raise in the plan if any */
+static int
+sym_raise_operand(sym_t *x, const index_set *target, size_t ref, bool y,
+                  void *args_)
+{
+    sym_args_t *args = args_;
+    raise_list *rec = NULL;
+
+    if (args->plan && ref < args->plan->nrefs)
+        rec = y ? &args->plan->y[ref] : &args->plan->x[ref];
+    return sym_raise(args, x, target, rec);
+}
+
+static void *
+sym_eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref,
+           const void *y_, void *args_)
+{
+    (void) xref; (void) yref;
+    sym_args_t *args = args_;
+
+    if (args->plan && ref >= args->plan->nrefs)
+        args->failed = true;
+    return sym_eval(obf_params_nzs(&args->op->cp), ref, op, x_, y_,
+                    sym_raise_operand, args, &args->failed);
+}
+
+static void *
+sym_output_f(size_t ref, size_t o, void *x_, void *args_)
+{
+    (void) ref;
+    sym_args_t *args = args_;
+    const circ_params_t *cp = &args->op->cp;
+    const sym_t *x = x_;
+    sym_t lhs = { index_set_copy(x->ix), x->degree };
+    index_set *zhat = index_set_new(obf_params_nzs(cp));
+    size_t degree = 0;
+
+    for (size_t k = 0; k < acirc_ninputs(cp->circ); k++) {
+        index_set_clear(zhat);
+        ix_zhat_set(zhat, cp, args->const_deg, args->const_deg_max, args->var_deg,
+                    args->var_deg_max, k, args->inputs[k], o);
+        if (index_set_add(lhs.ix, lhs.ix, zhat) == ERR) {
+            args->failed = true;
+            goto cleanup;
+        }
+        lhs.degree++;
+    }
+    if (sym_raise(args, &lhs, args->toplevel,
+                  args->plan ? &args->plan->out[o] : NULL) == ERR
+        || !index_set_eq(lhs.ix, args->toplevel)) {
+        fprintf(stderr, "%s: output %lu does not reach the top level\n",
+                errorstr, o);
+        args->failed = true;
+        goto cleanup;
+    }
+    /* Chatstar times one what per input */
+    degree = max(lhs.degree, 1 + acirc_ninputs(cp->circ));
+cleanup:
+    index_set_free(zhat);
+    index_set_free(lhs.ix);
+    return (void *) degree;
+}
+
+static int
+_symbolic(const obf_params_t *op, raise_plan *plan, size_t **hist,
+          const size_t *hist_len, size_t *kappa, size_t *npowers,
+          size_t *degrees)
+{
+    const circ_params_t *cp = &op->cp;
+    acirc_t *circ = cp->circ;
+    const size_t nsymbols = acirc_nsymbols(circ);
+    const size_t noutputs = acirc_noutputs(circ);
+    long *var_deg[nsymbols];
+    long var_deg_max[nsymbols];
+    long *const_deg, const_deg_max = 0;
+    size_t *input_syms;
+    long *inputs, *tmp;
+    index_set *toplevel;
+    int ret = ERR;
+
+    memset(var_deg_max, '\0', sizeof var_deg_max);
+    const_deg = acirc_const_degrees(circ);
+    for (size_t o = 0; o < noutputs; o++)
+        if (const_deg[o] > const_deg_max)
+            const_deg_max = const_deg[o];
+    for (size_t k = 0; k < nsymbols; ++k) {
+        var_deg[k] = acirc_var_degrees(circ, k);
+        for (size_t o = 0; o < noutputs; o++)
+            if (var_deg[k][o] > var_deg_max[k])
+                var_deg_max[k] = var_deg[k][o];
+    }
+    /* The all-zeros input selects symbol zero of every slot; neither the
+     * degrees nor the raises depend on the symbol */
+    input_syms = my_calloc(nsymbols, sizeof input_syms[0]);
+    inputs = my_calloc(acirc_ninputs(circ), sizeof inputs[0]);
+    toplevel = obf_params_new_toplevel(cp, obf_params_nzs(cp));
+
+    sym_args_t args = {
+        .op = op,
+        .input_syms = input_syms,
+        .inputs = inputs,
+        .toplevel = toplevel,
+        .const_deg = const_deg,
+        .const_deg_max = const_deg_max,
+        .var_deg = var_deg,
+        .var_deg_max = var_deg_max,
+        .plan = plan,
+        .hist = hist,
+        .hist_len = hist_len,
+        .max_npowers = 0,
+        .failed = false,
+    };
+    tmp = (long *) acirc_traverse(circ, sym_input_f, sym_const_f, sym_eval_f,
+                                  sym_output_f, sym_free_f, &args, 1);
+    if (tmp == NULL || args.failed)
+        goto cleanup;
+    if (kappa) {
+        *kappa = 0;
+        for (size_t o = 0; o < noutputs; o++)
+            if ((size_t) tmp[o] > *kappa)
+                *kappa = tmp[o];
+    }
+    if (degrees)
+        for (size_t o = 0; o < noutputs; o++)
+            degrees[o] = tmp[o];
+    if (npowers)
+        *npowers = args.max_npowers;
+    ret = OK;
+cleanup:
+    free(tmp);
+    index_set_free(toplevel);
+    free(inputs);
+    free(input_syms);
+    free(const_deg);
+    for (size_t k = 0; k < nsymbols; ++k)
+        free(var_deg[k]);
+    return ret;
+}
+
+/* Multiplications needed to make each difference counts[i] times, given that
+ * raises take the largest level that fits (see raise_power) */
+static size_t
+_cost(const size_t *diffs, const size_t *counts, size_t ndiffs,
+      const size_t *levels, size_t nlevels)
+{
+    size_t cost = 0;
+    for (size_t i = 0; i < ndiffs; ++i) {
+        size_t diff = diffs[i], p = nlevels - 1, steps = 0;
+        while (diff > 0) {
+            while (levels[p] > diff)
+                p--;
+            diff -= levels[p];
+            steps++;
+        }
+        cost += counts[i] * steps;
+    }
+    return cost;
+}
+
+/* Copies the n ascending levels of src into dst with v inserted in order;
+ * false if v is already a level */
+static bool
+_insert(size_t *dst, const size_t *src, size_t n, size_t v)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (src[i] == v)
+            return false;
+        if (j == i && src[i] > v)
+            dst[j++] = v;
+        dst[j++] = src[i];
+    }
+    if (j == n)
+        dst[j] = v;
+    return true;
+}
+
+/* Chooses the levels of one slot: starting from {1}, repeatedly adds the
+ * level that saves the most multiplications over the given differences,
+ * until nothing saves any or npowers levels are in use.  Candidates are the
+ * differences themselves and the powers of two. */
+static size_t *
+_choose_levels(const size_t *hist, size_t len, size_t npowers, size_t *nlevels)
+{
+    size_t *diffs, *counts, *levels, *tmp;
+    size_t ndiffs = 0, n = 1, cost;
+
+    diffs = my_calloc(len, sizeof diffs[0]);
+    counts = my_calloc(len, sizeof counts[0]);
+    for (size_t d = 1; d < len; ++d) {
+        if (hist[d]) {
+            diffs[ndiffs] = d;
+            counts[ndiffs] = hist[d];
+            ndiffs++;
+        }
+    }
+    levels = my_calloc(npowers, sizeof levels[0]);
+    tmp = my_calloc(npowers, sizeof tmp[0]);
+    levels[0] = 1;
+    cost = _cost(diffs, counts, ndiffs, levels, n);
+    while (n < npowers && cost > 0) {
+        size_t best = 0, best_cost = cost;
+        for (size_t v = 2; v < len; ++v) {
+            size_t c;
+            if (hist[v] == 0 && (v & (v - 1)))
+                continue;
+            if (!_insert(tmp, levels, n, v))
+                continue;
+            if ((c = _cost(diffs, counts, ndiffs, tmp, n + 1)) < best_cost) {
+                best = v;
+                best_cost = c;
+            }
+        }
+        if (best == 0)
+            break;
+        _insert(tmp, levels, n, best);
+        memcpy(levels, tmp, (n + 1) * sizeof levels[0]);
+        n++;
+        cost = best_cost;
+    }
+    free(tmp);
+    free(counts);
+    free(diffs);
+    *nlevels = n;
+    return levels;
+}
+
+/* Tailors the raise levels of every slot to the differences evaluating the
+ * circuit needs, rather than the first npowers powers of two.  Leaves the
+ * powers of two in place if the circuit cannot be analyzed. */
+PRIVATE int
+plan_levels(obf_params_t *op)
+{
+    const acirc_t *circ = op->cp.circ;
+    const size_t nsymbols = acirc_nsymbols(circ);
+    size_t *hist[nsymbols + 1];
+    size_t len[nsymbols + 1];
+    size_t before = 0, after = 0;
+
+    for (size_t k = 0; k <= nsymbols; ++k) {
+        len[k] = 1 + (k < nsymbols ? acirc_max_var_degree(circ, k)
+                                   : acirc_max_const_degree(circ));
+        hist[k] = my_calloc(len[k], sizeof hist[k][0]);
+    }
+    if (_symbolic(op, NULL, hist, len, NULL, NULL, NULL) == ERR) {
+        if (g_verbose)
+            fprintf(stderr, "warning: unable to tailor raise levels, using powers of two\n");
+        goto cleanup;
+    }
+    for (size_t k = 0; k <= nsymbols; ++k) {
+        size_t nlevels, *levels;
+        levels = _choose_levels(hist[k], len[k], op->npowers, &nlevels);
+        before += op->nlevels[k];
+        after += nlevels;
+        free(op->levels[k]);
+        op->levels[k] = levels;
+        op->nlevels[k] = nlevels;
+    }
+    if (g_verbose)
+        fprintf(stderr, "Raise levels: %lu in place of %lu powers of two\n",
+                after, before);
+cleanup:
+    for (size_t k = 0; k <= nsymbols; ++k)
+        free(hist[k]);
+    return OK;
+}
+
+/* Computes κ, the number of powers evaluation uses and the degree of each
+ * output, without any encodings */
+PRIVATE int
+plan_analyze(const obf_params_t *op, size_t *kappa, size_t *npowers,
+             size_t *degrees)
+{
+    return _symbolic(op, NULL, NULL, NULL, kappa, npowers, degrees);
+}
+
+PRIVATE raise_plan *
+raise_plan_new(const obf_params_t *op)
+{
+    const acirc_t *circ = op->cp.circ;
+    raise_plan *plan;
+
+    plan = my_calloc(1, sizeof plan[0]);
+    plan->nrefs = acirc_nrefs(circ);
+    plan->noutputs = acirc_noutputs(circ);
+    plan->x = my_calloc(plan->nrefs, sizeof plan->x[0]);
+    plan->y = my_calloc(plan->nrefs, sizeof plan->y[0]);
+    plan->out = my_calloc(plan->noutputs, sizeof plan->out[0]);
+    if (_symbolic(op, plan, NULL, NULL, NULL, &plan->npowers, NULL) == ERR) {
+        raise_plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+PRIVATE void
+raise_plan_free(raise_plan *plan)
+{
+    if (plan == NULL)
+        return;
+    for (size_t i = 0; i < plan->nrefs; ++i) {
+        free(plan->x[i].steps);
+        free(plan->y[i].steps);
+    }
+    for (size_t o = 0; o < plan->noutputs; ++o)
+        free(plan->out[o].steps);
+    free(plan->x);
+    free(plan->y);
+    free(plan->out);
+    free(plan);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "obf_params.h"
+
+/* One multiplication of a raise: by uhat[k][s][p], where s is the symbol the
+ * input selects for slot k, or by vhat[p] when k is the number of symbols */
+typedef struct {
+    size_t k;
+    size_t p;
+} raise_step;
+
+typedef struct {
+    raise_step *steps;
+    size_t nsteps;
+} raise_list;
+
+/* Every raise an evaluation performs.  Wire index sets depend only on the
+ * circuit, so these are computed once per obfuscation. */
+typedef struct {
+    size_t nrefs;
+    size_t noutputs;
+    raise_list *x;              // [nrefs] first operand of each add/sub
+    raise_list *y;              // [nrefs] second operand of each add/sub
+    raise_list *out;            // [γ] each output up to the top level
+    size_t npowers;             // powers used by the largest raise
+} raise_plan;
+
+/* The largest level of slot k that fits within diff */
+static inline size_t
+raise_power(const obf_params_t *op, size_t k, size_t diff)
+{
+    size_t p = 0;
+    while (p + 1 < op_nlevels(op, k) && op_level(op, k, p + 1) <= diff)
+        p++;
+    return p;
+}
+
+int
+plan_levels(obf_params_t *op);
+int
+plan_analyze(const obf_params_t *op, size_t *kappa, size_t *npowers,
+             size_t *degrees);
+raise_plan *
+raise_plan_new(const obf_params_t *op);
+void
+raise_plan_free(raise_plan *plan);
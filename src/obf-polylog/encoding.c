@@ -6,18 +6,26 @@
 #include <string.h>
 
 struct encoding_info {
-    index_set *ix;
+    const index_set *ix;      // interned
     bool polylog;
 };
 #define my(x) x->info
 
+/* Replaces rop's index set by |ix|, taking over the reference to it */
+static void
+_set_index(encoding *rop, const index_set *ix)
+{
+    index_set_release(my(rop)->ix);
+    my(rop)->ix = ix;
+}
+
 static int
 _encoding_new(const pp_vtable *vt, encoding *enc, const public_params *pp)
 {
     const obf_params_t *const mp = vt->params(pp);
     if ((my(enc) = calloc(1, sizeof my(enc)[0])) == NULL)
         return ERR;
-    my(enc)->ix = index_set_new(obf_params_nzs(&mp->cp));
+    my(enc)->ix = index_set_intern_zero(obf_params_nzs(&mp->cp));
     if (vt->mmap == &clt_pl_vtable)
         my(enc)->polylog = true;
     return OK;
@@ -27,8 +35,7 @@ static void
 _encoding_free(encoding *enc)
 {
     if (my(enc)) {
-        if (my(enc)->ix)
-            index_set_free(my(enc)->ix);
+        index_set_release(my(enc)->ix);
         free(my(enc));
     }
 }
@@ -45,7 +52,7 @@ _encode(encoding *rop, const void *ix_)
 {
     int *pows;
     const index_set *const ix = ix_;
-    index_set_set(my(rop)->ix, ix);
+    _set_index(rop, index_set_intern(ix));
     if ((pows = calloc(ix->nzs, sizeof pows[0])) == NULL)
         return NULL;
     memcpy(pows, ix->pows, ix->nzs * sizeof pows[0]);
@@ -55,7 +62,7 @@ _encode(encoding *rop, const void *ix_)
 static int
 _encoding_set(encoding *rop, const encoding *x)
 {
-    index_set_set(my(rop)->ix, my(x)->ix);
+    _set_index(rop, index_set_acquire(my(x)->ix));
     return OK;
 }
 
@@ -64,7 +71,10 @@ _encoding_mul(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp;
-    index_set_add(my(rop)->ix, my(x)->ix, my(y)->ix);
+    const index_set *ix;
+    if ((ix = index_set_intern_add(my(x)->ix, my(y)->ix)) == NULL)
+        return ERR;
+    _set_index(rop, ix);
     return OK;
 }
 
@@ -73,7 +83,7 @@ _encoding_add(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->ix, my(x)->ix);
+    _set_index(rop, index_set_acquire(my(x)->ix));
     return OK;
 }
 
@@ -82,7 +92,7 @@ _encoding_sub(const pp_vtable *vt, encoding *rop, const encoding *x,
               const encoding *y, const public_params *pp)
 {
     (void) vt; (void) pp; (void) y;
-    index_set_set(my(rop)->ix, my(x)->ix);
+    _set_index(rop, index_set_acquire(my(x)->ix));
     return OK;
 }
 
@@ -102,9 +112,13 @@ _encoding_is_zero(const pp_vtable *vt, const encoding *x, const public_params *p
 static int
 _encoding_fread(encoding *x, FILE *fp)
 {
+    index_set *ix;
+
     my(x) = calloc(1, sizeof x->info[0]);
-    if ((my(x)->ix = index_set_fread(fp)) == NULL)
+    if ((ix = index_set_fread(fp)) == NULL)
         goto error;
+    my(x)->ix = index_set_intern(ix);
+    index_set_free(ix);
     return OK;
 error:
     free(my(x));
@@ -1,7 +1,12 @@
 #include "obfuscator.h"
 #include "obf_params.h"
 #include "wire.h"
+#include "../container.h"
+#include "../encode_batch.h"
+#include "../eval_lanes.h"
 #include "../index_set.h"
+#include "../rand_streams.h"
+#include "../sched.h"
 #include "../vtables.h"
 #include "../util.h"
 
@@ -25,8 +30,105 @@ struct obfuscation {
     wire_t **yhat;              /* [c] */
     encoding ****what;          /* [n][2][m] */
     long *deg_max;              /* [n] */
+    container *container;       /* backing file, if read from disk */
+    sched_graph *graph;         /* evaluation schedule, recorded once */
 };
 
+/* Container layout: Chatstar, zhat, xhat, yhat, then what */
+
+static size_t
+_entry_Chatstar(const circ_params_t *cp, size_t o)
+{
+    (void) cp;
+    return o;
+}
+
+static size_t
+_entry_zhat(const circ_params_t *cp, size_t o)
+{
+    return acirc_noutputs(cp->circ) + o;
+}
+
+static size_t
+_entry_xhat(const circ_params_t *cp, size_t i, size_t b)
+{
+    return 2 * acirc_noutputs(cp->circ) + 2 * i + b;
+}
+
+static size_t
+_entry_yhat(const circ_params_t *cp, size_t i)
+{
+    return _entry_xhat(cp, acirc_ninputs(cp->circ), 0) + i;
+}
+
+static size_t
+_entry_what(const circ_params_t *cp, size_t i, size_t b, size_t o)
+{
+    const size_t noutputs = acirc_noutputs(cp->circ);
+    return _entry_yhat(cp, acirc_nconsts(cp->circ)) + (2 * i + b) * noutputs + o;
+}
+
+static size_t
+_nentries(const circ_params_t *cp)
+{
+    return _entry_what(cp, acirc_ninputs(cp->circ), 0, 0);
+}
+
+static void *
+_wire_read(FILE *fp, void *vt)
+{
+    return wire_fread(vt, fp);
+}
+
+static int
+_wire_write(const void *w, FILE *fp, void *vt)
+{
+    return wire_fwrite(vt, w, fp);
+}
+
+static void
+_wire_free(void *w, void *vt)
+{
+    wire_free(vt, w);
+}
+
+static wire_t *
+_xhat(const obfuscation *obf, size_t i, size_t b)
+{
+    return container_get(obf->container, _entry_xhat(&obf->op->cp, i, b),
+                         (void **) &obf->xhat[i][b], _wire_read, _wire_free,
+                         (void *) obf->enc_vt);
+}
+
+static wire_t *
+_yhat(const obfuscation *obf, size_t i)
+{
+    return container_get(obf->container, _entry_yhat(&obf->op->cp, i),
+                         (void **) &obf->yhat[i], _wire_read, _wire_free,
+                         (void *) obf->enc_vt);
+}
+
+static encoding *
+_zhat(const obfuscation *obf, size_t o)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->zhat[o],
+                                  _entry_zhat(&obf->op->cp, o));
+}
+
+static encoding *
+_Chatstar(const obfuscation *obf, size_t o)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->Chatstar[o],
+                                  _entry_Chatstar(&obf->op->cp, o));
+}
+
+static encoding *
+_what(const obfuscation *obf, size_t i, size_t b, size_t o)
+{
+    return container_get_encoding(obf->container, obf->enc_vt, &obf->what[i][b][o],
+                                  _entry_what(&obf->op->cp, i, b, o));
+}
+
 /* static long * */
 /* populate_circ_degrees(const circ_params_t *cp) */
 /* { */
@@ -65,55 +167,87 @@ populate_circ_inputs(const circ_params_t *cp, ssize_t slot, mpz_t **inputs,
     return OK;
 }
 
-typedef struct {
-    const encoding_vtable *vt;
-    encoding *enc;
-    size_t level;
-    mpz_t *slots;
-    size_t nslots;
-    index_set *ix;
-    const secret_params *sp;
-    pthread_mutex_t *lock;
-    size_t *count;
-    size_t total;
-} obf_args_t;
-
-static void
-encode_worker(void *wargs)
+/* The residual circuit of C† for each input i, where only input i is free,
+ * in [ninputs + 1] with C*'s lane left NULL.  Each is derived on |pool|
+ * from |base|, the circuit with every input set to 1 */
+static residual **
+_residuals(const circ_params_t *cp, residual **base, threadpool *pool)
 {
-    obf_args_t *const args = wargs;
-
-    encode(args->vt, args->enc, args->slots, args->nslots, args->ix, args->sp, args->level);
-    if (g_verbose) {
-        pthread_mutex_lock(args->lock);
-        print_progress(++*args->count, args->total);
-        pthread_mutex_unlock(args->lock);
+    const size_t ninputs = acirc_ninputs(cp->circ);
+    const size_t nconsts = acirc_nconsts(cp->circ);
+    mpz_srcptr *inputs, *consts;
+    residual **residuals;
+    mpz_t one, *cs;
+    size_t ngates = 0;
+
+    mpz_init_set_ui(one, 1);
+    cs = mpz_vect_new(nconsts);
+    inputs = my_calloc(ninputs, sizeof inputs[0]);
+    consts = my_calloc(nconsts, sizeof consts[0]);
+    for (size_t i = 0; i < ninputs; ++i)
+        inputs[i] = one;
+    for (size_t i = 0; i < nconsts; ++i) {
+        mpz_set_ui(cs[i], acirc_const(cp->circ, i));
+        consts[i] = cs[i];
     }
-    mpz_vect_free(args->slots, args->nslots);
-    index_set_free(args->ix);
-    free(args);
+    *base = residual_new(cp->circ, inputs, consts);
+    residuals = my_calloc(ninputs + 1, sizeof residuals[0]);
+    residual_derive(cp->circ, *base, residuals, ninputs, pool);
+    for (size_t i = 0; i < ninputs; ++i)
+        ngates += residual_ngates(residuals[i]);
+    if (g_verbose)
+        fprintf(stderr, "  C†: %lu gates to evaluate, rather than %lu\n",
+                ngates, ninputs * acirc_ngates(cp->circ));
+    free(inputs);
+    free(consts);
+    mpz_vect_free(cs, nconsts);
+    mpz_clear(one);
+    return residuals;
 }
 
-static void
-__encode(threadpool *pool, const encoding_vtable *vt, encoding *enc, size_t nslots,
-         mpz_t slots[nslots], index_set *ix, const secret_params *sp, size_t level,
-         pthread_mutex_t *lock, size_t *count, size_t total)
+/* Evaluates the circuit in one traversal for C† of each input i, in lane i
+ * modulo field 1 + i, and for C*, in lane ninputs modulo field 1 + ninputs.
+ * Lane i only depends on input i, with the other inputs and the constants
+ * known, so it evaluates |residuals|[i].  Returns [noutputs][ninputs + 1] */
+static mpz_t **
+_eval_lanes(const circ_params_t *cp, const mpz_t *moduli, const mpz_t *alphas,
+            const mpz_t *betas, residual **residuals, size_t nthreads)
 {
-    obf_args_t *args;
-    args = my_calloc(1, sizeof args[0]);
-    args->vt = vt;
-    args->enc = enc;
-    args->level = level;
-    args->slots = my_calloc(nslots, sizeof args->slots[0]);
-    for (size_t i = 0; i < nslots; ++i)
-        mpz_init_set(args->slots[i], slots[i]);
-    args->nslots = nslots;
-    args->ix = ix;
-    args->sp = sp;
-    args->lock = lock;
-    args->count = count;
-    args->total = total;
-    threadpool_add_job(pool, encode_worker, args);
+    const size_t ninputs = acirc_ninputs(cp->circ);
+    const size_t nconsts = acirc_nconsts(cp->circ);
+    const size_t nlanes = ninputs + 1;
+    mpz_t ***inputs, ***consts, **outputs;
+    mpz_srcptr *ms;
+
+    inputs = my_calloc(nlanes, sizeof inputs[0]);
+    consts = my_calloc(nlanes, sizeof consts[0]);
+    ms = my_calloc(nlanes, sizeof ms[0]);
+    for (size_t l = 0; l < nlanes; ++l) {
+        inputs[l] = my_calloc(ninputs, sizeof inputs[l][0]);
+        for (size_t i = 0; i < ninputs; ++i)
+            inputs[l][i] = mpz_vect_new(1);
+        consts[l] = my_calloc(nconsts, sizeof consts[l][0]);
+        for (size_t i = 0; i < nconsts; ++i)
+            consts[l][i] = mpz_vect_new(1);
+        if (l < ninputs)
+            populate_circ_inputs(cp, l, inputs[l], consts[l], alphas);
+        else
+            populate_circ_inputs(cp, -1, inputs[l], consts[l], betas);
+        ms[l] = moduli[1 + l];
+    }
+    outputs = eval_lanes(cp->circ, inputs, consts, ms, residuals, nlanes, nthreads);
+    for (size_t l = 0; l < nlanes; ++l) {
+        for (size_t i = 0; i < ninputs; ++i)
+            mpz_vect_free(inputs[l][i], 1);
+        free(inputs[l]);
+        for (size_t i = 0; i < nconsts; ++i)
+            mpz_vect_free(consts[l][i], 1);
+        free(consts[l]);
+    }
+    free(inputs);
+    free(consts);
+    free(ms);
+    return outputs;
 }
 
 static void
@@ -165,6 +299,8 @@ _free(obfuscation *obf)
         public_params_free(obf->pp_vt, obf->pp);
     if (obf->sp)
         secret_params_free(obf->sp_vt, obf->sp);
+    container_close(obf->container);
+    sched_graph_free(obf->graph);
     free(obf);
 }
 
@@ -185,6 +321,7 @@ _alloc(const mmap_vtable *mmap, const obf_params_t *op)
     obf->enc_vt = get_encoding_vtable(mmap);
     obf->pp_vt = get_pp_vtable(mmap);
     obf->sp_vt = get_sp_vtable(mmap);
+    obf->graph = sched_graph_new(cp->circ, NULL);
     obf->xhat = my_calloc(ninputs, sizeof obf->xhat[0]);
     for (size_t i = 0; i < ninputs; ++i)
         obf->xhat[i] = my_calloc(2, sizeof obf->xhat[0]);
@@ -213,11 +350,14 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     const size_t total = obf_num_encodings(cp);
 
     obfuscation *obf;
-    mpz_t *moduli = NULL, *slots = NULL, *alphas = NULL, *betas = NULL;
+    mpz_t *moduli = NULL, *slots = NULL, *alphas = NULL, *betas = NULL, *deltas = NULL;
     threadpool *pool = NULL;
+    encode_batch *batch = NULL;
+    residual *base = NULL, **residuals = NULL;
     index_set *ix = NULL;
-    pthread_mutex_t lock;
-    size_t count = 0;
+    const mpz_t *ones;
+    mpz_srcptr bits[2];
+    progress *progress = NULL;
     int result = ERR;
 
     if ((obf = _alloc(mmap, op)) == NULL)
@@ -243,142 +383,160 @@ _obfuscate(const mmap_vtable *mmap, const obf_params_t *op, size_t secparam,
     moduli = mmap->sk->plaintext_fields(obf->sp->sk);
     slots = mpz_vect_new(nslots);
     alphas = mpz_vect_new(ninputs); /* XXX should be α_{i,b} */
-    for (size_t i = 0; i < ninputs; ++i)
-        mpz_randomm_inv(alphas[i], rng, moduli[1 + i]);
     betas = mpz_vect_new(ninputs + nconsts);
-    for (size_t i = 0; i < ninputs + nconsts; ++i)
-        mpz_randomm_inv(betas[i], rng, moduli[1 + ninputs]);
+    deltas = mpz_vect_new(noutputs);
     pool = threadpool_create(nthreads);
-    pthread_mutex_init(&lock, NULL);
+    /* Derived while the pool is still idle */
+    residuals = _residuals(cp, &base, pool);
+    {   /* Each value is drawn from its own substream, on the pool */
+        const size_t n = ninputs + ninputs + nconsts + noutputs;
+        mpz_ptr *xs = my_calloc(n, sizeof xs[0]);
+        mpz_srcptr *ms = my_calloc(n, sizeof ms[0]);
+        rand_streams rs;
 
-    if (g_verbose)
-        print_progress(count, total);
+        for (size_t i = 0; i < ninputs; ++i) {
+            xs[i] = alphas[i];
+            ms[i] = moduli[1 + i];
+        }
+        for (size_t i = 0; i < ninputs + nconsts; ++i) {
+            xs[ninputs + i] = betas[i];
+            ms[ninputs + i] = moduli[1 + ninputs];
+        }
+        for (size_t o = 0; o < noutputs; ++o) {
+            xs[ninputs + ninputs + nconsts + o] = deltas[o];
+            ms[ninputs + ninputs + nconsts + o] = moduli[0];
+        }
+        rand_streams_init(&rs, rng);
+        rand_streams_units(&rs, 0, xs, ms, n, pool, nthreads);
+        free(xs);
+        free(ms);
+    }
+    progress = progress_new("encode", 0, total);
+    batch = encode_batch_new(pool, obf->enc_vt, obf->sp, nslots, nthreads, progress);
+    /* Every encoding is [1, ..., 1] with a few slots replaced, so jobs share
+     * one vector of ones and refer to the values they replace */
+    for (size_t i = 0; i < nslots; ++i)
+        mpz_set_ui(slots[i], 1);
+    ones = encode_batch_slots(batch, slots);
+    mpz_set_ui(slots[0], 0);
+    bits[0] = encode_batch_value(batch, slots[0]);
+    bits[1] = ones[0];
+    ix = index_set_new(obf_params_nzs(cp));
 
     {   /* Encode \hat x_{i,b} = [ b, 1, ..., 1, α_{i,b}, 1, ..., 1, βᵢ ] */
         for (size_t i = 0; i < ninputs; ++i) {
-            for (size_t j = 0; j < ninputs; ++j)
-                mpz_set_ui(slots[1 + j], 1);
             for (size_t b = 0; b < 2; ++b) {
-                mpz_set_ui(slots[0], b);
-                mpz_set(slots[1 + i], alphas[i]);
-                mpz_set(slots[1 + ninputs], betas[i]);
-                ix = index_set_new(obf_params_nzs(cp));
-                __encode(pool, obf->enc_vt, wire_x(obf->xhat[i][b]), nslots, slots,
-                         ix, obf->sp, 0, &lock, &count, total);
-                mpz_set_ui(slots[0], 1);
-                mpz_set_ui(slots[1 + i], 1);
-                mpz_set_ui(slots[1 + ninputs], 1);
-                ix = index_set_new(obf_params_nzs(cp));
-                __encode(pool, obf->enc_vt, wire_u(obf->xhat[i][b]), nslots, slots,
-                         ix, obf->sp, 0, &lock, &count, total);
+                encode_batch_add(batch, &(encode_job) {
+                        .enc = wire_x(obf->xhat[i][b]),
+                        .slots = ones,
+                        .nover = 3,
+                        .over = { 0, 1 + i, 1 + ninputs },
+                        .value = { bits[b], alphas[i], betas[i] },
+                        .ix = ix,
+                    });
+                encode_batch_add(batch, &(encode_job) {
+                        .enc = wire_u(obf->xhat[i][b]),
+                        .slots = ones,
+                        .ix = ix,
+                    });
             }
         }
     }
 
     {   /* Encode \hat y_i = [ b, 1, ..., 1, βᵢ ] */
         for (size_t i = 0; i < nconsts; i++) {
-            for (size_t j = 0; j < ninputs; ++j)
-                mpz_set_ui(slots[1 + j], 1);
-            mpz_set_si(slots[0],           acirc_const(cp->circ, i));
-            mpz_set   (slots[1 + ninputs], betas[ninputs + i]);
-            ix = index_set_new(obf_params_nzs(cp));
-            __encode(pool, obf->enc_vt, wire_x(obf->yhat[i]), nslots, slots,
-                     ix, obf->sp, 0, &lock, &count, total);
-            mpz_set_ui(slots[0],           1);
-            mpz_set_ui(slots[1 + ninputs], 1);
-            ix = index_set_new(obf_params_nzs(cp));
-            __encode(pool, obf->enc_vt, wire_u(obf->yhat[i]), nslots, slots,
-                     ix, obf->sp, 0, &lock, &count, total);
-        }
-    }
-
-    {   /* Encode \hat w_{i,o} = [0, 1, ..., 1, C†, 1, ..., 1] */
-        mpz_t **inputs, **consts;
-        mpz_set_ui(slots[0], 0);
-        inputs = calloc(ninputs, sizeof inputs[0]);
-        for (size_t i = 0; i < ninputs; ++i)
-            inputs[i] = mpz_vect_new(1);
-        consts = calloc(nconsts, sizeof inputs[0]);
-        for (size_t i = 0; i < nconsts; ++i)
-            consts[i] = mpz_vect_new(1);
-        for (size_t i = 0; i < ninputs; ++i) {
-            mpz_t **outputs;
-            for (size_t j = 0; j < ninputs + 1; ++j)
-                mpz_set_ui(slots[1 + j], 1);
-            populate_circ_inputs(cp, i, inputs, consts, alphas);
-            outputs = acirc_eval_mpz(cp->circ, inputs, consts, moduli[1 + i]);
-            for (size_t b = 0; b < 2; ++b) {
-                for (size_t o = 0; o < noutputs; ++o) {
-                    mpz_set(slots[1 + i], *outputs[o]);
-                    ix = index_set_new(obf_params_nzs(cp));
-                    __encode(pool, obf->enc_vt, obf->what[i][b][o], nslots, slots,
-                             ix, obf->sp, i /* XXX */, &lock, &count, total);
-                }
-            }
-            for (size_t o = 0; o < noutputs; ++o)
-                mpz_vect_free(outputs[o], 1);
-            free(outputs);
+            mpz_set_si(slots[0], acirc_const(cp->circ, i));
+            encode_batch_add(batch, &(encode_job) {
+                    .enc = wire_x(obf->yhat[i]),
+                    .slots = ones,
+                    .nover = 2,
+                    .over = { 0, 1 + ninputs },
+                    .value = { encode_batch_value(batch, slots[0]), betas[ninputs + i] },
+                    .ix = ix,
+                });
+            encode_batch_add(batch, &(encode_job) {
+                    .enc = wire_u(obf->yhat[i]),
+                    .slots = ones,
+                    .ix = ix,
+                });
         }
-        for (size_t i = 0; i < nconsts; ++i)
-            mpz_vect_free(consts[i], 1);
-        free(consts);
-        for (size_t i = 0; i < ninputs; ++i)
-            mpz_vect_free(inputs[i], 1);
-        free(inputs);
     }
 
     {   /* Encode \hat z_o = [δ_o, 1, ..., 1] */
-        for (size_t i = 0; i < ninputs + 1; ++i)
-            mpz_set_ui(slots[1 + i], 1);
         for (size_t i = 0; i < noutputs; ++i) {
-            ix = index_set_new(obf_params_nzs(cp));
-            mpz_randomm_inv(slots[0], rng, moduli[0]);
-            __encode(pool, obf->enc_vt, obf->zhat[i], nslots, slots,
-                     ix, obf->sp, obf->op->nlevels - 1, &lock, &count, total);
+            encode_batch_add(batch, &(encode_job) {
+                    .enc = obf->zhat[i],
+                    .slots = ones,
+                    .nover = 1,
+                    .over = { 0 },
+                    .value = { deltas[i] },
+                    .ix = ix,
+                    .level = obf->op->nlevels - 1,
+                });
         }
     }
 
-    {   /* Encode \hat C* = [0, 1, ..., 1] */
-        mpz_t **inputs, **consts, **outputs;
+    {
+        mpz_t **outputs;
 
-        inputs = calloc(ninputs, sizeof inputs[0]);
-        for (size_t i = 0; i < ninputs; ++i)
-            inputs[i] = mpz_vect_new(1);
-        consts = calloc(nconsts, sizeof inputs[0]);
-        for (size_t i = 0; i < nconsts; ++i)
-            consts[i] = mpz_vect_new(1);
-        populate_circ_inputs(cp, -1, inputs, consts, betas);
-        outputs = acirc_eval_mpz(cp->circ, inputs, consts, moduli[1 + ninputs]);
+        /* The pool encodes the above while the circuit is evaluated */
+        encode_batch_flush(batch);
+        if ((outputs = _eval_lanes(cp, moduli, alphas, betas, residuals, nthreads)) == NULL)
+            goto cleanup;
 
-        mpz_set_ui(slots[0], 0);
+        /* Encode \hat w_{i,o} = [0, 1, ..., 1, C†, 1, ..., 1] */
         for (size_t i = 0; i < ninputs; ++i) {
-            mpz_set_ui(slots[1 + i], 1);
+            for (size_t o = 0; o < noutputs; ++o) {
+                /* One copy of C†, shared by both b */
+                mpz_srcptr c = encode_batch_value(batch, outputs[o][i]);
+                for (size_t b = 0; b < 2; ++b) {
+                    encode_batch_add(batch, &(encode_job) {
+                            .enc = obf->what[i][b][o],
+                            .slots = ones,
+                            .nover = 2,
+                            .over = { 0, 1 + i },
+                            .value = { bits[0], c },
+                            .ix = ix,
+                            .level = i /* XXX */,
+                        });
+                }
+            }
         }
+        /* Encode \hat C* = [0, 1, ..., 1] */
         for (size_t o = 0; o < noutputs; ++o) {
-            mpz_set(slots[1 + ninputs], *outputs[o]);
-            ix = index_set_new(obf_params_nzs(cp));
-            __encode(pool, obf->enc_vt, obf->Chatstar[o], nslots, slots,
-                     ix, obf->sp, 0, &lock, &count, total);
+            encode_batch_add(batch, &(encode_job) {
+                    .enc = obf->Chatstar[o],
+                    .slots = ones,
+                    .nover = 2,
+                    .over = { 0, 1 + ninputs },
+                    .value = { bits[0], encode_batch_value(batch, outputs[o][ninputs]) },
+                    .ix = ix,
+                });
         }
-        for (size_t i = 0; i < nconsts; ++i)
-            mpz_vect_free(consts[i], 1);
-        free(consts);
-        for (size_t i = 0; i < ninputs; ++i)
-            mpz_vect_free(inputs[i], 1);
-        free(inputs);
-        for (size_t i = 0; i < noutputs; ++i)
-            mpz_vect_free(outputs[i], 1);
+        for (size_t o = 0; o < noutputs; ++o)
+            mpz_vect_free(outputs[o], ninputs + 1);
         free(outputs);
     }
 
-
     result = OK;
 cleanup:
+    /* Jobs refer to alphas, betas and deltas, so they go once the pool is done */
+    if (batch)
+        encode_batch_flush(batch);
+    threadpool_destroy(pool);
+    encode_batch_free(batch);
+    progress_free(progress);
+    index_set_free(ix);
     mpz_vect_free(slots, nslots);
     mpz_vect_free(alphas, ninputs);
     mpz_vect_free(betas, ninputs + nconsts);
-    threadpool_destroy(pool);
-    pthread_mutex_destroy(&lock);
+    mpz_vect_free(deltas, noutputs);
+    if (residuals) {
+        for (size_t i = 0; i < ninputs; ++i)
+            residual_free(residuals[i]);
+        free(residuals);
+    }
+    residual_free(base);
     if (result == OK)
         return obf;
     else {
@@ -394,87 +552,98 @@ _fwrite(const obfuscation *obf, FILE *fp)
     const size_t ninputs = acirc_ninputs(cp->circ);
     const size_t nconsts = acirc_nconsts(cp->circ);
     const size_t noutputs = acirc_noutputs(cp->circ);
+    void *vt = (void *) obf->enc_vt;
+    container_writer *w;
 
+    if ((w = container_writer_new(fp, _nentries(cp))) == NULL)
+        return ERR;
     public_params_fwrite(obf->pp_vt, obf->pp, fp);
     for (size_t o = 0; o < noutputs; ++o)
-        encoding_fwrite(obf->enc_vt, obf->Chatstar[o], fp);
-    for (size_t i = 0; i < noutputs; ++i)
-        encoding_fwrite(obf->enc_vt, obf->zhat[i], fp);
+        if (container_writer_add_encoding(w, _entry_Chatstar(cp, o), obf->enc_vt,
+                                          obf->Chatstar[o]) == ERR)
+            goto error;
+    for (size_t o = 0; o < noutputs; ++o)
+        if (container_writer_add_encoding(w, _entry_zhat(cp, o), obf->enc_vt,
+                                          obf->zhat[o]) == ERR)
+            goto error;
     for (size_t i = 0; i < ninputs; ++i)
         for (size_t b = 0; b < 2; ++b)
-            wire_fwrite(obf->enc_vt, obf->xhat[i][b], fp);
+            if (container_writer_add(w, _entry_xhat(cp, i, b), obf->xhat[i][b],
+                                     _wire_write, vt) == ERR)
+                goto error;
     for (size_t i = 0; i < nconsts; ++i)
-        wire_fwrite(obf->enc_vt, obf->yhat[i], fp);
+        if (container_writer_add(w, _entry_yhat(cp, i), obf->yhat[i],
+                                 _wire_write, vt) == ERR)
+            goto error;
     for (size_t i = 0; i < ninputs; ++i)
         for (size_t b = 0; b < 2; ++b)
             for (size_t o = 0; o < noutputs; ++o)
-                encoding_fwrite(obf->enc_vt, obf->what[i][b][o], fp);
-    return OK;
+                if (container_writer_add_encoding(w, _entry_what(cp, i, b, o),
+                                                  obf->enc_vt, obf->what[i][b][o]) == ERR)
+                    goto error;
+    return container_writer_finish(w);
+error:
+    container_writer_free(w);
+    return ERR;
 }
 
 static obfuscation *
 _fread(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp)
 {
     obfuscation *obf;
-    const circ_params_t *cp = &op->cp;
-    const size_t ninputs = acirc_ninputs(cp->circ);
-    const size_t nconsts = acirc_nconsts(cp->circ);
-    const size_t noutputs = acirc_noutputs(cp->circ);
 
     if ((obf = _alloc(mmap, op)) == NULL)
         return NULL;
-
+    if ((obf->container = container_open(fp)) == NULL)
+        goto error;
+    if (container_nentries(obf->container) != _nentries(&op->cp)) {
+        fprintf(stderr, "%s: obfuscation does not match circuit\n", errorstr);
+        goto error;
+    }
+    /* Encodings are decoded from the container as evaluation needs them */
     obf->pp = public_params_fread(obf->pp_vt, op, fp);
-    for (size_t o = 0; o < noutputs; ++o)
-        obf->Chatstar[o] = encoding_fread(obf->enc_vt, fp);
-    for (size_t i = 0; i < noutputs; ++i)
-        obf->zhat[i] = encoding_fread(obf->enc_vt, fp);
-    for (size_t i = 0; i < ninputs; ++i)
-        for (size_t b = 0; b < 2; ++b)
-            obf->xhat[i][b] = wire_fread(obf->enc_vt, fp);
-    for (size_t i = 0; i < nconsts; ++i)
-        obf->yhat[i] = wire_fread(obf->enc_vt, fp);
-    for (size_t i = 0; i < ninputs; ++i)
-        for (size_t b = 0; b < 2; ++b)
-            for (size_t o = 0; o < noutputs; ++o)
-                obf->what[i][b][o] = encoding_fread(obf->enc_vt, fp);
     return obf;
+error:
+    _free(obf);
+    return NULL;
 }
 
 typedef struct {
     obfuscation *obf;
     long *inputs;
     switch_state_t ***switches;
+    encoding_pool *pool;
+    bool failed;                /* a wire could not be read or computed; atomic */
 } eval_args_t;
 
 static void *
-copy_f(void *x, void *args_)
+_fail(eval_args_t *args)
 {
-    eval_args_t *args = args_;
-    obfuscation *obf = args->obf;
-    wire_t *out;
-
-    out = wire_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    wire_set(obf->enc_vt, out, x);
-    return out;
+    __atomic_store_n(&args->failed, true, __ATOMIC_RELAXED);
+    return NULL;
 }
 
 static void *
 input_f(size_t ref, size_t i, void *args_)
 {
-    (void) ref;
     eval_args_t *args = args_;
     const obfuscation *const obf = args->obf;
-    return copy_f(obf->xhat[i][args->inputs[i]], args_);
+    if (!circ_params_needs_ref(&obf->op->cp, ref))
+        return NULL;
+    wire_t *x = _xhat(obf, i, args->inputs[i]);
+    return x ? wire_ref(x) : _fail(args);
 }
 
 static void *
 const_f(size_t ref, size_t i, long val, void *args_)
 {
-    (void) ref; (void) val;
+    (void) val;
     eval_args_t *args = args_;
     const obfuscation *const obf = args->obf;
-    return copy_f(obf->yhat[i], args_);
+    if (!circ_params_needs_ref(&obf->op->cp, ref))
+        return NULL;
+    wire_t *y = _yhat(obf, i);
+    return y ? wire_ref(y) : _fail(args);
 }
 
 static void *
@@ -487,26 +656,32 @@ eval_f(size_t ref, acirc_op op, size_t xref, const void *x_, size_t yref, const
     const wire_t *y = y_;
     wire_t *res;
 
-    res = wire_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (!circ_params_needs_ref(&obf->op->cp, ref))
+        return NULL;
+    /* An operand is missing because an earlier read failed */
+    if (x == NULL || y == NULL)
+        return _fail(args);
+    if ((res = wire_get(args->pool)) == NULL)
+        return _fail(args);
     switch (op) {
     case ACIRC_OP_MUL:
-        if (wire_mul(obf->enc_vt, obf->pp_vt, obf->pp, res, x, y,
+        if (wire_mul(obf->enc_vt, obf->pp_vt, obf->pp, args->pool, res, x, y,
                      args->switches ? args->switches[ref] : NULL) == ERR)
             goto error;
         break;
     case ACIRC_OP_ADD:
-        wire_add(obf->enc_vt, obf->pp_vt, obf->pp, res, x, y,
+        wire_add(obf->enc_vt, obf->pp_vt, obf->pp, args->pool, res, x, y,
                  args->switches ? args->switches[ref] : NULL);
         break;
     case ACIRC_OP_SUB:
-        wire_sub(obf->enc_vt, obf->pp_vt, obf->pp, res, x, y,
+        wire_sub(obf->enc_vt, obf->pp_vt, obf->pp, args->pool, res, x, y,
                  args->switches ? args->switches[ref] : NULL);
         break;
     }
     return res;
 error:
-    wire_free(obf->enc_vt, res);
-    return NULL;
+    wire_put(args->pool, res);
+    return _fail(args);
 }
 
 static void *
@@ -518,19 +693,36 @@ output_f(size_t ref, size_t o, void *x_, void *args_)
     obfuscation *obf = args->obf;
     const circ_params_t *const cp = &obf->op->cp;
     const size_t ninputs = acirc_ninputs(cp->circ);
-    encoding *out, *lhs, *rhs;
+    encoding *out, *lhs, *rhs, *xx = NULL;
+    const encoding *zhat, *Chatstar;
     const index_set *const toplevel = obf->pp_vt->toplevel(obf->pp);
     wire_t *x = x_;
 
-    out = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    lhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
-    rhs = encoding_new(obf->enc_vt, obf->pp_vt, obf->pp);
+    if (!circ_params_needs_output(cp, o))
+        return (void *) 0;
+    if (x == NULL || (zhat = _zhat(obf, o)) == NULL
+        || (Chatstar = _Chatstar(obf, o)) == NULL) {
+        _fail(args);
+        return (void *) output;
+    }
+    for (size_t i = 0; i < ninputs; ++i) {
+        if (_what(obf, i, 0, o) == NULL) {
+            _fail(args);
+            return (void *) output;
+        }
+    }
+    out = encoding_pool_get(args->pool);
+    lhs = encoding_pool_get(args->pool);
+    rhs = encoding_pool_get(args->pool);
 
     /* Compute LHS */
     ref = acirc_nrefs(cp->circ) + o * (ninputs + 2);
-    if (obf->mmap == &clt_pl_vtable)
-        clt_pl_elem_switch(wire_x(x)->enc, obf->pp->pp, wire_x(x)->enc, args->switches[ref][0]);
-    encoding_mul(obf->enc_vt, obf->pp_vt, lhs, wire_x(x), obf->zhat[o], obf->pp);
+    if (obf->mmap == &clt_pl_vtable) {
+        /* x may be borrowed, so switch a copy */
+        xx = encoding_pool_copy(args->pool, wire_x(x));
+        clt_pl_elem_switch(xx->enc, obf->pp->pp, xx->enc, args->switches[ref][0]);
+    }
+    encoding_mul(obf->enc_vt, obf->pp_vt, lhs, xx ? xx : wire_x(x), zhat, obf->pp);
     if (obf->mmap == &clt_pl_vtable)
         clt_pl_elem_switch(lhs->enc, obf->pp->pp, lhs->enc, args->switches[ref][1]);
     if (!index_set_eq(obf->enc_vt->mmap_set(lhs), toplevel)) {
@@ -541,10 +733,10 @@ output_f(size_t ref, size_t o, void *x_, void *args_)
     }
     /* Compute RHS */
     ref++;
-    encoding_set(obf->enc_vt, rhs, obf->Chatstar[o]);
+    encoding_set(obf->enc_vt, rhs, Chatstar);
     for (size_t i = 0; i < ninputs; ++i) {
         /* XXX wrong */
-        encoding_mul(obf->enc_vt, obf->pp_vt, rhs, rhs, args->obf->what[i][0][o], obf->pp);
+        encoding_mul_inplace(obf->enc_vt, obf->pp_vt, rhs, _what(obf, i, 0, o), obf->pp);
         if (obf->mmap == &clt_pl_vtable)
             clt_pl_elem_switch(rhs->enc, obf->pp->pp, rhs->enc, args->switches[ref++][1]);
     }
@@ -559,9 +751,10 @@ output_f(size_t ref, size_t o, void *x_, void *args_)
     encoding_sub(obf->enc_vt, obf->pp_vt, out, lhs, rhs, obf->pp);
     output = !encoding_is_zero(obf->enc_vt, obf->pp_vt, out, obf->pp);
 cleanup:
-    encoding_free(obf->enc_vt, out);
-    encoding_free(obf->enc_vt, lhs);
-    encoding_free(obf->enc_vt, rhs);
+    encoding_pool_put(args->pool, out);
+    encoding_pool_put(args->pool, lhs);
+    encoding_pool_put(args->pool, rhs);
+    encoding_pool_put(args->pool, xx);
     return (void *) output;
 }
 
@@ -569,8 +762,7 @@ static void
 free_f(void *x, void *args_)
 {
     eval_args_t *args = args_;
-    if (x)
-        wire_free(args->obf->enc_vt, x);
+    wire_put(args->pool, x);
 }
 
 static int
@@ -580,6 +772,7 @@ _evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
 {
     (void) kappa; (void) npowers;
     const circ_params_t *cp = &obf->op->cp;
+    int ret = OK;
 
     if (ninputs != acirc_ninputs(cp->circ)) {
         fprintf(stderr, "error: obf evaluate: invalid number of inputs\n");
@@ -596,18 +789,29 @@ _evaluate(const obfuscation *obf, long *outputs, size_t noutputs,
             .obf = obf,
             .inputs = inputs,
             .switches = NULL,
+            .pool = encoding_pool_new(obf->enc_vt, obf->pp_vt, obf->pp),
         };
         if (obf->mmap == &clt_pl_vtable)
             args.switches = clt_pl_pp_switches(obf->pp->pp);
-        tmp = (long *) acirc_traverse(cp->circ, input_f, const_f, eval_f,
-                                      output_f, free_f, &args, nthreads);
-        if (outputs)
+        tmp = (long *) sched_graph_traverse(obf->graph, input_f, const_f,
+                                            eval_f, output_f, free_f, &args,
+                                            nthreads);
+        if (tmp == NULL)
+            ret = ERR;
+        else if (outputs)
             for (size_t i = 0; i < acirc_noutputs(cp->circ); ++i)
                 outputs[i] = tmp[i];
         free(tmp);
+        if (g_verbose)
+            encoding_pool_print(args.pool);
+        encoding_pool_free(args.pool);
+        if (ret == OK && args.failed) {
+            fprintf(stderr, "%s: unable to read obfuscation\n", errorstr);
+            ret = ERR;
+        }
     }
 
-    return OK;
+    return ret;
 }
 
 obfuscator_vtable polylog_obfuscator_vtable = {
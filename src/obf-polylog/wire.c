@@ -27,7 +27,8 @@ wire_new(const encoding_vtable *vt, const pp_vtable *pp_vt, const public_params
 {
     wire_t *wire;
 
-    wire = calloc(1, sizeof wire[0]);
+    if ((wire = my_calloc(1, sizeof wire[0])) == NULL)
+        return NULL;
     wire->x = encoding_new(vt, pp_vt, pp);
     wire->u = encoding_new(vt, pp_vt, pp);
     return wire;
@@ -36,11 +37,47 @@ wire_new(const encoding_vtable *vt, const pp_vtable *pp_vt, const public_params
 void
 wire_free(const encoding_vtable *vt, wire_t *w)
 {
+    if (w == NULL)
+        return;
     encoding_free(vt, w->x);
     encoding_free(vt, w->u);
     free(w);
 }
 
+wire_t *
+wire_get(encoding_pool *pool)
+{
+    wire_t *wire;
+
+    if ((wire = my_calloc(1, sizeof wire[0])) == NULL)
+        return NULL;
+    wire->x = encoding_pool_get(pool);
+    wire->u = encoding_pool_get(pool);
+    return wire;
+}
+
+wire_t *
+wire_ref(wire_t *w)
+{
+    wire_t *wire;
+
+    if ((wire = my_calloc(1, sizeof wire[0])) == NULL)
+        return NULL;
+    wire->x = encoding_ref(w->x);
+    wire->u = encoding_ref(w->u);
+    return wire;
+}
+
+void
+wire_put(encoding_pool *pool, wire_t *w)
+{
+    if (w == NULL)
+        return;
+    encoding_pool_put(pool, w->x);
+    encoding_pool_put(pool, w->u);
+    free(w);
+}
+
 int
 wire_set(const encoding_vtable *vt, wire_t *rop, wire_t *w)
 {
@@ -49,84 +86,74 @@ wire_set(const encoding_vtable *vt, wire_t *rop, wire_t *w)
     return OK;
 }
 
+/* Switches the lower of *a and *b up to the other's level.  Operands may be
+ * borrowed, so the one switched is first copied, at most once, into its
+ * copy slot */
+static void
+_match_levels(encoding_pool *pool, const public_params *pp, switch_state_t *sw,
+              encoding **a, encoding **a_copy, encoding **b, encoding **b_copy)
+{
+    encoding **lo, **lo_copy;
+
+    if (clt_pl_elem_level((*a)->enc) == clt_pl_elem_level((*b)->enc))
+        return;
+    if (clt_pl_elem_level((*a)->enc) < clt_pl_elem_level((*b)->enc)) {
+        lo = a;
+        lo_copy = a_copy;
+    } else {
+        lo = b;
+        lo_copy = b_copy;
+    }
+    if (*lo_copy == NULL)
+        *lo = *lo_copy = encoding_pool_copy(pool, *lo);
+    clt_pl_elem_switch((*lo)->enc, pp->pp, (*lo)->enc, sw);
+}
+
 int
 wire_mul(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches)
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches)
 {
-    encoding *xx = x->x;
-    encoding *yx = y->x;
-    encoding *xu = x->u;
-    encoding *yu = y->u;
+    encoding *xx = x->x, *xx_copy = NULL;
+    encoding *yx = y->x, *yx_copy = NULL;
+    encoding *xu = x->u, *xu_copy = NULL;
+    encoding *yu = y->u, *yu_copy = NULL;
     if (switches) {
-        xx = encoding_copy(vt, pp_vt, pp, xx);
-        yx = encoding_copy(vt, pp_vt, pp, yx);
-        xu = encoding_copy(vt, pp_vt, pp, xu);
-        yu = encoding_copy(vt, pp_vt, pp, yu);
-        if (clt_pl_elem_level(xx->enc) != clt_pl_elem_level(yx->enc)) {
-            if (clt_pl_elem_level(xx->enc) < clt_pl_elem_level(yx->enc))
-                clt_pl_elem_switch(xx->enc, pp->pp, xx->enc, switches[0]);
-            else
-                clt_pl_elem_switch(yx->enc, pp->pp, yx->enc, switches[0]);
-        }
-        if (clt_pl_elem_level(xu->enc) != clt_pl_elem_level(yu->enc)) {
-            if (clt_pl_elem_level(xu->enc) < clt_pl_elem_level(yu->enc))
-                clt_pl_elem_switch(xu->enc, pp->pp, xu->enc, switches[0]);
-            else
-                clt_pl_elem_switch(yu->enc, pp->pp, yu->enc, switches[0]);
-        }
+        _match_levels(pool, pp, switches[0], &xx, &xx_copy, &yx, &yx_copy);
+        _match_levels(pool, pp, switches[0], &xu, &xu_copy, &yu, &yu_copy);
     }
     encoding_mul(vt, pp_vt, rop->x, xx, yx, pp);
     encoding_mul(vt, pp_vt, rop->u, xu, yu, pp);
     if (switches) {
         clt_pl_elem_switch(rop->x->enc, pp->pp, rop->x->enc, switches[1]);
         clt_pl_elem_switch(rop->u->enc, pp->pp, rop->u->enc, switches[1]);
-        encoding_free(vt, xx);
-        encoding_free(vt, yx);
-        encoding_free(vt, xu);
-        encoding_free(vt, yu);
     }
+    encoding_pool_put(pool, xx_copy);
+    encoding_pool_put(pool, yx_copy);
+    encoding_pool_put(pool, xu_copy);
+    encoding_pool_put(pool, yu_copy);
     return OK;
 }
 
 
 static int
 wire_op(const encoding_vtable *vt, const pp_vtable *pp_vt,
-        const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-        switch_state_t **switches,
+        const public_params *pp, encoding_pool *pool, wire_t *rop,
+        const wire_t *x, const wire_t *y, switch_state_t **switches,
         int (*op)(const encoding_vtable *, const pp_vtable *, encoding *,
                   const encoding *, const encoding *, const public_params *))
 {
     encoding *tmp;
-    encoding *xx = x->x;
-    encoding *yx = y->x;
-    encoding *xu = x->u;
-    encoding *yu = y->u;
+    encoding *xx = x->x, *xx_copy = NULL;
+    encoding *yx = y->x, *yx_copy = NULL;
+    encoding *xu = x->u, *xu_copy = NULL;
+    encoding *yu = y->u, *yu_copy = NULL;
 
-    tmp = encoding_new(vt, pp_vt, pp);
+    tmp = encoding_pool_get(pool);
     if (switches) {
-        xx = encoding_copy(vt, pp_vt, pp, xx);
-        yx = encoding_copy(vt, pp_vt, pp, yx);
-        xu = encoding_copy(vt, pp_vt, pp, xu);
-        yu = encoding_copy(vt, pp_vt, pp, yu);
-        if (clt_pl_elem_level(xu->enc) != clt_pl_elem_level(yu->enc)) {
-            if (clt_pl_elem_level(xu->enc) < clt_pl_elem_level(yu->enc))
-                clt_pl_elem_switch(xu->enc, pp->pp, xu->enc, switches[0]);
-            else
-                clt_pl_elem_switch(yu->enc, pp->pp, yu->enc, switches[0]);
-        }
-        if (clt_pl_elem_level(xx->enc) != clt_pl_elem_level(yu->enc)) {
-            if (clt_pl_elem_level(xx->enc) < clt_pl_elem_level(yu->enc))
-                clt_pl_elem_switch(xx->enc, pp->pp, xx->enc, switches[0]);
-            else
-                clt_pl_elem_switch(yu->enc, pp->pp, yu->enc, switches[0]);
-        }
-        if (clt_pl_elem_level(xu->enc) != clt_pl_elem_level(yx->enc)) {
-            if (clt_pl_elem_level(xu->enc) < clt_pl_elem_level(yx->enc))
-                clt_pl_elem_switch(xu->enc, pp->pp, xu->enc, switches[0]);
-            else
-                clt_pl_elem_switch(yx->enc, pp->pp, yx->enc, switches[0]);
-        }
+        _match_levels(pool, pp, switches[0], &xu, &xu_copy, &yu, &yu_copy);
+        _match_levels(pool, pp, switches[0], &xx, &xx_copy, &yu, &yu_copy);
+        _match_levels(pool, pp, switches[0], &xu, &xu_copy, &yx, &yx_copy);
     }
     encoding_mul(vt, pp_vt, rop->u, xu, yu, pp);
     encoding_mul(vt, pp_vt, tmp,    xx, yu, pp);
@@ -135,30 +162,30 @@ wire_op(const encoding_vtable *vt, const pp_vtable *pp_vt,
         clt_pl_elem_switch(rop->u->enc, pp->pp, rop->u->enc, switches[1]);
         clt_pl_elem_switch(tmp->enc,    pp->pp, tmp->enc,    switches[1]);
         clt_pl_elem_switch(rop->x->enc, pp->pp, rop->x->enc, switches[1]);
-        encoding_free(vt, xx);
-        encoding_free(vt, yx);
-        encoding_free(vt, xu);
-        encoding_free(vt, yu);
     }
+    encoding_pool_put(pool, xx_copy);
+    encoding_pool_put(pool, yx_copy);
+    encoding_pool_put(pool, xu_copy);
+    encoding_pool_put(pool, yu_copy);
     op(vt, pp_vt, rop->x, tmp, rop->x, pp);
-    encoding_free(vt, tmp);
+    encoding_pool_put(pool, tmp);
     return OK;
 }
 
 int
 wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches)
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches)
 {
-    return wire_op(vt, pp_vt, pp, rop, x, y, switches, encoding_add);
+    return wire_op(vt, pp_vt, pp, pool, rop, x, y, switches, encoding_add);
 }
 
 int
 wire_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches)
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches)
 {
-    return wire_op(vt, pp_vt, pp, rop, x, y, switches, encoding_sub);
+    return wire_op(vt, pp_vt, pp, pool, rop, x, y, switches, encoding_sub);
 }
 
 wire_t *
@@ -166,9 +193,14 @@ wire_fread(const encoding_vtable *vt, FILE *fp)
 {
     wire_t *w;
 
-    w = calloc(1, sizeof w[0]);
+    if ((w = my_calloc(1, sizeof w[0])) == NULL)
+        return NULL;
     w->x = encoding_fread(vt, fp);
     w->u = encoding_fread(vt, fp);
+    if (w->x == NULL || w->u == NULL) {
+        wire_free(vt, w);
+        return NULL;
+    }
     return w;
 }
 
@@ -13,20 +13,28 @@ wire_t *
 wire_new(const encoding_vtable *vt, const pp_vtable *pp_vt, const public_params *pp);
 void
 wire_free(const encoding_vtable *vt, wire_t *w);
+/* Wires whose encodings come from, and go back to, |pool| */
+wire_t *
+wire_get(encoding_pool *pool);
+/* Borrows the encodings of |w| read-only, see encoding_ref */
+wire_t *
+wire_ref(wire_t *w);
+void
+wire_put(encoding_pool *pool, wire_t *w);
 int
 wire_set(const encoding_vtable *vt, wire_t *rop, wire_t *w);
 int
 wire_mul(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches);
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches);
 int
 wire_add(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches);
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches);
 int
 wire_sub(const encoding_vtable *vt, const pp_vtable *pp_vt,
-         const public_params *pp, wire_t *rop, const wire_t *x, const wire_t *y,
-         switch_state_t **switches);
+         const public_params *pp, encoding_pool *pool, wire_t *rop,
+         const wire_t *x, const wire_t *y, switch_state_t **switches);
 wire_t *
 wire_fread(const encoding_vtable *vt, FILE *fp);
 int
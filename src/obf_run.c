@@ -1,19 +1,187 @@
 #include "obf_run.h"
+#include "container.h"
 #include "util.h"
 
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <mmap/mmap_dummy.h>
+#include <threadpool.h>
+
+/* Encodings of the input-independent gates are kept next to the obfuscation
+ * in <fname>.consts */
+static char *
+_consts_fname(const char *fname)
+{
+    const size_t length = snprintf(NULL, 0, "%s.consts", fname) + 1;
+    char *consts = my_calloc(length, sizeof consts[0]);
+    snprintf(consts, length, "%s.consts", fname);
+    return consts;
+}
+
+/* The .consts file starts with the digest of the obfuscation container it
+ * was computed from, so a stale or copied file is rejected */
+static int
+_consts_digest(const char *fname, size_t *digest)
+{
+    container *c;
+    FILE *fp;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%s: unable to open '%s' for reading\n",
+                errorstr, fname);
+        return ERR;
+    }
+    c = container_open(fp);
+    fclose(fp);
+    if (c == NULL)
+        return ERR;
+    *digest = container_digest(c);
+    container_close(c);
+    return OK;
+}
+
+static obfuscation *
+_load(const mmap_vtable *mmap, const obfuscator_vtable *vt, const char *fname,
+      const obf_params_t *op)
+{
+    double start, end;
+    obfuscation *obf;
+    FILE *fp;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        fprintf(stderr, "%s: unable to open '%s' for reading\n",
+                errorstr, fname);
+        return NULL;
+    }
+    start = current_time();
+    if ((obf = vt->fread(mmap, op, fp)) == NULL)
+        fprintf(stderr, "%s: reading obfuscator failed\n", errorstr);
+    end = current_time();
+    fclose(fp);
+    if (obf && g_verbose)
+        fprintf(stderr, "Reading obfuscation from disk: %.2fs\n", end - start);
+    if (obf && vt->consts_fread) {
+        char *consts = _consts_fname(fname);
+        if ((fp = fopen(consts, "r"))) {
+            size_t want, have;
+            if (size_t_fread(&have, fp) == ERR
+                || _consts_digest(fname, &want) == ERR) {
+                fprintf(stderr, "%s: reading '%s' failed\n", errorstr, consts);
+                vt->free(obf);
+                obf = NULL;
+            } else if (have != want) {
+                fprintf(stderr, "%s: '%s' was not computed from '%s'; "
+                        "remove it or obfuscate again\n", errorstr, consts, fname);
+                vt->free(obf);
+                obf = NULL;
+            } else if (vt->consts_fread(obf, fp) == ERR) {
+                fprintf(stderr, "%s: reading '%s' failed\n", errorstr, consts);
+                vt->free(obf);
+                obf = NULL;
+            }
+            fclose(fp);
+        }
+        free(consts);
+    }
+    return obf;
+}
+
+static int
+_consts_write(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+              const char *fname, const obf_params_t *op,
+              const obfuscation *obf, size_t nthreads)
+{
+    char *consts = _consts_fname(fname);
+    obfuscation *loaded = NULL;
+    double start, end;
+    size_t digest;
+    FILE *fp = NULL;
+    int ret = ERR;
+
+    /* A streamed obfuscation is not in memory, so read it back */
+    if (obf == NULL && (obf = loaded = _load(mmap, vt, fname, op)) == NULL)
+        goto cleanup;
+    if ((fp = fopen(consts, "w")) == NULL) {
+        fprintf(stderr, "%s: unable to open '%s' for writing\n", errorstr, consts);
+        goto cleanup;
+    }
+    start = current_time();
+    if (_consts_digest(fname, &digest) == ERR || size_t_fwrite(digest, fp) == ERR) {
+        fprintf(stderr, "%s: unable to write '%s'\n", errorstr, consts);
+        goto cleanup;
+    }
+    if (vt->consts_fwrite(obf, fp, nthreads) == ERR) {
+        fprintf(stderr, "%s: precomputing constant gates failed\n", errorstr);
+        goto cleanup;
+    }
+    end = current_time();
+    fclose(fp);
+    fp = NULL;
+    if (g_verbose) {
+        fprintf(stderr, "Precomputing constant gates: %.2fs\n", end - start);
+        fprintf(stderr, "  Constants file size: %lu KB\n", filesize(consts) / 1024);
+    }
+    ret = OK;
+cleanup:
+    if (fp)
+        fclose(fp);
+    if (ret == ERR)
+        (void) unlink(consts);
+    free(consts);
+    if (loaded)
+        vt->free(loaded);
+    return ret;
+}
 
 int
 obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
-                  const char *fname, obf_params_t *op, size_t secparam,
-                  size_t *kappa, size_t nthreads, aes_randstate_t rng)
+                  const char *fname, const char *checkpoint, obf_params_t *op,
+                  size_t secparam, size_t *kappa, size_t nthreads,
+                  aes_randstate_t rng)
 {
-    obfuscation *obf;
+    obfuscation *obf = NULL;
     double start, end, _start, _end;
     int ret = ERR;
 
+    if (checkpoint && (fname == NULL || vt->obfuscate_fwrite == NULL)) {
+        fprintf(stderr, "%s: checkpointing is not supported by this scheme\n",
+                errorstr);
+        return ERR;
+    }
+    if (fname) {
+        /* Never leave constants from an earlier obfuscation behind */
+        char *consts = _consts_fname(fname);
+        (void) unlink(consts);
+        free(consts);
+    }
     start = current_time();
+    if (fname && vt->obfuscate_fwrite) {
+        FILE *fp;
+        if ((fp = fopen(fname, "w")) == NULL) {
+            fprintf(stderr, "%s: unable to open '%s' for writing\n",
+                    errorstr, fname);
+            exit(EXIT_FAILURE);
+        }
+        _start = current_time();
+        if (vt->obfuscate_fwrite(mmap, op, fp, checkpoint, secparam, kappa,
+                                 nthreads, rng) == ERR) {
+            fprintf(stderr, "%s: obfuscation failed\n", errorstr);
+            fclose(fp);
+            goto cleanup;
+        }
+        fclose(fp);
+        _end = current_time();
+        if (g_verbose) {
+            fprintf(stderr, "Obfuscation and writing to disk: %.2fs\n", _end - _start);
+            fprintf(stderr, "  Obfuscation file size: %lu KB\n",
+                    filesize(fname) / 1024);
+        }
+        goto done;
+    }
     _start = current_time();
     obf = vt->obfuscate(mmap, op, secparam, kappa, nthreads, rng);
     if (obf == NULL) {
@@ -45,6 +213,10 @@ obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
                     filesize(fname) / 1024);
         }
     }
+done:
+    if (fname && vt->consts_fwrite
+        && _consts_write(mmap, vt, fname, op, obf, nthreads) == ERR)
+        goto cleanup;
     end = current_time();
     if (g_verbose)
         fprintf(stderr, "Total: %.2fs\n", end - start);
@@ -67,24 +239,11 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
 {
     double start, end, _start, _end;
     obfuscation *obf;
-    FILE *fp;
     int ret = ERR;
 
-    if ((fp = fopen(fname, "r")) == NULL) {
-        fprintf(stderr, "%s: unable to open '%s' for reading\n",
-                errorstr, fname);
-        return ERR;
-    }
-
     start = current_time();
-    _start = current_time();
-    if ((obf = vt->fread(mmap, op, fp)) == NULL) {
-        fprintf(stderr, "%s: reading obfuscator failed\n", errorstr);
-        goto cleanup;
-    }
-    _end = current_time();
-    if (g_verbose)
-        fprintf(stderr, "Reading obfuscation from disk: %.2fs\n", _end - _start);
+    if ((obf = _load(mmap, vt, fname, op)) == NULL)
+        return ERR;
 
     _start = current_time();
     if (vt->evaluate(obf, outputs, noutputs, inputs, ninputs, nthreads, kappa, npowers) == ERR)
@@ -103,26 +262,333 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
     }
     ret = OK;
 cleanup:
-    fclose(fp);
     vt->free(obf);
     return ret;
 }
 
+int
+obf_run_batch(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+              const char *fname, obf_params_t *op, long **inputs,
+              size_t ninputs, long **outputs, size_t noutputs, size_t n,
+              size_t nthreads, size_t budget)
+{
+    double start, end;
+    obfuscation *obf;
+    int ret = ERR;
+
+    if ((obf = _load(mmap, vt, fname, op)) == NULL)
+        return ERR;
+
+    start = current_time();
+    if (vt->evaluate_batch) {
+        if (vt->evaluate_batch(obf, outputs, noutputs, inputs, ninputs, n,
+                               nthreads, budget) == ERR)
+            goto cleanup;
+    } else {
+        for (size_t b = 0; b < n; ++b)
+            if (vt->evaluate(obf, outputs[b], noutputs, inputs[b], ninputs,
+                             nthreads, NULL, NULL) == ERR)
+                goto cleanup;
+    }
+    end = current_time();
+    if (g_verbose) {
+        fprintf(stderr, "Evaluation time: %.2fs (%lu inputs, %.2fs each)\n",
+                end - start, n, n ? (end - start) / n : 0.0);
+        unsigned long size, resident;
+        if (memory(&size, &resident) == OK)
+            fprintf(stderr, "Memory: %luM\n", resident);
+    }
+    ret = OK;
+cleanup:
+    vt->free(obf);
+    return ret;
+}
+
+typedef struct {
+    const obfuscator_vtable *vt;
+    const obfuscation *obf;
+    const acirc_t *circ;
+    size_t t;
+    long *outputs;
+    size_t nthreads;
+    size_t kappa;
+    int ret;                    /* each worker's own status */
+} test_args_t;
+
+static void
+test_worker(void *vargs)
+{
+    test_args_t *args = vargs;
+    const acirc_t *circ = args->circ;
+
+    if (args->vt->evaluate(args->obf, args->outputs, acirc_noutputs(circ),
+                           acirc_test_input(circ, args->t), acirc_ninputs(circ),
+                           args->nthreads, &args->kappa, NULL) == ERR)
+        args->ret = ERR;
+}
+
+int
+obf_run_test(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+             const char *fname, obf_params_t *op, long **outputs,
+             size_t nthreads, size_t *kappa)
+{
+    const acirc_t *circ = obf_params_cp(op)->circ;
+    const size_t ntests = acirc_ntests(circ);
+    double start, end;
+    obfuscation *obf;
+    test_args_t *args;
+    threadpool *pool;
+    size_t nouter, ninner;
+    int ret = OK;
+
+    if ((obf = _load(mmap, vt, fname, op)) == NULL)
+        return ERR;
+
+    /* Run up to |nthreads| tests side by side, and hand whatever threads are
+     * left over to each test's circuit traversal */
+    if (nthreads == 0)
+        nthreads = 1;
+    nouter = ntests < nthreads ? ntests : nthreads;
+    if (nouter == 0)
+        nouter = 1;
+    ninner = nthreads / nouter;
+    if (g_verbose)
+        fprintf(stderr, "Running %lu tests: %lu at a time × %lu threads each\n",
+                ntests, nouter, ninner);
+
+    start = current_time();
+    args = my_calloc(ntests, sizeof args[0]);
+    pool = threadpool_create(nouter);
+    for (size_t t = 0; t < ntests; ++t) {
+        args[t].vt = vt;
+        args[t].obf = obf;
+        args[t].circ = circ;
+        args[t].t = t;
+        args[t].outputs = outputs[t];
+        args[t].nthreads = ninner;
+        args[t].kappa = 0;
+        args[t].ret = OK;
+        threadpool_add_job(pool, test_worker, &args[t]);
+    }
+    threadpool_destroy(pool);
+    end = current_time();
+    if (g_verbose)
+        fprintf(stderr, "Evaluation time: %.2fs\n", end - start);
+
+    for (size_t t = 0; t < ntests; ++t)
+        if (args[t].ret == ERR)
+            ret = ERR;
+    if (kappa) {
+        *kappa = 0;
+        for (size_t t = 0; t < ntests; ++t)
+            if (args[t].kappa > *kappa)
+                *kappa = args[t].kappa;
+    }
+    free(args);
+    vt->free(obf);
+    return ret;
+}
+
+/* Evaluates one input per line of |in|, writing one result line per request
+ * to |out|.  Malformed requests get an error line rather than ending the
+ * session. */
+static int
+_serve_stream(const obfuscator_vtable *vt, const obfuscation *obf,
+              const obf_params_t *op, FILE *in, FILE *out, size_t nthreads,
+              size_t *count)
+{
+    const acirc_t *circ = obf_params_cp(op)->circ;
+    const size_t ninputs = acirc_ninputs(circ);
+    const size_t noutputs = acirc_noutputs(circ);
+    long inputs[ninputs];
+    long outputs[noutputs];
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, in)) != -1) {
+        double start, end;
+        bool valid = true;
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t) len != ninputs) {
+            fprintf(out, "error: expected %lu inputs, got %ld\n", ninputs, len);
+            fflush(out);
+            continue;
+        }
+        for (size_t i = 0; i < ninputs; ++i) {
+            if ((inputs[i] = char_to_long(line[i])) < 0)
+                valid = false;
+        }
+        if (!valid) {
+            fprintf(out, "error: invalid input '%s'\n", line);
+            fflush(out);
+            continue;
+        }
+        (*count)++;
+        start = current_time();
+        if (vt->evaluate(obf, outputs, noutputs, inputs, ninputs, nthreads,
+                         NULL, NULL) == ERR) {
+            fprintf(out, "error: evaluation failed\n");
+            fflush(out);
+            continue;
+        }
+        end = current_time();
+        fprintf(out, "result: ");
+        for (size_t o = 0; o < noutputs; ++o)
+            fprintf(out, "%c", long_to_char(outputs[o]));
+        fprintf(out, "\n");
+        fflush(out);
+        fprintf(stderr, "Request #%lu: %.4fs\n", *count, end - start);
+    }
+    free(line);
+    return OK;
+}
+
+static int
+_serve_socket(const obfuscator_vtable *vt, const obfuscation *obf,
+              const obf_params_t *op, const char *path, size_t nthreads,
+              size_t *count)
+{
+    struct sockaddr_un addr;
+    int sock, ret = ERR;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket path '%s' too long\n", errorstr, path);
+        return ERR;
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "%s: unable to create socket\n", errorstr);
+        return ERR;
+    }
+    memset(&addr, '\0', sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    (void) unlink(path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof addr) == -1
+        || listen(sock, 8) == -1) {
+        fprintf(stderr, "%s: unable to listen on '%s'\n", errorstr, path);
+        goto cleanup;
+    }
+    /* A client hanging up mid-response must not take the server down */
+    signal(SIGPIPE, SIG_IGN);
+    if (g_verbose)
+        fprintf(stderr, "Listening on %s\n", path);
+
+    while (true) {
+        FILE *in = NULL, *out = NULL;
+        int fd;
+
+        if ((fd = accept(sock, NULL, NULL)) == -1) {
+            fprintf(stderr, "%s: accept failed\n", errorstr);
+            goto cleanup;
+        }
+        if ((in = fdopen(fd, "r")) == NULL
+            || (out = fdopen(dup(fd), "w")) == NULL) {
+            fprintf(stderr, "%s: unable to open connection stream\n", errorstr);
+            if (in)
+                fclose(in);
+            else
+                close(fd);
+            continue;
+        }
+        (void) _serve_stream(vt, obf, op, in, out, nthreads, count);
+        fclose(out);
+        fclose(in);
+    }
+cleanup:
+    close(sock);
+    (void) unlink(path);
+    return ret;
+}
+
+int
+obf_run_serve(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+              const char *fname, obf_params_t *op, const char *socket,
+              size_t nthreads)
+{
+    double start, end;
+    obfuscation *obf;
+    size_t count = 0;
+    int ret;
+
+    start = current_time();
+    if ((obf = _load(mmap, vt, fname, op)) == NULL)
+        return ERR;
+    end = current_time();
+    fprintf(stderr, "Load time: %.2fs\n", end - start);
+    if (g_verbose) {
+        unsigned long size, resident;
+        if (memory(&size, &resident) == OK)
+            fprintf(stderr, "Memory: %luM\n", resident);
+    }
+
+    if (socket)
+        ret = _serve_socket(vt, obf, op, socket, nthreads, &count);
+    else
+        ret = _serve_stream(vt, obf, op, stdin, stdout, nthreads, &count);
+
+    if (g_verbose)
+        fprintf(stderr, "Served %lu requests\n", count);
+    vt->free(obf);
+    return ret;
+}
+
+static size_t
+_smart_kappa_analyze(const obfuscator_vtable *vt, const acirc_t *circ,
+                     obf_params_t *op)
+{
+    size_t degrees[acirc_noutputs(circ)];
+    size_t kappa, npowers;
+    double start, end;
+
+    start = current_time();
+    if (vt->analyze(op, &kappa, &npowers, degrees) == ERR) {
+        fprintf(stderr, "%s: unable to determine smart κ settings\n", errorstr);
+        return 0;
+    }
+    end = current_time();
+    if (g_verbose) {
+        fprintf(stderr, "  κ: %lu\n", kappa);
+        fprintf(stderr, "  # powers used: %lu\n", npowers);
+        fprintf(stderr, "  Output degrees:");
+        for (size_t o = 0; o < acirc_noutputs(circ); ++o)
+            fprintf(stderr, " %lu", degrees[o]);
+        fprintf(stderr, "\n");
+        fprintf(stderr, "  Analysis time: %.4fs\n", end - start);
+    }
+    return kappa;
+}
+
 size_t
 obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc_t *circ,
                     obf_params_t *op, size_t nthreads, aes_randstate_t rng)
 {
-    const char *fname = "/tmp/smart-kappa.obf";
+    char fname[] = "/tmp/smart-kappa-XXXXXX";
     long input[acirc_ninputs(circ)];
     long output[acirc_noutputs(circ)];
     bool verbosity = g_verbose;
     size_t kappa = 1;
+    int fd;
 
     if (g_verbose)
         fprintf(stderr, "Choosing κ smartly...\n");
+    if (vt->analyze)
+        return _smart_kappa_analyze(vt, circ, op);
+
+    /* Otherwise obfuscate and evaluate with the dummy mmap, using a private
+     * file so that concurrent runs do not clobber each other */
+    if ((fd = mkstemp(fname)) == -1) {
+        fprintf(stderr, "%s: unable to create temporary file\n", errorstr);
+        return 0;
+    }
+    close(fd);
 
     g_verbose = false;
-    if (obf_run_obfuscate(&dummy_vtable, vt, fname, op, 8, &kappa, nthreads, rng) == ERR) {
+    if (obf_run_obfuscate(&dummy_vtable, vt, fname, NULL, op, 8, &kappa, nthreads, rng) == ERR) {
         fprintf(stderr, "%s: unable to obfuscate to determine smart κ settings\n",
                 errorstr);
         kappa = 0;
@@ -139,6 +605,7 @@ obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc_t *circ,
     }
 
 cleanup:
+    unlink(fname);
     g_verbose = verbosity;
     return kappa;
 }
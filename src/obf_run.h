@@ -4,8 +4,9 @@
 
 int
 obf_run_obfuscate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
-                  const char *fname, obf_params_t *op, size_t secparam,
-                  size_t *kappa, size_t nthreads, aes_randstate_t rng);
+                  const char *fname, const char *checkpoint, obf_params_t *op,
+                  size_t secparam, size_t *kappa, size_t nthreads,
+                  aes_randstate_t rng);
 
 int
 obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
@@ -13,6 +14,27 @@ obf_run_evaluate(const mmap_vtable *mmap, const obfuscator_vtable *vt,
                  size_t ninputs, long *output, size_t noutputs, size_t nthreads,
                  size_t *kappa, size_t *npowers);
 
+/* Reads the obfuscation once and evaluates each of the |n| inputs, writing
+ * the outputs of input b to outputs[b]; schemes that support it reuse gate
+ * encodings across inputs within |budget| bytes */
+int
+obf_run_batch(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+              const char *fname, obf_params_t *op, long **inputs,
+              size_t ninputs, long **outputs, size_t noutputs, size_t n,
+              size_t nthreads, size_t budget);
+
+/* Reads the obfuscation once and evaluates every test vector of the circuit
+ * against it, writing the outputs of test t to outputs[t] */
+int
+obf_run_test(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+             const char *fname, obf_params_t *op, long **outputs,
+             size_t nthreads, size_t *kappa);
+
+int
+obf_run_serve(const mmap_vtable *mmap, const obfuscator_vtable *vt,
+              const char *fname, obf_params_t *op, const char *socket,
+              size_t nthreads);
+
 size_t
 obf_run_smart_kappa(const obfuscator_vtable *vt, const acirc_t *circ, obf_params_t *op, size_t nthreads,
                     aes_randstate_t rng);
@@ -13,4 +13,26 @@ typedef struct {
                     size_t *kappa, size_t *npowers);
     int (*fwrite)(const obfuscation *obf, FILE *fp);
     obfuscation * (*fread)(const mmap_vtable *mmap, const obf_params_t *op, FILE *fp);
+    /* Optional: obfuscates straight to |fp|, writing each encoding as soon as
+     * it is produced instead of holding the whole obfuscation in memory.  If
+     * |checkpoint| names a directory, progress is recorded there and an
+     * interrupted run with the same directory resumes where it stopped. */
+    int (*obfuscate_fwrite)(const mmap_vtable *mmap, const obf_params_t *op,
+                            FILE *fp, const char *checkpoint, size_t secparam,
+                            size_t *kappa, size_t nthreads, aes_randstate_t rng);
+    /* Optional: computes κ, the number of powers evaluation uses and the
+     * degree of each output symbolically, without obfuscating */
+    int (*analyze)(const obf_params_t *op, size_t *kappa, size_t *npowers,
+                   size_t *degrees);
+    /* Optional: evaluates the gates that depend only on constants, writing
+     * their encodings to |fp|, a sidecar to the obfuscation */
+    int (*consts_fwrite)(const obfuscation *obf, FILE *fp, size_t nthreads);
+    /* Optional: reads a sidecar written by consts_fwrite, after which
+     * evaluation starts from those encodings instead of recomputing them */
+    int (*consts_fread)(obfuscation *obf, FILE *fp);
+    /* Optional: evaluates |n| inputs in turn, reusing the encodings of gates
+     * that repeat across them while these fit in |budget| bytes */
+    int (*evaluate_batch)(const obfuscation *obf, long **outputs,
+                          size_t noutputs, long **inputs, size_t ninputs,
+                          size_t n, size_t nthreads, size_t budget);
 } obfuscator_vtable;
@@ -0,0 +1,149 @@
+#include "progress.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum progress_e g_progress = PROGRESS_BAR;
+
+/* How often the reporter samples, in milliseconds */
+#define PROGRESS_INTERVAL 250
+
+#define PBSTR "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||"
+#define PBWIDTH 60
+
+struct progress {
+    const char *name;
+    size_t done;                /* updated atomically */
+    size_t start;               /* done when created, left out of the rate */
+    size_t total;
+    double t0;
+    bool reporting;
+    bool stop;                  /* requires the lock */
+    pthread_t reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void
+_eta_str(char *buf, size_t len, double secs)
+{
+    if (secs < 0) {
+        snprintf(buf, len, "--:--");
+        return;
+    }
+    const unsigned long s = secs + 0.5;
+    if (s >= 3600)
+        snprintf(buf, len, "%lu:%02lu:%02lu", s / 3600, s / 60 % 60, s % 60);
+    else
+        snprintf(buf, len, "%02lu:%02lu", s / 60, s % 60);
+}
+
+static void
+_sample(const progress *p, bool last)
+{
+    const size_t done = progress_done(p);
+    const double elapsed = current_time() - p->t0;
+    const double rate = elapsed > 0 ? (done - p->start) / elapsed : 0;
+    const double eta = done >= p->total ? 0
+        : rate > 0 ? (p->total - done) / rate : -1;
+
+    switch (g_progress) {
+    case PROGRESS_BAR: {
+        const double percentage = p->total ? (double) done / p->total : 1;
+        const int val = percentage * 100;
+        const int lpad = percentage * PBWIDTH;
+        const int rpad = PBWIDTH - lpad;
+        char etastr[32];
+        _eta_str(etastr, sizeof etastr, eta);
+        fprintf(stdout, "\r\t%3d%% [%.*s%*s] %lu/%lu  %.1f/s  ETA %s ",
+                val, lpad, PBSTR, rpad, "", done, p->total, rate, etastr);
+        if (last)
+            fprintf(stdout, "\n");
+        break;
+    }
+    case PROGRESS_MACHINE:
+        fprintf(stdout, "progress name=%s done=%lu total=%lu elapsed=%.3f rate=%.3f eta=%.3f%s\n",
+                p->name, done, p->total, elapsed, rate, eta, last ? " last=1" : "");
+        break;
+    }
+    fflush(stdout);
+}
+
+static void *
+reporter(void *vp)
+{
+    progress *p = vp;
+    struct timespec ts;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PROGRESS_INTERVAL * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+        if (!p->stop)
+            _sample(p, false);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+progress *
+progress_new(const char *name, size_t done, size_t total)
+{
+    progress *p;
+
+    p = my_calloc(1, sizeof p[0]);
+    p->name = name;
+    p->done = done;
+    p->start = done;
+    p->total = total;
+    p->t0 = current_time();
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (g_verbose) {
+        _sample(p, false);
+        p->reporting = pthread_create(&p->reporter, NULL, reporter, p) == 0;
+    }
+    return p;
+}
+
+void
+progress_free(progress *p)
+{
+    if (p == NULL)
+        return;
+    if (p->reporting) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reporter, NULL);
+        _sample(p, true);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+void
+progress_add(progress *p, size_t n)
+{
+    __atomic_fetch_add(&p->done, n, __ATOMIC_RELAXED);
+}
+
+size_t
+progress_done(const progress *p)
+{
+    return __atomic_load_n(&p->done, __ATOMIC_RELAXED);
+}
+
+size_t
+progress_total(const progress *p)
+{
+    return p->total;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Progress of a phase made of many like items, such as encodings.  Workers
+ * count finished items with progress_add, a single atomic add, and when
+ * verbose a reporter thread samples the count at a fixed rate and prints the
+ * fraction done, the rate and the time left.  PROGRESS_MACHINE prints each
+ * sample as one line of key=value pairs instead of a bar.
+ */
+
+enum progress_e {
+    PROGRESS_BAR,
+    PROGRESS_MACHINE,
+};
+extern enum progress_e g_progress;
+
+typedef struct progress progress;
+
+/* |done| of the |total| items are already finished, as when resuming */
+progress * progress_new(const char *name, size_t done, size_t total);
+/* Stops the reporter, printing a last sample */
+void progress_free(progress *p);
+void progress_add(progress *p, size_t n);
+size_t progress_done(const progress *p);
+size_t progress_total(const progress *p);
@@ -0,0 +1,111 @@
+#include "rand_streams.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Substreams sampled per pool job; each substream is keyed anew, which
+ * costs about as much as sampling a unit, so chunks need not be large */
+#define RAND_CHUNK 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;
+} latch;
+
+typedef struct {
+    const rand_streams *rs;
+    size_t first;
+    mpz_ptr *xs;
+    mpz_srcptr *moduli;
+    size_t n;
+    latch *done;
+} units_args;
+
+void
+rand_streams_init(rand_streams *rs, aes_randstate_t rng)
+{
+    mpz_t x, bound;
+    size_t count;
+
+    mpz_inits(x, bound, NULL);
+    mpz_ui_pow_ui(bound, 2, 8 * RAND_SEEDLEN);
+    mpz_urandomm_aes(x, rng, bound);
+    memset(rs->seed, '\0', sizeof rs->seed);
+    mpz_export(rs->seed, &count, -1, 1, 0, 0, x);
+    mpz_clears(x, bound, NULL);
+}
+
+void
+rand_streams_get(aes_randstate_t rng, const rand_streams *rs, size_t i)
+{
+    unsigned char idx[8];
+
+    /* Little-endian, so substreams agree across hosts */
+    for (size_t b = 0; b < sizeof idx; ++b)
+        idx[b] = (unsigned char) ((uint64_t) i >> (8 * b));
+    aes_randinit_seedn(rng, (char *) rs->seed, sizeof rs->seed,
+                       (char *) idx, sizeof idx);
+}
+
+static void
+_units(const rand_streams *rs, size_t first, mpz_ptr *xs, mpz_srcptr *moduli,
+       size_t n)
+{
+    aes_randstate_t rng;
+
+    for (size_t i = 0; i < n; ++i) {
+        rand_streams_get(rng, rs, first + i);
+        mpz_randomm_inv(xs[i], rng, moduli[i]);
+        aes_randclear(rng);
+    }
+}
+
+static void
+units_worker(void *vargs)
+{
+    units_args *args = vargs;
+    latch *done = args->done;
+
+    _units(args->rs, args->first, args->xs, args->moduli, args->n);
+    free(args);
+    pthread_mutex_lock(&done->lock);
+    if (--done->pending == 0)
+        pthread_cond_signal(&done->cond);
+    pthread_mutex_unlock(&done->lock);
+}
+
+void
+rand_streams_units(const rand_streams *rs, size_t first, mpz_ptr *xs,
+                   mpz_srcptr *moduli, size_t n, threadpool *pool,
+                   size_t nthreads)
+{
+    latch done;
+
+    if (pool == NULL || nthreads <= 1 || n <= RAND_CHUNK) {
+        _units(rs, first, xs, moduli, n);
+        return;
+    }
+    pthread_mutex_init(&done.lock, NULL);
+    pthread_cond_init(&done.cond, NULL);
+    done.pending = (n + RAND_CHUNK - 1) / RAND_CHUNK;
+    for (size_t i = 0; i < n; i += RAND_CHUNK) {
+        units_args *args = my_calloc(1, sizeof args[0]);
+        args->rs = rs;
+        args->first = first + i;
+        args->xs = &xs[i];
+        args->moduli = &moduli[i];
+        args->n = n - i < RAND_CHUNK ? n - i : RAND_CHUNK;
+        args->done = &done;
+        threadpool_add_job(pool, units_worker, args);
+    }
+    pthread_mutex_lock(&done.lock);
+    while (done.pending)
+        pthread_cond_wait(&done.cond, &done.lock);
+    pthread_mutex_unlock(&done.lock);
+    pthread_cond_destroy(&done.cond);
+    pthread_mutex_destroy(&done.lock);
+}
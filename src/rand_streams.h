@@ -0,0 +1,29 @@
+#pragma once
+
+#include <aesrand.h>
+#include <gmp.h>
+#include <threadpool.h>
+
+/*
+ * Numbered AES-CTR substreams of one seed.  Substream i is keyed by the
+ * seed and i alone, so whichever thread samples from it, and in whatever
+ * order, it yields the same values: sampling can be spread over workers
+ * while the output stays reproducible for a given seed.
+ */
+
+#define RAND_SEEDLEN 32
+
+typedef struct {
+    unsigned char seed[RAND_SEEDLEN];
+} rand_streams;
+
+/* Draws the seed from |rng| */
+void rand_streams_init(rand_streams *rs, aes_randstate_t rng);
+/* Initializes |rng| to substream |i|; free it with aes_randclear */
+void rand_streams_get(aes_randstate_t rng, const rand_streams *rs, size_t i);
+/* Samples each xs[i] as a unit modulo moduli[i] from substream first + i.
+ * Spreads the work over |pool| if given and waits for it, so jobs already
+ * queued there delay it; otherwise samples inline */
+void rand_streams_units(const rand_streams *rs, size_t first, mpz_ptr *xs,
+                        mpz_srcptr *moduli, size_t n, threadpool *pool,
+                        size_t nthreads);
@@ -0,0 +1,640 @@
+#include "sched.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum sched_e g_sched = SCHED_ACIRC;
+
+typedef enum {
+    NODE_NONE = 0,
+    NODE_INPUT,
+    NODE_CONST,
+    NODE_GATE,
+} node_e;
+
+typedef struct {
+    node_e kind;
+    acirc_op op;
+    size_t i;                   /* input or constant index */
+    long val;
+    size_t x, y;
+} node;
+
+/* The circuit as acirc_traverse presents it, plus who reads each ref */
+typedef struct {
+    size_t nrefs;
+    size_t nnodes;
+    size_t noutputs;
+    node *nodes;                /* [nrefs] */
+    size_t *order;              /* [nnodes] operands before gates */
+    size_t *outrefs;            /* [noutputs] */
+    size_t *cstart;             /* [nrefs + 1] into consumers */
+    size_t *consumers;          /* gates reading each ref, once per operand */
+    size_t *ostart;             /* [nrefs + 1] into outs */
+    size_t *outs;               /* outputs reading each ref */
+    size_t *prio;               /* [nrefs] cost of the longest path to an output */
+    size_t *pos;                /* [nrefs] place in Sethi-Ullman order */
+} graph;
+
+struct sched_graph {
+    acirc_t *circ;
+    size_t *extra;              /* [nrefs], or NULL */
+    bool built;                 /* requires the lock */
+    pthread_mutex_t lock;
+    graph g;
+};
+
+typedef struct worker {
+    struct run *run;
+    size_t id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t *heap;               /* ready refs, soonest first by _before */
+    size_t nheap;
+    size_t cap;
+    unsigned int seed;
+    size_t nsteals;
+} worker;
+
+typedef struct run {
+    const graph *g;
+    acirc_input_f input_f;
+    acirc_const_f const_f;
+    acirc_eval_f eval_f;
+    acirc_output_f output_f;
+    acirc_free_f free_f;
+    void *args;
+    void **values;              /* [nrefs] */
+    void **results;             /* [noutputs] */
+    size_t *pending;            /* [nrefs] operands not yet computed */
+    size_t *uses;               /* [nrefs] reads not yet done */
+    worker *workers;
+    size_t nworkers;
+    size_t nqueued;
+    size_t ncompleted;
+    size_t nidle;
+    size_t nlive;
+    size_t peak;
+    bool shared;                /* all ready refs go to worker 0's heap */
+    bool failed;                /* a heap could not grow */
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} run;
+
+static void *
+record_input_f(size_t ref, size_t i, void *args_)
+{
+    graph *g = args_;
+    g->nodes[ref] = (node) { .kind = NODE_INPUT, .i = i };
+    g->order[g->nnodes++] = ref;
+    return (void *) 1;
+}
+
+static void *
+record_const_f(size_t ref, size_t i, long val, void *args_)
+{
+    graph *g = args_;
+    g->nodes[ref] = (node) { .kind = NODE_CONST, .i = i, .val = val };
+    g->order[g->nnodes++] = ref;
+    return (void *) 1;
+}
+
+static void *
+record_eval_f(size_t ref, acirc_op op, size_t xref, const void *x, size_t yref,
+              const void *y, void *args_)
+{
+    (void) x; (void) y;
+    graph *g = args_;
+    g->nodes[ref] = (node) { .kind = NODE_GATE, .op = op, .x = xref, .y = yref };
+    g->order[g->nnodes++] = ref;
+    return (void *) 1;
+}
+
+static void *
+record_output_f(size_t ref, size_t o, void *x, void *args_)
+{
+    (void) x;
+    graph *g = args_;
+    g->outrefs[o] = ref;
+    return NULL;
+}
+
+static void
+record_free_f(void *x, void *args_)
+{
+    (void) x; (void) args_;
+}
+
+static size_t
+_cost(const node *n, const size_t *extra, size_t ref)
+{
+    const size_t cost = extra ? extra[ref] : 0;
+    if (n->kind != NODE_GATE)
+        return cost + SCHED_COST_LEAF;
+    return cost + (n->op == ACIRC_OP_MUL ? SCHED_COST_MUL : SCHED_COST_ADD);
+}
+
+/* Numbers the refs in post-order from the outputs, visiting first the
+ * operand whose Sethi-Ullman label (the number of values live while it is
+ * computed, counting the circuit as a tree) is larger */
+static void
+_order(graph *g)
+{
+    size_t *label, *stack, nstack = 0, next = 0;
+    unsigned char *state;
+
+    label = my_calloc(g->nrefs, sizeof label[0]);
+    for (size_t i = 0; i < g->nnodes; ++i) {
+        const size_t ref = g->order[i];
+        const node *n = &g->nodes[ref];
+        if (n->kind != NODE_GATE) {
+            label[ref] = 1;
+        } else if (n->x == n->y) {
+            label[ref] = label[n->x];
+        } else {
+            const size_t a = label[n->x], b = label[n->y];
+            label[ref] = a == b ? a + 1 : (a > b ? a : b);
+        }
+    }
+    state = my_calloc(g->nrefs, sizeof state[0]);
+    stack = my_calloc(2 * g->nrefs + g->noutputs + 1, sizeof stack[0]);
+    for (size_t o = g->noutputs; o-- > 0;)
+        stack[nstack++] = g->outrefs[o];
+    while (nstack) {
+        const size_t ref = stack[nstack - 1];
+        const node *n = &g->nodes[ref];
+        if (state[ref] == 0) {
+            state[ref] = 1;
+            if (n->kind == NODE_GATE) {
+                /* The larger operand goes on top, so is visited first */
+                const bool xfirst = label[n->x] >= label[n->y];
+                const size_t first = xfirst ? n->x : n->y;
+                const size_t second = xfirst ? n->y : n->x;
+                if (state[second] == 0)
+                    stack[nstack++] = second;
+                if (state[first] == 0)
+                    stack[nstack++] = first;
+            }
+        } else {
+            nstack--;
+            if (state[ref] == 1) {
+                state[ref] = 2;
+                g->pos[ref] = next++;
+            }
+        }
+    }
+    /* Refs no output reads go last */
+    for (size_t i = 0; i < g->nnodes; ++i)
+        if (state[g->order[i]] == 0)
+            g->pos[g->order[i]] = next++;
+    free(label);
+    free(state);
+    free(stack);
+}
+
+static void
+graph_init(graph *g, acirc_t *circ, const size_t *extra, bool live)
+{
+    size_t *fill;
+
+    memset(g, '\0', sizeof g[0]);
+    g->nrefs = acirc_nrefs(circ);
+    g->noutputs = acirc_noutputs(circ);
+    g->nodes = my_calloc(g->nrefs, sizeof g->nodes[0]);
+    g->order = my_calloc(g->nrefs, sizeof g->order[0]);
+    g->outrefs = my_calloc(g->noutputs, sizeof g->outrefs[0]);
+    /* Gates are visited after their operands, which a single thread guarantees */
+    free(acirc_traverse(circ, record_input_f, record_const_f, record_eval_f,
+                        record_output_f, record_free_f, g, 1));
+
+    g->cstart = my_calloc(g->nrefs + 1, sizeof g->cstart[0]);
+    g->ostart = my_calloc(g->nrefs + 1, sizeof g->ostart[0]);
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        if (g->nodes[ref].kind == NODE_GATE) {
+            g->cstart[g->nodes[ref].x + 1]++;
+            g->cstart[g->nodes[ref].y + 1]++;
+        }
+    }
+    for (size_t o = 0; o < g->noutputs; ++o)
+        g->ostart[g->outrefs[o] + 1]++;
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        g->cstart[ref + 1] += g->cstart[ref];
+        g->ostart[ref + 1] += g->ostart[ref];
+    }
+    g->consumers = my_calloc(g->cstart[g->nrefs] + 1, sizeof g->consumers[0]);
+    g->outs = my_calloc(g->ostart[g->nrefs] + 1, sizeof g->outs[0]);
+    fill = my_calloc(g->nrefs, sizeof fill[0]);
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        if (g->nodes[ref].kind == NODE_GATE) {
+            const size_t x = g->nodes[ref].x, y = g->nodes[ref].y;
+            g->consumers[g->cstart[x] + fill[x]++] = ref;
+            g->consumers[g->cstart[y] + fill[y]++] = ref;
+        }
+    }
+    memset(fill, '\0', g->nrefs * sizeof fill[0]);
+    for (size_t o = 0; o < g->noutputs; ++o)
+        g->outs[g->ostart[g->outrefs[o]] + fill[g->outrefs[o]]++] = o;
+    free(fill);
+
+    g->pos = my_calloc(g->nrefs, sizeof g->pos[0]);
+    _order(g);
+    g->prio = my_calloc(g->nrefs, sizeof g->prio[0]);
+    for (size_t i = g->nnodes; !live && i-- > 0;) {
+        const size_t ref = g->order[i];
+        size_t longest = 0;
+        for (size_t c = g->cstart[ref]; c < g->cstart[ref + 1]; ++c)
+            if (g->prio[g->consumers[c]] > longest)
+                longest = g->prio[g->consumers[c]];
+        g->prio[ref] = longest + _cost(&g->nodes[ref], extra, ref);
+    }
+}
+
+static void
+graph_clear(graph *g)
+{
+    free(g->nodes);
+    free(g->order);
+    free(g->outrefs);
+    free(g->cstart);
+    free(g->consumers);
+    free(g->ostart);
+    free(g->outs);
+    free(g->prio);
+    free(g->pos);
+}
+
+/* Whether ref a should run before ref b */
+static inline bool
+_before(const graph *g, size_t a, size_t b)
+{
+    if (g->prio[a] != g->prio[b])
+        return g->prio[a] > g->prio[b];
+    return g->pos[a] < g->pos[b];
+}
+
+/* Requires w->lock */
+static int
+_heap_push(worker *w, const graph *g, size_t ref)
+{
+    size_t i;
+
+    if (w->nheap == w->cap) {
+        const size_t cap = w->cap ? 2 * w->cap : 64;
+        size_t *heap;
+        if ((heap = my_realloc(w->heap, cap * sizeof heap[0])) == NULL)
+            return ERR;
+        w->heap = heap;
+        w->cap = cap;
+    }
+    /* Thieves peek at nheap without the lock */
+    __atomic_store_n(&w->nheap, w->nheap + 1, __ATOMIC_RELAXED);
+    for (i = w->nheap - 1; i > 0 && _before(g, ref, w->heap[(i - 1) / 2]); i = (i - 1) / 2)
+        w->heap[i] = w->heap[(i - 1) / 2];
+    w->heap[i] = ref;
+    return OK;
+}
+
+/* Requires w->lock */
+static bool
+_heap_pop(worker *w, const graph *g, size_t *ref)
+{
+    size_t last, i = 0;
+
+    if (w->nheap == 0)
+        return false;
+    *ref = w->heap[0];
+    __atomic_store_n(&w->nheap, w->nheap - 1, __ATOMIC_RELAXED);
+    last = w->heap[w->nheap];
+    while (2 * i + 1 < w->nheap) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < w->nheap && _before(g, w->heap[child + 1], w->heap[child]))
+            child++;
+        if (!_before(g, w->heap[child], last))
+            break;
+        w->heap[i] = w->heap[child];
+        i = child;
+    }
+    w->heap[i] = last;
+    return true;
+}
+
+/* Stops the run: workers finish what they hold and then exit */
+static void
+_abort(run *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->failed = true;
+    r->done = true;
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void
+_push(run *r, worker *w, size_t ref)
+{
+    int ret;
+
+    if (r->shared)
+        w = &r->workers[0];
+    pthread_mutex_lock(&w->lock);
+    ret = _heap_push(w, r->g, ref);
+    pthread_mutex_unlock(&w->lock);
+    if (ret == ERR) {
+        _abort(r);
+        return;
+    }
+    __sync_add_and_fetch(&r->nqueued, 1);
+    if (__sync_fetch_and_add(&r->nidle, 0)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static bool
+_take(run *r, worker *w, size_t *ref)
+{
+    bool found;
+
+    pthread_mutex_lock(&w->lock);
+    found = _heap_pop(w, r->g, ref);
+    pthread_mutex_unlock(&w->lock);
+    if (found)
+        __sync_sub_and_fetch(&r->nqueued, 1);
+    return found;
+}
+
+static bool
+_steal(run *r, worker *w, size_t *ref)
+{
+    const size_t start = rand_r(&w->seed) % r->nworkers;
+
+    for (size_t i = 0; i < r->nworkers; ++i) {
+        worker *victim = &r->workers[(start + i) % r->nworkers];
+        if (victim == w || __atomic_load_n(&victim->nheap, __ATOMIC_RELAXED) == 0)
+            continue;
+        if (_take(r, victim, ref)) {
+            w->nsteals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+_free(run *r, void *x)
+{
+    r->free_f(x, r->args);
+    __sync_sub_and_fetch(&r->nlive, 1);
+}
+
+static void
+_release(run *r, size_t ref)
+{
+    if (__sync_sub_and_fetch(&r->uses[ref], 1) == 0 && r->values[ref])
+        _free(r, r->values[ref]);
+}
+
+static void
+_execute(run *r, worker *w, size_t ref)
+{
+    const graph *g = r->g;
+    const node *n = &g->nodes[ref];
+    void *x = NULL;
+
+    switch (n->kind) {
+    case NODE_INPUT:
+        x = r->input_f(ref, n->i, r->args);
+        break;
+    case NODE_CONST:
+        x = r->const_f(ref, n->i, n->val, r->args);
+        break;
+    case NODE_GATE:
+        x = r->eval_f(ref, n->op, n->x, r->values[n->x], n->y, r->values[n->y],
+                      r->args);
+        break;
+    case NODE_NONE:
+        break;
+    }
+    r->values[ref] = x;
+    if (x) {
+        const size_t nlive = __sync_add_and_fetch(&r->nlive, 1);
+        size_t peak = __atomic_load_n(&r->peak, __ATOMIC_RELAXED);
+        while (nlive > peak && !__sync_bool_compare_and_swap(&r->peak, peak, nlive))
+            peak = __atomic_load_n(&r->peak, __ATOMIC_RELAXED);
+    }
+    for (size_t i = g->ostart[ref]; i < g->ostart[ref + 1]; ++i) {
+        const size_t o = g->outs[i];
+        r->results[o] = r->output_f(ref, o, x, r->args);
+    }
+    /* Readying consumers comes first, as it is what other workers wait on */
+    for (size_t i = g->cstart[ref]; i < g->cstart[ref + 1]; ++i) {
+        const size_t c = g->consumers[i];
+        if (__sync_sub_and_fetch(&r->pending[c], 1) == 0)
+            _push(r, w, c);
+    }
+    for (size_t i = g->ostart[ref]; i < g->ostart[ref + 1]; ++i)
+        _release(r, ref);
+    if (g->cstart[ref] == g->cstart[ref + 1] && g->ostart[ref] == g->ostart[ref + 1]
+        && x != NULL)
+        _free(r, x);
+    if (n->kind == NODE_GATE) {
+        _release(r, n->x);
+        _release(r, n->y);
+    }
+    if (__sync_add_and_fetch(&r->ncompleted, 1) == g->nnodes) {
+        pthread_mutex_lock(&r->lock);
+        r->done = true;
+        pthread_cond_broadcast(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static void *
+sched_worker(void *vw)
+{
+    worker *w = vw;
+    run *r = w->run;
+
+    while (true) {
+        size_t ref;
+        bool done;
+
+        if (_take(r, w, &ref) || _steal(r, w, &ref)) {
+            _execute(r, w, ref);
+            continue;
+        }
+        pthread_mutex_lock(&r->lock);
+        __sync_add_and_fetch(&r->nidle, 1);
+        while (__sync_fetch_and_add(&r->nqueued, 0) == 0 && !r->done)
+            pthread_cond_wait(&r->wake, &r->lock);
+        __sync_sub_and_fetch(&r->nidle, 1);
+        done = r->done;
+        pthread_mutex_unlock(&r->lock);
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+static void **
+_run(const graph *g, acirc_input_f input_f, acirc_const_f const_f,
+     acirc_eval_f eval_f, acirc_output_f output_f, acirc_free_f free_f,
+     void *args, size_t nthreads)
+{
+    run r;
+    size_t nstarted, nsteals = 0;
+
+    memset(&r, '\0', sizeof r);
+    r.g = g;
+    r.input_f = input_f;
+    r.const_f = const_f;
+    r.eval_f = eval_f;
+    r.output_f = output_f;
+    r.free_f = free_f;
+    r.args = args;
+    r.values = my_calloc(g->nrefs, sizeof r.values[0]);
+    r.results = my_calloc(g->noutputs + 1, sizeof r.results[0]);
+    r.pending = my_calloc(g->nrefs, sizeof r.pending[0]);
+    r.uses = my_calloc(g->nrefs, sizeof r.uses[0]);
+    r.nworkers = nthreads;
+    /* Per-worker heaps let workers run ahead on leaves far apart in the
+     * order, so minimising live values takes one heap */
+    r.shared = g_sched == SCHED_LIVE;
+    r.workers = my_calloc(nthreads, sizeof r.workers[0]);
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.wake, NULL);
+    for (size_t ref = 0; ref < g->nrefs; ++ref) {
+        r.uses[ref] = (g->cstart[ref + 1] - g->cstart[ref])
+            + (g->ostart[ref + 1] - g->ostart[ref]);
+        if (g->nodes[ref].kind == NODE_GATE)
+            r.pending[ref] = 2;
+    }
+    for (size_t i = 0; i < nthreads; ++i) {
+        r.workers[i].run = &r;
+        r.workers[i].id = i;
+        r.workers[i].seed = i + 1;
+        pthread_mutex_init(&r.workers[i].lock, NULL);
+    }
+    /* Deal the inputs and constants out round-robin */
+    for (size_t i = 0, w = 0; i < g->nnodes && !r.failed; ++i) {
+        const size_t ref = g->order[i];
+        if (g->nodes[ref].kind != NODE_GATE) {
+            if (_heap_push(&r.workers[r.shared ? 0 : w], g, ref) == ERR)
+                r.failed = true;
+            else
+                r.nqueued++;
+            w = (w + 1) % nthreads;
+        }
+    }
+    if (g->nnodes == 0 || r.failed)
+        r.done = true;
+    /* Workers may set done as soon as they start */
+    const bool start = !r.done;
+
+    /* The calling thread is worker 0 */
+    for (nstarted = 1; nstarted < nthreads && start; ++nstarted) {
+        if (pthread_create(&r.workers[nstarted].thread, NULL, sched_worker,
+                           &r.workers[nstarted]) != 0)
+            break;
+    }
+    if (start && nstarted < nthreads && g_verbose)
+        fprintf(stderr, "  Scheduler: started %lu of %lu workers\n",
+                nstarted, nthreads);
+    (void) sched_worker(&r.workers[0]);
+    for (size_t i = 1; i < nstarted; ++i)
+        pthread_join(r.workers[i].thread, NULL);
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        nsteals += r.workers[i].nsteals;
+        free(r.workers[i].heap);
+        pthread_mutex_destroy(&r.workers[i].lock);
+    }
+    if (r.failed) {
+        /* Values whose readers never ran are still live */
+        for (size_t ref = 0; ref < g->nrefs; ++ref)
+            if (r.values[ref] && r.uses[ref])
+                r.free_f(r.values[ref], r.args);
+        fprintf(stderr, "%s: scheduler ran out of memory\n", errorstr);
+        free(r.results);
+        r.results = NULL;
+    }
+    if (g_verbose)
+        fprintf(stderr, "  Scheduler: %lu gates, %lu workers, %lu steals, "
+                "at most %lu values live\n", g->nnodes, nstarted, nsteals, r.peak);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.wake);
+    free(r.workers);
+    free(r.values);
+    free(r.pending);
+    free(r.uses);
+    return r.results;
+}
+
+sched_graph *
+sched_graph_new(acirc_t *circ, const size_t *extra)
+{
+    sched_graph *sg;
+
+    sg = my_calloc(1, sizeof sg[0]);
+    sg->circ = circ;
+    if (extra) {
+        sg->extra = my_calloc(acirc_nrefs(circ), sizeof sg->extra[0]);
+        memcpy(sg->extra, extra, acirc_nrefs(circ) * sizeof sg->extra[0]);
+    }
+    pthread_mutex_init(&sg->lock, NULL);
+    return sg;
+}
+
+void
+sched_graph_free(sched_graph *sg)
+{
+    if (sg == NULL)
+        return;
+    if (sg->built)
+        graph_clear(&sg->g);
+    pthread_mutex_destroy(&sg->lock);
+    free(sg->extra);
+    free(sg);
+}
+
+void **
+sched_graph_traverse(sched_graph *sg, acirc_input_f input_f,
+                     acirc_const_f const_f, acirc_eval_f eval_f,
+                     acirc_output_f output_f, acirc_free_f free_f, void *args,
+                     size_t nthreads)
+{
+    if (g_sched == SCHED_ACIRC || (nthreads <= 1 && g_sched != SCHED_LIVE))
+        return acirc_traverse(sg->circ, input_f, const_f, eval_f, output_f,
+                              free_f, args, nthreads);
+    if (nthreads == 0)
+        nthreads = 1;
+    pthread_mutex_lock(&sg->lock);
+    if (!sg->built) {
+        graph_init(&sg->g, sg->circ, sg->extra, g_sched == SCHED_LIVE);
+        sg->built = true;
+    }
+    pthread_mutex_unlock(&sg->lock);
+    return _run(&sg->g, input_f, const_f, eval_f, output_f, free_f, args,
+                nthreads);
+}
+
+void **
+sched_traverse(acirc_t *circ, const size_t *extra, acirc_input_f input_f,
+               acirc_const_f const_f, acirc_eval_f eval_f,
+               acirc_output_f output_f, acirc_free_f free_f, void *args,
+               size_t nthreads)
+{
+    sched_graph *sg;
+    void **results;
+
+    sg = sched_graph_new(circ, extra);
+    results = sched_graph_traverse(sg, input_f, const_f, eval_f, output_f,
+                                   free_f, args, nthreads);
+    sched_graph_free(sg);
+    return results;
+}
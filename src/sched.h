@@ -0,0 +1,54 @@
+#pragma once
+
+#include <acirc.h>
+#include <stddef.h>
+
+/*
+ * Circuit traversal with a work-stealing scheduler.  Each worker keeps its
+ * ready gates in a heap ordered by the cost of the longest path from the
+ * gate to an output, and steals the most urgent gate of another worker when
+ * its own heap runs dry, so the critical path is started first and no
+ * worker waits on a shared queue.  Gates on equally long paths go in
+ * Sethi-Ullman order, finishing the operand needing more live values first,
+ * and SCHED_LIVE uses that order alone to keep the fewest values live.  Each
+ * value is freed once its last reader is done.  The callbacks are those of
+ * acirc_traverse, as is the result: the values returned by output_f.
+ */
+
+/* SCHED_ACIRC is the default.  On the ggm and sigma circuits, timed on a
+ * single core, the other two were no faster, and SCHED_STEAL kept up to
+ * eight times as many values live with four threads */
+enum sched_e {
+    SCHED_STEAL,
+    SCHED_LIVE,
+    SCHED_ACIRC,
+};
+extern enum sched_e g_sched;
+
+/* Rough relative costs of evaluating a gate */
+#define SCHED_COST_LEAF 1
+#define SCHED_COST_ADD  1
+#define SCHED_COST_MUL  10
+
+/* Gates are weighted by operation, plus |extra[ref]| if given, for work an
+ * evaluator does alongside a gate (such as raising its operands or checking
+ * an output).  Uses acirc_traverse when g_sched is SCHED_ACIRC, or for a
+ * single thread unless it is SCHED_LIVE.  Returns NULL if the scheduler
+ * runs out of memory */
+void ** sched_traverse(acirc_t *circ, const size_t *extra, acirc_input_f input_f,
+                       acirc_const_f const_f, acirc_eval_f eval_f,
+                       acirc_output_f output_f, acirc_free_f free_f,
+                       void *args, size_t nthreads);
+
+/* The scheduler's view of a circuit, recorded on first use and then kept,
+ * for evaluators that traverse the same circuit many times.  |extra| is
+ * copied */
+typedef struct sched_graph sched_graph;
+
+sched_graph * sched_graph_new(acirc_t *circ, const size_t *extra);
+void sched_graph_free(sched_graph *sg);
+/* As sched_traverse; safe to call concurrently on the same graph */
+void ** sched_graph_traverse(sched_graph *sg, acirc_input_f input_f,
+                             acirc_const_f const_f, acirc_eval_f eval_f,
+                             acirc_output_f output_f, acirc_free_f free_f,
+                             void *args, size_t nthreads);
@@ -0,0 +1,55 @@
+#include "sym.h"
+#include "util.h"
+
+sym_t *
+sym_new(size_t nzs, size_t degree)
+{
+    sym_t *x = my_calloc(1, sizeof x[0]);
+    x->ix = index_set_new(nzs);
+    x->degree = degree;
+    return x;
+}
+
+void
+sym_free_f(void *x_, void *args_)
+{
+    (void) args_;
+    sym_t *x = x_;
+    if (x) {
+        index_set_free(x->ix);
+        free(x);
+    }
+}
+
+sym_t *
+sym_eval(size_t nzs, size_t ref, acirc_op op, const sym_t *x, const sym_t *y,
+         sym_raise_f raise, void *args, bool *failed)
+{
+    sym_t *res = sym_new(nzs, 0);
+
+    switch (op) {
+    case ACIRC_OP_MUL:
+        if (index_set_add(res->ix, x->ix, y->ix) == ERR)
+            *failed = true;
+        res->degree = x->degree + y->degree;
+        break;
+    case ACIRC_OP_ADD:
+    case ACIRC_OP_SUB: {
+        sym_t tmp_x = { index_set_copy(x->ix), x->degree };
+        sym_t tmp_y = { index_set_copy(y->ix), y->degree };
+        if (!index_set_eq(tmp_x.ix, tmp_y.ix)) {
+            index_set *ix = index_set_union(tmp_x.ix, tmp_y.ix);
+            if (raise(&tmp_x, ix, ref, false, args) == ERR
+                || raise(&tmp_y, ix, ref, true, args) == ERR)
+                *failed = true;
+            index_set_free(ix);
+        }
+        index_set_set(res->ix, tmp_x.ix);
+        res->degree = max(tmp_x.degree, tmp_y.degree);
+        index_set_free(tmp_x.ix);
+        index_set_free(tmp_y.ix);
+        break;
+    }
+    }
+    return res;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "index_set.h"
+
+#include <acirc.h>
+#include <stdbool.h>
+
+/*
+ * Symbolic evaluation: a wire carries only the index set and degree its
+ * encoding would have, following the degree rules of the dummy mmap (fresh
+ * encodings have degree one, multiplication adds degrees and addition takes
+ * the maximum).  Schemes supply the inputs, constants and outputs, and how
+ * an operand is raised to a larger index set.
+ */
+
+typedef struct {
+    index_set *ix;
+    size_t degree;
+} sym_t;
+
+/* Raises |x| to |target|, adding one to its degree per multiplication.  |x|
+ * is the first operand of gate |ref|, or the second if |y| is set */
+typedef int (*sym_raise_f)(sym_t *x, const index_set *target, size_t ref,
+                           bool y, void *args);
+
+sym_t * sym_new(size_t nzs, size_t degree);
+/* Usable as the free callback of a traversal */
+void sym_free_f(void *x, void *args);
+/* Evaluates gate |ref| over index sets of |nzs| entries, raising the operands
+ * of an addition to their union with |raise|; sets *failed if a raise fails */
+sym_t * sym_eval(size_t nzs, size_t ref, acirc_op op, const sym_t *x,
+                 const sym_t *y, sym_raise_f raise, void *args, bool *failed);
@@ -169,6 +169,18 @@ my_calloc(size_t nmemb, size_t size)
     return ptr;
 }
 
+/* On failure |ptr| is left allocated, so keep it until the result is checked */
+void *
+my_realloc(void *ptr, size_t size)
+{
+    void *ret;
+    ret = realloc(ptr, size);
+    if (ret == NULL && size)
+        fprintf(stderr, "%s: %s: couldn't allocate %lu bytes!\n",
+                errorstr, __func__, size);
+    return ret;
+}
+
 int
 mpz_fread(mpz_t *x, FILE *fp)
 {